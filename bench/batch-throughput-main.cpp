@@ -0,0 +1,117 @@
+/* Measure throughput of batched sends and batched drains against one message
+ * at a time, for each transport.
+ *
+ * Usage: bench-batch-throughput [messages]
+ *
+ * Batch size 1 is the unbatched baseline: Producer::send on one end and
+ * Consumer::timedReceiveAndProcess on the other. Larger batch sizes use
+ * Producer::sendBatch and Consumer::timedReceiveAndProcessBatch. Prints one
+ * line per (transport, batch size) pair:
+ *   transport batch messages seconds msgs/sec */
+
+#include "ipc/consumer.hpp"
+#include "ipc/producer.hpp"
+#include "ipc/mpsc_ring_transport.hpp"
+#include "ipc/spsc_ring_transport.hpp"
+
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+namespace {
+
+struct Sample {
+    long sequence;
+    char payload[56];
+};
+
+const char* kQueueName = "ipc-bench-batch-throughput";
+
+template <template <typename> class Transport>
+void runProducer (long count, size_t batchSize) {
+    ipc::Producer<Sample, Transport> producer { kQueueName };
+    if (!producer.waitForConsumer(std::chrono::seconds(10))) {
+        _exit(1);
+    }
+    std::vector<Sample> batch(batchSize);
+    for (long i = 0; i < count; i += batchSize) {
+        auto n = std::min<long>(batchSize, count - i);
+        if (batchSize == 1) {
+            producer.send(batch[0]);
+        }
+        else {
+            producer.sendBatch(batch.data(), n);
+        }
+    }
+    _exit(0);
+}
+
+template <template <typename> class Transport>
+void runTrial (const char* transportName, size_t batchSize, long count) {
+    auto pid = fork();
+    if (!pid) {
+        runProducer<Transport>(count, batchSize);
+    }
+
+    long received = 0;
+    std::chrono::steady_clock::time_point start;
+    {
+        ipc::Consumer<Sample, 1024, Transport> consumer { kQueueName };
+        auto timeout = std::chrono::seconds(10);
+        if (batchSize == 1) {
+            auto process = [&] (Sample) {
+                if (!received++) {
+                    start = std::chrono::steady_clock::now();
+                }
+            };
+            while (received < count && consumer.timedReceiveAndProcess(timeout, process))
+                ;
+        }
+        else {
+            auto process = [&] (const Sample*, size_t n) {
+                if (!received) {
+                    start = std::chrono::steady_clock::now();
+                }
+                received += n;
+            };
+            while (received < count && consumer.timedReceiveAndProcessBatch(timeout, process))
+                ;
+        }
+    }
+    auto seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+
+    waitpid(pid, nullptr, 0);
+
+    printf("%-12s %5zu %10ld %8.3f %12.0f\n", transportName, batchSize,
+            received, seconds, received / seconds);
+    fflush(stdout);
+}
+
+template <template <typename> class Transport>
+void runTrials (const char* transportName, long count) {
+    for (size_t batchSize = 1; batchSize <= 1024; batchSize *= 4) {
+        runTrial<Transport>(transportName, batchSize, count);
+    }
+}
+
+}
+
+int main (int argc, char** argv) {
+    boost::log::core::get()->set_filter(
+            boost::log::trivial::severity >= boost::log::trivial::warning);
+
+    long count = argc > 1 ? atol(argv[1]) : 2000000;
+
+    printf("%-12s %5s %10s %8s %12s\n", "transport", "batch", "messages",
+            "seconds", "msgs/sec");
+    runTrials<ipc::MessageQueueTransport>("msg_queue", count / 10);
+    runTrials<ipc::SpscRingTransport>("spsc_ring", count);
+    runTrials<ipc::MpscRingTransport>("mpsc_ring", count);
+}
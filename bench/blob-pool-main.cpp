@@ -0,0 +1,165 @@
+/* Measure the cost of moving large payloads by copying them through queue
+ * slots sized for them, against passing a BlobHandle to a block in a
+ * BlobPool.
+ *
+ * Usage: bench-blob-pool [messages]
+ *
+ * The producer fills in the first and last word of every payload, as a
+ * stand-in for producing it, and the consumer reads them back in place.
+ * Prints one line per (payload size, method) pair:
+ *   bytes method messages seconds msgs/sec GB/sec */
+
+#include "ipc/blob_pool.hpp"
+#include "ipc/consumer.hpp"
+#include "ipc/producer.hpp"
+#include "ipc/spsc_ring_transport.hpp"
+
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+
+namespace {
+
+template <size_t Size>
+struct Frame {
+    long sequence;
+    char payload[Size - 2 * sizeof(long)];
+    long checksum;
+};
+
+const char* kQueueName = "ipc-bench-blob-pool";
+const char* kPoolName = "ipc-bench-blob-pool-blobs";
+const size_t kCapacity = 8;
+
+template <size_t Size>
+void runCopyProducer (long count) {
+    using Msg = Frame<Size>;
+    ipc::Producer<Msg, ipc::SpscRingTransport> producer { kQueueName };
+    if (!producer.waitForConsumer(std::chrono::seconds(10))) {
+        _exit(1);
+    }
+    std::unique_ptr<Msg> frame { new Msg };
+    for (long i = 0; i < count; ++i) {
+        frame->sequence = frame->checksum = i;
+        producer.send(*frame);
+    }
+    _exit(0);
+}
+
+template <size_t Size>
+void runBlobProducer (long count) {
+    ipc::Producer<ipc::BlobHandle, ipc::SpscRingTransport> producer { kQueueName };
+    if (!producer.waitForConsumer(std::chrono::seconds(10))) {
+        _exit(1);
+    }
+    ipc::BlobPool pool { boost::interprocess::open_only, kPoolName };
+    ipc::BlobHandle handle;
+    for (long i = 0; i < count; ++i) {
+        if (!pool.allocate(Size, handle, std::chrono::seconds(10))) {
+            _exit(1);
+        }
+        auto words = static_cast<long*>(pool.data(handle));
+        words[0] = words[Size / sizeof(long) - 1] = i;
+        producer.send(handle);
+    }
+    _exit(0);
+}
+
+void report (size_t size, const char* method, long received, long mismatches,
+        std::chrono::steady_clock::time_point start) {
+    auto seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+    if (mismatches) {
+        fprintf(stderr, "%ld torn payloads\n", mismatches);
+    }
+    printf("%8zu %-6s %9ld %8.3f %10.0f %8.2f\n", size, method, received, seconds,
+            received / seconds, received * double(size) / seconds / 1e9);
+    fflush(stdout);
+}
+
+template <size_t Size>
+void runCopyTrial (long count) {
+    using Msg = Frame<Size>;
+
+    auto pid = fork();
+    if (!pid) {
+        runCopyProducer<Size>(count);
+    }
+
+    long received = 0;
+    long mismatches = 0;
+    std::chrono::steady_clock::time_point start;
+    {
+        ipc::Consumer<Msg, kCapacity, ipc::SpscRingTransport> consumer { kQueueName };
+        auto process = [&] (const Msg& msg) {
+            if (!received++) {
+                start = std::chrono::steady_clock::now();
+            }
+            mismatches += msg.sequence != msg.checksum;
+        };
+        while (received < count &&
+                consumer.timedReceiveAndProcess(std::chrono::seconds(10), process))
+            ;
+    }
+    waitpid(pid, nullptr, 0);
+    report(Size, "copy", received, mismatches, start);
+}
+
+template <size_t Size>
+void runBlobTrial (long count) {
+    ipc::BlobPool::remove(kPoolName);
+    ipc::BlobPool pool { boost::interprocess::create_only, kPoolName, Size, 2 * kCapacity };
+
+    auto pid = fork();
+    if (!pid) {
+        runBlobProducer<Size>(count);
+    }
+
+    long received = 0;
+    long mismatches = 0;
+    std::chrono::steady_clock::time_point start;
+    {
+        ipc::Consumer<ipc::BlobHandle, kCapacity, ipc::SpscRingTransport> consumer { kQueueName };
+        auto process = [&] (const ipc::BlobHandle& handle) {
+            if (!received++) {
+                start = std::chrono::steady_clock::now();
+            }
+            auto words = static_cast<const long*>(pool.data(handle));
+            mismatches += words[0] != words[Size / sizeof(long) - 1];
+            pool.release(handle);
+        };
+        while (received < count &&
+                consumer.timedReceiveAndProcess(std::chrono::seconds(10), process))
+            ;
+    }
+    waitpid(pid, nullptr, 0);
+    ipc::BlobPool::remove(kPoolName);
+    report(Size, "blob", received, mismatches, start);
+}
+
+template <size_t Size>
+void runTrials (long count) {
+    runCopyTrial<Size>(count);
+    runBlobTrial<Size>(count);
+}
+
+}
+
+int main (int argc, char** argv) {
+    boost::log::core::get()->set_filter(
+            boost::log::trivial::severity >= boost::log::trivial::warning);
+
+    long count = argc > 1 ? atol(argv[1]) : 5000;
+
+    printf("%8s %-6s %9s %8s %10s %8s\n", "bytes", "method", "messages", "seconds",
+            "msgs/sec", "GB/sec");
+    runTrials<64 * 1024>(count);
+    runTrials<1024 * 1024>(count);
+    runTrials<4 * 1024 * 1024>(count);
+}
@@ -0,0 +1,144 @@
+/* Measure the consumer's per-message cost with a trivial handler, passed as a
+ * std::function (an indirect call per message) and as a lambda (which the
+ * compiler can inline into the receive loop).
+ *
+ * Usage: bench-handler-dispatch [rounds]
+ *
+ * Each round, a producer process fills the queue and exits, and then the
+ * consumer drains it with the clock running, so the figures are the consumer
+ * side alone, without any cross-process waiting. Prints one line per
+ * (transport, receive function, handler) triple:
+ *   transport receive handler ns/msg */
+
+#include "ipc/consumer.hpp"
+#include "ipc/producer.hpp"
+#include "ipc/mpsc_ring_transport.hpp"
+#include "ipc/spsc_ring_transport.hpp"
+
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <vector>
+
+namespace {
+
+const char* kQueueName = "ipc-bench-handler-dispatch";
+const size_t kQueueSize = 1 << 16;
+
+template <template <typename> class Transport>
+void fill (ipc::Consumer<long, kQueueSize, Transport>&) {
+    auto pid = fork();
+    if (!pid) {
+        ipc::Producer<long, Transport> producer { kQueueName };
+        if (!producer.waitForConsumer(std::chrono::seconds(10))) {
+            _exit(1);
+        }
+        std::vector<long> msgs(kQueueSize);
+        for (size_t i = 0; i < kQueueSize; ++i) {
+            msgs[i] = i;
+        }
+        producer.sendBatch(msgs.data(), msgs.size());
+        _exit(0);
+    }
+    waitpid(pid, nullptr, 0);
+}
+
+/* Drain a full queue rounds times with drain, and return the mean time per
+ * message in nanoseconds. */
+template <template <typename> class Transport, typename Drain>
+double nanosecondsPerMessage (int rounds, Drain drain) {
+    ipc::Consumer<long, kQueueSize, Transport> consumer { kQueueName };
+    std::chrono::steady_clock::duration elapsed { 0 };
+    long received = 0;
+    for (int i = 0; i < rounds; ++i) {
+        fill(consumer);
+        auto start = std::chrono::steady_clock::now();
+        received += drain(consumer);
+        elapsed += std::chrono::steady_clock::now() - start;
+    }
+    if (received != long(rounds * kQueueSize)) {
+        fprintf(stderr, "Received %ld messages, expected %ld\n", received,
+                long(rounds * kQueueSize));
+    }
+    return std::chrono::duration<double, std::nano>(elapsed).count() / received;
+}
+
+template <template <typename> class Transport>
+void runTrials (const char* transportName, int rounds) {
+    using Consumer = ipc::Consumer<long, kQueueSize, Transport>;
+    auto timeout = std::chrono::milliseconds(0);
+    long sum = 0;
+
+    std::function<void(const long&)> function = [&] (const long& msg) { sum += msg; };
+    auto lambda = [&] (const long& msg) { sum += msg; };
+
+    std::function<void(const long*, size_t)> batchFunction =
+        [&] (const long* msgs, size_t n) {
+            for (size_t i = 0; i < n; ++i) {
+                sum += msgs[i];
+            }
+        };
+    auto batchLambda = [&] (const long* msgs, size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            sum += msgs[i];
+        }
+    };
+
+    printf("%-12s %-8s %-14s %8.1f\n", transportName, "single", "std::function",
+            nanosecondsPerMessage<Transport>(rounds, [&] (Consumer& consumer) {
+                long n = 0;
+                while (consumer.timedReceiveAndProcess(timeout, function)) {
+                    ++n;
+                }
+                return n;
+            }));
+    printf("%-12s %-8s %-14s %8.1f\n", transportName, "single", "lambda",
+            nanosecondsPerMessage<Transport>(rounds, [&] (Consumer& consumer) {
+                long n = 0;
+                while (consumer.timedReceiveAndProcess(timeout, lambda)) {
+                    ++n;
+                }
+                return n;
+            }));
+    printf("%-12s %-8s %-14s %8.1f\n", transportName, "batch", "std::function",
+            nanosecondsPerMessage<Transport>(rounds, [&] (Consumer& consumer) {
+                long n = 0;
+                while (size_t count = consumer.timedReceiveAndProcessBatch(timeout, batchFunction)) {
+                    n += count;
+                }
+                return n;
+            }));
+    printf("%-12s %-8s %-14s %8.1f\n", transportName, "batch", "lambda",
+            nanosecondsPerMessage<Transport>(rounds, [&] (Consumer& consumer) {
+                long n = 0;
+                while (size_t count = consumer.timedReceiveAndProcessBatch(timeout, batchLambda)) {
+                    n += count;
+                }
+                return n;
+            }));
+    fflush(stdout);
+
+    /* Keep the handlers' work observable. */
+    if (sum == 42) {
+        printf("\n");
+    }
+}
+
+}
+
+int main (int argc, char** argv) {
+    boost::log::core::get()->set_filter(
+            boost::log::trivial::severity >= boost::log::trivial::warning);
+
+    int rounds = argc > 1 ? atoi(argv[1]) : 16;
+
+    printf("%-12s %-8s %-14s %8s\n", "transport", "receive", "handler", "ns/msg");
+    runTrials<ipc::SpscRingTransport>("spsc_ring", rounds);
+    runTrials<ipc::MpscRingTransport>("mpsc_ring", rounds);
+}
@@ -0,0 +1,84 @@
+/* Measure the throughput of a journal, with a writer process and a reader
+ * process, at different commit intervals.
+ *
+ * Usage: bench-journal-throughput [messages] [directory]
+ *
+ * The journal lives in directory (default: a fresh one under /tmp), which
+ * should be on the disk of interest. An interval of 0 syncs every message,
+ * so it sends a hundredth as many. Prints, per interval:
+ *   interval_ms messages seconds msgs/sec */
+
+#include "ipc/journal.hpp"
+
+#include <boost/filesystem.hpp>
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+namespace {
+
+struct Record {
+    long sequence;
+    char payload[56];
+};
+
+void runWriter (const std::string& directory, long interval, long count) {
+    {
+        ipc::JournalWriter<Record> writer { directory, std::chrono::milliseconds(interval) };
+        Record record = { };
+        for (long i = 0; i < count; ++i) {
+            record.sequence = i;
+            writer.send(record);
+        }
+    }
+    _exit(0);
+}
+
+}
+
+int main (int argc, char** argv) {
+    boost::log::core::get()->set_filter(
+            boost::log::trivial::severity >= boost::log::trivial::warning);
+
+    long messages = argc > 1 ? atol(argv[1]) : 1000000;
+    std::string root = argc > 2 ? argv[2] : "/tmp/ipc-bench-journal";
+
+    printf("%11s %9s %8s %10s\n", "interval_ms", "messages", "seconds", "msgs/sec");
+    for (long interval : { 0, 1, 10, 100 }) {
+        auto directory = root + "-" + std::to_string(interval);
+        boost::filesystem::remove_all(directory);
+        auto count = interval ? messages : std::max(messages / 100, 1L);
+
+        long received = 0;
+        auto start = std::chrono::steady_clock::now();
+        {
+            ipc::JournalReader<Record> reader { directory, std::chrono::milliseconds(interval) };
+            auto pid = fork();
+            if (!pid) {
+                runWriter(directory, interval, count);
+            }
+            while (received < count &&
+                    reader.timedReceiveAndProcess(std::chrono::seconds(10), [&] (const Record& record) {
+                        if (record.sequence != received) {
+                            fprintf(stderr, "message %ld arrived as %ld\n", received, record.sequence);
+                            exit(1);
+                        }
+                        ++received;
+                    }))
+                ;
+            waitpid(pid, nullptr, 0);
+        }
+        auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        boost::filesystem::remove_all(directory);
+
+        printf("%11ld %9ld %8.3f %10.0f\n", interval, received, seconds, received / seconds);
+        fflush(stdout);
+    }
+}
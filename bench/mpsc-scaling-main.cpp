@@ -0,0 +1,102 @@
+/* Measure SharedProducer fan-in throughput as the number of producer
+ * processes grows, for the message_queue transport and the lock-free MPSC
+ * ring.
+ *
+ * Usage: bench-mpsc-scaling [messages-per-producer] [max-producers]
+ *
+ * Prints one line per (transport, producer count) pair:
+ *   transport producers messages seconds msgs/sec */
+
+#include "ipc/consumer.hpp"
+#include "ipc/producer.hpp"
+#include "ipc/mpsc_ring_transport.hpp"
+
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+namespace {
+
+struct Sample {
+    int producer;
+    int sequence;
+    char payload[24];
+};
+
+const char* kQueueName = "ipc-bench-mpsc-scaling";
+
+template <template <typename> class Transport>
+void runProducer (int id, int count) {
+    ipc::SharedProducer<Sample, Transport> producer { kQueueName };
+    if (!producer.waitForConsumer(std::chrono::seconds(10))) {
+        _exit(1);
+    }
+    Sample sample = { id, 0, { 0 } };
+    for (int i = 0; i < count; ++i) {
+        sample.sequence = i;
+        producer.send(sample);
+    }
+    _exit(0);
+}
+
+template <template <typename> class Transport>
+void runTrial (const char* transportName, int nProducers, int perProducer) {
+    std::vector<pid_t> children;
+    for (int i = 0; i < nProducers; ++i) {
+        auto pid = fork();
+        if (!pid) {
+            runProducer<Transport>(i, perProducer);
+        }
+        children.push_back(pid);
+    }
+
+    long total = long(nProducers) * perProducer;
+    long received = 0;
+    std::chrono::steady_clock::time_point start;
+    {
+        ipc::Consumer<Sample, 1024, Transport> consumer { kQueueName };
+        auto count = [&] (Sample) {
+            if (!received++) {
+                start = std::chrono::steady_clock::now();
+            }
+        };
+        while (received < total &&
+                consumer.timedReceiveAndProcess(std::chrono::seconds(10), count))
+            ;
+    }
+    auto seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+
+    for (auto pid : children) {
+        waitpid(pid, nullptr, 0);
+    }
+
+    printf("%-12s %4d %10ld %8.3f %12.0f\n", transportName, nProducers,
+            received, seconds, received / seconds);
+    fflush(stdout);
+}
+
+}
+
+int main (int argc, char** argv) {
+    boost::log::core::get()->set_filter(
+            boost::log::trivial::severity >= boost::log::trivial::warning);
+
+    int perProducer = argc > 1 ? atoi(argv[1]) : 100000;
+    int maxProducers = argc > 2 ? atoi(argv[2]) : 16;
+
+    printf("%-12s %4s %10s %8s %12s\n", "transport", "prod", "messages",
+            "seconds", "msgs/sec");
+    for (int n = 1; n <= maxProducers; n *= 2) {
+        runTrial<ipc::MessageQueueTransport>("msg_queue", n, perProducer);
+    }
+    for (int n = 1; n <= maxProducers; n *= 2) {
+        runTrial<ipc::MpscRingTransport>("mpsc_ring", n, perProducer);
+    }
+}
@@ -0,0 +1,140 @@
+/* Measure the latency of control messages sent while a bulk producer keeps
+ * the queue saturated, with one shared lane, and with a separate urgent lane
+ * drained by strict priority and by weight.
+ *
+ * Usage: bench-priority-lanes [control messages]
+ *
+ * A bulk producer process sends as fast as it can, and the consumer spends a
+ * couple of microseconds on each bulk message, so the bulk lane stays full. A
+ * control producer process sends one timestamped message per millisecond.
+ * Prints one line per transport with percentiles of the control messages'
+ * send-to-handler latency:
+ *   transport p50(us) p99(us) max(us) bulk-msgs */
+
+#include "ipc/consumer.hpp"
+#include "ipc/producer.hpp"
+#include "ipc/lane_transport.hpp"
+#include "ipc/mpsc_ring_transport.hpp"
+
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace {
+
+struct Sample {
+    long control;
+    long sentNanoseconds;
+    char payload[48];
+};
+
+const char* kQueueName = "ipc-bench-priority-lanes";
+
+long nowNanoseconds () {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+template <typename Producer>
+void sendControl (Producer& producer, const Sample& msg, std::true_type) {
+    producer.send(msg, 1);
+}
+
+template <typename Producer>
+void sendControl (Producer& producer, const Sample& msg, std::false_type) {
+    producer.send(msg);
+}
+
+template <template <typename> class Transport, bool Laned>
+void runTrial (const char* transportName, long count) {
+    auto bulkPid = fork();
+    if (!bulkPid) {
+        ipc::SharedProducer<Sample, Transport> producer { kQueueName };
+        if (!producer.waitForConsumer(std::chrono::seconds(10))) {
+            _exit(1);
+        }
+        Sample msg = { 0, 0, { } };
+        try {
+            while (true) {
+                producer.send(msg);
+            }
+        }
+        catch (ipc::NoConsumer&) {
+        }
+        _exit(0);
+    }
+
+    auto controlPid = fork();
+    if (!controlPid) {
+        ipc::SharedProducer<Sample, Transport> producer { kQueueName };
+        if (!producer.waitForConsumer(std::chrono::seconds(10))) {
+            _exit(1);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        for (long i = 0; i < count; ++i) {
+            Sample msg = { 1, nowNanoseconds(), { } };
+            sendControl(producer, msg, std::integral_constant<bool, Laned>());
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        _exit(0);
+    }
+
+    std::vector<double> latencies;
+    long bulk = 0;
+    {
+        ipc::Consumer<Sample, 1024, Transport> consumer { kQueueName };
+        auto process = [&] (const Sample& msg) {
+            if (msg.control) {
+                latencies.push_back((nowNanoseconds() - msg.sentNanoseconds) / 1e3);
+                return;
+            }
+            ++bulk;
+            auto until = nowNanoseconds() + 2000;
+            while (nowNanoseconds() < until)
+                ;
+        };
+        while (long(latencies.size()) < count &&
+                consumer.timedReceiveAndProcess(std::chrono::seconds(10), process))
+            ;
+    }
+
+    waitpid(controlPid, nullptr, 0);
+    waitpid(bulkPid, nullptr, 0);
+
+    if (latencies.empty()) {
+        fprintf(stderr, "%s: no control messages received\n", transportName);
+        return;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&] (double p) {
+        return latencies[std::min(latencies.size() - 1, size_t(p * latencies.size()))];
+    };
+    printf("%-16s %9.1f %9.1f %9.1f %10ld\n", transportName, percentile(0.5),
+            percentile(0.99), latencies.back(), bulk);
+    fflush(stdout);
+}
+
+}
+
+int main (int argc, char** argv) {
+    boost::log::core::get()->set_filter(
+            boost::log::trivial::severity >= boost::log::trivial::warning);
+
+    long count = argc > 1 ? atol(argv[1]) : 1000;
+
+    printf("%-16s %9s %9s %9s %10s\n", "transport", "p50(us)", "p99(us)", "max(us)",
+            "bulk-msgs");
+    runTrial<ipc::MpscRingTransport, false>("one lane", count);
+    runTrial<ipc::PriorityLanes<2>::Transport, true>("strict lanes", count);
+    runTrial<ipc::WeightedLanes<ipc::MpscRingTransport, 1, 4>::Transport, true>(
+            "weighted 1:4", count);
+}
@@ -0,0 +1,95 @@
+/* Measure the round-trip latency of RpcClient::call against an echo server
+ * in another process.
+ *
+ * Usage: bench-rpc-latency [calls] [spin count]
+ *
+ * Calls are made one at a time, each waited on before the next. Prints the
+ * latency distribution, in microseconds:
+ *   calls p50 p99 p99.9 max calls/sec */
+
+#include "ipc/rpc.hpp"
+
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+namespace {
+
+struct Ping {
+    long sequence;
+    char payload[56];
+};
+
+const char* kServerName = "ipc-bench-rpc-latency";
+
+void runServer () {
+    {
+        ipc::RpcServer<Ping, Ping> server { kServerName };
+        server.startServiceThread([] (const Ping& ping) { return ping; },
+                std::chrono::seconds(10), std::chrono::seconds(1));
+        server.joinServiceThread();
+    }
+    _exit(0);
+}
+
+double percentile (const std::vector<double>& sorted, double p) {
+    auto index = static_cast<size_t>(p / 100 * (sorted.size() - 1) + 0.5);
+    return sorted[index];
+}
+
+}
+
+int main (int argc, char** argv) {
+    boost::log::core::get()->set_filter(
+            boost::log::trivial::severity >= boost::log::trivial::warning);
+
+    long count = argc > 1 ? atol(argv[1]) : 100000;
+    long spin = argc > 2 ? atol(argv[2]) : 1000;
+    long warmup = std::min(count / 10, 10000L);
+
+    auto pid = fork();
+    if (!pid) {
+        runServer();
+    }
+
+    std::vector<double> latencies;
+    latencies.reserve(count);
+    auto start = std::chrono::steady_clock::now();
+    {
+        ipc::RpcClient<Ping, Ping> client { kServerName, std::chrono::seconds(10) };
+        client.setSpinCount(spin);
+        Ping ping = { };
+        for (long i = 0; i < warmup; ++i) {
+            ping.sequence = i;
+            client.call(ping).get();
+        }
+
+        start = std::chrono::steady_clock::now();
+        for (long i = 0; i < count; ++i) {
+            ping.sequence = i;
+            auto sent = std::chrono::steady_clock::now();
+            auto pong = client.call(ping).get();
+            latencies.push_back(std::chrono::duration<double, std::micro>(
+                        std::chrono::steady_clock::now() - sent).count());
+            if (pong.sequence != i) {
+                fprintf(stderr, "call %ld answered with %ld\n", i, pong.sequence);
+                return 1;
+            }
+        }
+    }
+    auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    waitpid(pid, nullptr, 0);
+
+    std::sort(latencies.begin(), latencies.end());
+    printf("%9s %8s %8s %8s %8s %10s\n", "calls", "p50", "p99", "p99.9", "max", "calls/sec");
+    printf("%9ld %8.2f %8.2f %8.2f %8.2f %10.0f\n", count, percentile(latencies, 50),
+            percentile(latencies, 99), percentile(latencies, 99.9), latencies.back(),
+            count / seconds);
+}
@@ -0,0 +1,91 @@
+/* Measure the per-send cost of consumer liveness checking: the lock-file
+ * probe BasicProducer::send used to make on every message, against the
+ * control block epoch load it makes now.
+ *
+ * Usage: bench-send-cost [iterations]
+ *
+ * A consumer process drains an SPSC ring while this process sends to it, so
+ * the send figures include a real cross-process enqueue. */
+
+#include "ipc/consumer.hpp"
+#include "ipc/producer.hpp"
+#include "ipc/spsc_ring_transport.hpp"
+
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+
+namespace {
+
+const char* kQueueName = "ipc-bench-send-cost";
+
+template <typename F>
+double nanosecondsPerOp (long iterations, F f) {
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < iterations; ++i) {
+        f(i);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+}
+
+}
+
+int main (int argc, char** argv) {
+    boost::log::core::get()->set_filter(
+            boost::log::trivial::severity >= boost::log::trivial::warning);
+
+    long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+
+    auto consumerPid = fork();
+    if (!consumerPid) {
+        ipc::Consumer<long, 1024, ipc::SpscRingTransport> consumer { kQueueName };
+        long received = 0;
+        while (received < 2 * iterations &&
+                consumer.timedReceiveAndProcess(std::chrono::seconds(10),
+                    [&] (long) { ++received; }))
+            ;
+        _exit(0);
+    }
+
+    ipc::Producer<long, ipc::SpscRingTransport> producer { kQueueName };
+    if (!producer.waitForConsumer(std::chrono::seconds(10))) {
+        fprintf(stderr, "Consumer no-showed\n");
+        return 1;
+    }
+
+    /* The probe BasicProducer::send used to make: a try_lock on the
+     * consumption lock file, which fails while the consumer is alive. */
+    ipc::tmp_file_lock consumptionMutex { std::string(kQueueName) + IPC_CONSUMER_SUFFIX };
+    auto lockFileProbe = [&] () {
+        if (consumptionMutex.try_lock()) {
+            consumptionMutex.unlock();
+            throw ipc::NoConsumer();
+        }
+    };
+
+    ipc::ChannelControl control { kQueueName };
+    auto epoch = control->consumerEpoch.load();
+    auto epochProbe = [&] () {
+        if (control->consumerEpoch.load(std::memory_order_acquire) != epoch) {
+            throw ipc::NoConsumer();
+        }
+    };
+
+    printf("%-28s %10s\n", "operation", "ns/op");
+    printf("%-28s %10.1f\n", "liveness check (lock file)",
+            nanosecondsPerOp(iterations, [&] (long) { lockFileProbe(); }));
+    printf("%-28s %10.1f\n", "liveness check (epoch)",
+            nanosecondsPerOp(iterations, [&] (long) { epochProbe(); }));
+    printf("%-28s %10.1f\n", "send (lock file + send)",
+            nanosecondsPerOp(iterations, [&] (long i) { lockFileProbe(); producer.send(i); }));
+    printf("%-28s %10.1f\n", "send (epoch + send)",
+            nanosecondsPerOp(iterations, [&] (long i) { producer.send(i); }));
+
+    waitpid(consumerPid, nullptr, 0);
+}
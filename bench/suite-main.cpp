@@ -0,0 +1,210 @@
+/* The benchmark suite: throughput and one-way latency of real producer and
+ * consumer processes, across transports, message sizes, queue capacities,
+ * numbers of producers and handler costs, printed as one JSON object per
+ * trial so that runs can be stored and compared to catch regressions.
+ *
+ * Usage: bench-suite [messages] [max-producers]
+ *
+ * Each sweep varies one parameter from a baseline of a 64-byte message, a
+ * capacity of 1024, one producer, a free handler, and the MPSC ring. Every
+ * trial but the paced one sends flat out, so its latencies include the time
+ * messages spend waiting in a full queue; the paced trial sends at a fixed
+ * rate well within the consumer's reach, for latency without queueing.
+ *
+ * Producers stamp each message with CLOCK_MONOTONIC (steady_clock) as they
+ * send it, and the consumer records the time from stamp to handler in a
+ * LatencyHistogram. Each line looks like
+ *   {"transport":"mpsc_ring","size":64,"capacity":1024,"producers":1,
+ *    "handler_ns":0,"rate":0,"messages":200000,"seconds":0.1,
+ *    "msgs_per_sec":2000000,"latency_ns":{"min":..,"mean":..,"p50":..,
+ *    "p90":..,"p99":..,"p99.9":..,"p99.99":..,"max":..}}
+ * (on one line). */
+
+#include "ipc/consumer.hpp"
+#include "ipc/histogram.hpp"
+#include "ipc/producer.hpp"
+#include "ipc/mpsc_ring_transport.hpp"
+#include "ipc/spsc_ring_transport.hpp"
+
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace {
+
+template <size_t Size>
+struct Sample {
+    static_assert(Size >= 16, "samples need room for their stamp");
+
+    int64_t sentAt;
+    uint32_t producer;
+    uint32_t sequence;
+    char payload[Size - 16];
+};
+
+/* The smallest sample is all stamp: a zero-length payload is not C++. */
+template <>
+struct Sample<16> {
+    int64_t sentAt;
+    uint32_t producer;
+    uint32_t sequence;
+};
+
+struct Trial {
+    size_t capacity;
+    int producers;
+    long handlerNs;
+    long rate;
+    long messages;
+};
+
+const char* kQueueName = "ipc-bench-suite";
+
+int64_t now () {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* Exclusive producers for single-producer transports, shared ones for the
+ * rest. */
+template <typename Msg, template <typename> class Transport>
+using ProducerFor = typename std::conditional<Transport<Msg>::multiProducer,
+        ipc::SharedProducer<Msg, Transport>, ipc::Producer<Msg, Transport>>::type;
+
+template <size_t Size, template <typename> class Transport>
+void runProducer (uint32_t id, long count, long rate) {
+    using Msg = Sample<Size>;
+    ProducerFor<Msg, Transport> producer { kQueueName };
+    if (!producer.waitForConsumer(std::chrono::seconds(10))) {
+        _exit(1);
+    }
+    Msg sample = { };
+    sample.producer = id;
+    auto next = std::chrono::steady_clock::now();
+    auto interval = rate ? std::chrono::nanoseconds(1000000000L / rate) : std::chrono::nanoseconds(0);
+    for (long i = 0; i < count; ++i) {
+        if (rate) {
+            next += interval;
+            std::this_thread::sleep_until(next);
+        }
+        sample.sequence = static_cast<uint32_t>(i);
+        sample.sentAt = now();
+        producer.send(sample);
+    }
+    _exit(0);
+}
+
+template <size_t Size, template <typename> class Transport>
+void runTrial (const char* transportName, const Trial& trial) {
+    using Msg = Sample<Size>;
+
+    auto perProducer = trial.messages / trial.producers;
+    auto perProducerRate = trial.rate / trial.producers;
+    std::vector<pid_t> children;
+    for (int i = 0; i < trial.producers; ++i) {
+        auto pid = fork();
+        if (!pid) {
+            runProducer<Size, Transport>(i, perProducer, perProducerRate);
+        }
+        children.push_back(pid);
+    }
+
+    long total = perProducer * trial.producers;
+    long received = 0;
+    ipc::LatencyHistogram latencies;
+    std::chrono::steady_clock::time_point start;
+    {
+        ipc::Consumer<Msg, 1024, Transport> consumer { kQueueName, trial.capacity };
+        auto process = [&] (const Msg& msg) {
+            if (!received++) {
+                start = std::chrono::steady_clock::now();
+            }
+            if (trial.handlerNs) {
+                auto until = now() + trial.handlerNs;
+                while (now() < until)
+                    ;
+            }
+            latencies.record(std::max<int64_t>(now() - msg.sentAt, 0));
+        };
+        while (received < total &&
+                consumer.timedReceiveAndProcess(std::chrono::seconds(10), process))
+            ;
+    }
+    auto seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+
+    for (auto pid : children) {
+        waitpid(pid, nullptr, 0);
+    }
+
+    printf("{\"transport\":\"%s\",\"size\":%zu,\"capacity\":%zu,\"producers\":%d,"
+            "\"handler_ns\":%ld,\"rate\":%ld,\"messages\":%ld,\"seconds\":%.6f,"
+            "\"msgs_per_sec\":%.0f,\"latency_ns\":{\"min\":%llu,\"mean\":%.0f,"
+            "\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p99.9\":%llu,\"p99.99\":%llu,"
+            "\"max\":%llu}}\n",
+            transportName, Size, trial.capacity, trial.producers, trial.handlerNs,
+            trial.rate, received, seconds, received / seconds,
+            (unsigned long long)latencies.min(), latencies.mean(),
+            (unsigned long long)latencies.valueAtPercentile(50),
+            (unsigned long long)latencies.valueAtPercentile(90),
+            (unsigned long long)latencies.valueAtPercentile(99),
+            (unsigned long long)latencies.valueAtPercentile(99.9),
+            (unsigned long long)latencies.valueAtPercentile(99.99),
+            (unsigned long long)latencies.max());
+    fflush(stdout);
+}
+
+}
+
+int main (int argc, char** argv) {
+    boost::log::core::get()->set_filter(
+            boost::log::trivial::severity >= boost::log::trivial::warning);
+
+    long messages = argc > 1 ? atol(argv[1]) : 200000;
+    int maxProducers = argc > 2 ? atoi(argv[2]) : 4;
+
+    const Trial baseline = { 1024, 1, 0, 0, messages };
+
+    runTrial<64, ipc::MessageQueueTransport>("msg_queue", baseline);
+    runTrial<64, ipc::SpscRingTransport>("spsc_ring", baseline);
+    runTrial<64, ipc::MpscRingTransport>("mpsc_ring", baseline);
+
+    runTrial<16, ipc::MpscRingTransport>("mpsc_ring", baseline);
+    runTrial<256, ipc::MpscRingTransport>("mpsc_ring", baseline);
+    runTrial<1024, ipc::MpscRingTransport>("mpsc_ring", baseline);
+    runTrial<4096, ipc::MpscRingTransport>("mpsc_ring", baseline);
+
+    for (size_t capacity : { 16, 128, 8192 }) {
+        auto trial = baseline;
+        trial.capacity = capacity;
+        runTrial<64, ipc::MpscRingTransport>("mpsc_ring", trial);
+    }
+
+    for (int producers = 2; producers <= maxProducers; producers *= 2) {
+        auto trial = baseline;
+        trial.producers = producers;
+        runTrial<64, ipc::MpscRingTransport>("mpsc_ring", trial);
+    }
+
+    /* Give each handler cost about a second's worth of messages at most. */
+    for (long handlerNs : { 100, 1000, 10000 }) {
+        auto trial = baseline;
+        trial.handlerNs = handlerNs;
+        trial.messages = std::min(messages, 1000000000L / handlerNs);
+        runTrial<64, ipc::MpscRingTransport>("mpsc_ring", trial);
+    }
+
+    auto paced = baseline;
+    paced.rate = 10000;
+    paced.messages = std::min(messages, 20000L);
+    runTrial<64, ipc::MpscRingTransport>("mpsc_ring", paced);
+}
@@ -0,0 +1,118 @@
+/* Measure throughput of large messages sent with send, which copies the
+ * message into the queue, against reserve/commit, which builds it in place.
+ *
+ * Usage: bench-zero-copy [messages]
+ *
+ * The producer fills in the first and last word of every frame, as a stand-in
+ * for building the message, and the consumer reads them back by reference.
+ * Prints one line per (transport, frame size, method) triple:
+ *   transport bytes method messages seconds msgs/sec MB/sec */
+
+#include "ipc/consumer.hpp"
+#include "ipc/producer.hpp"
+#include "ipc/mpsc_ring_transport.hpp"
+#include "ipc/spsc_ring_transport.hpp"
+
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+
+namespace {
+
+template <size_t Size>
+struct Frame {
+    long sequence;
+    char payload[Size - 2 * sizeof(long)];
+    long checksum;
+};
+
+const char* kQueueName = "ipc-bench-zero-copy";
+
+template <typename Msg, template <typename> class Transport>
+void runProducer (long count, bool inPlace) {
+    ipc::Producer<Msg, Transport> producer { kQueueName };
+    if (!producer.waitForConsumer(std::chrono::seconds(10))) {
+        _exit(1);
+    }
+    Msg frame;
+    for (long i = 0; i < count; ++i) {
+        if (inPlace) {
+            auto& msg = producer.reserve();
+            msg.sequence = msg.checksum = i;
+            producer.commit();
+        }
+        else {
+            frame.sequence = frame.checksum = i;
+            producer.send(frame);
+        }
+    }
+    _exit(0);
+}
+
+template <size_t Size, template <typename> class Transport>
+void runTrial (const char* transportName, bool inPlace, long count) {
+    using Msg = Frame<Size>;
+
+    auto pid = fork();
+    if (!pid) {
+        runProducer<Msg, Transport>(count, inPlace);
+    }
+
+    long received = 0;
+    long mismatches = 0;
+    std::chrono::steady_clock::time_point start;
+    {
+        ipc::Consumer<Msg, 64, Transport> consumer { kQueueName };
+        auto process = [&] (const Msg& msg) {
+            if (!received++) {
+                start = std::chrono::steady_clock::now();
+            }
+            mismatches += msg.sequence != msg.checksum;
+        };
+        while (received < count &&
+                consumer.timedReceiveAndProcess(std::chrono::seconds(10), process))
+            ;
+    }
+    auto seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+
+    waitpid(pid, nullptr, 0);
+
+    if (mismatches) {
+        fprintf(stderr, "%ld torn frames\n", mismatches);
+    }
+    printf("%-12s %6zu %-8s %9ld %8.3f %10.0f %9.0f\n", transportName, Size,
+            inPlace ? "reserve" : "send", received, seconds, received / seconds,
+            received * double(Size) / seconds / 1e6);
+    fflush(stdout);
+}
+
+template <template <typename> class Transport>
+void runTrials (const char* transportName, long count) {
+    runTrial<64, Transport>(transportName, false, count);
+    runTrial<64, Transport>(transportName, true, count);
+    runTrial<4096, Transport>(transportName, false, count);
+    runTrial<4096, Transport>(transportName, true, count);
+    runTrial<16384, Transport>(transportName, false, count);
+    runTrial<16384, Transport>(transportName, true, count);
+}
+
+}
+
+int main (int argc, char** argv) {
+    boost::log::core::get()->set_filter(
+            boost::log::trivial::severity >= boost::log::trivial::warning);
+
+    long count = argc > 1 ? atol(argv[1]) : 200000;
+
+    printf("%-12s %6s %-8s %9s %8s %10s %9s\n", "transport", "bytes", "method",
+            "messages", "seconds", "msgs/sec", "MB/sec");
+    runTrials<ipc::MessageQueueTransport>("msg_queue", count);
+    runTrials<ipc::SpscRingTransport>("spsc_ring", count);
+    runTrials<ipc::MpscRingTransport>("mpsc_ring", count);
+}
@@ -0,0 +1,269 @@
+#ifndef IPC_BLOB_POOL_HPP
+#define IPC_BLOB_POOL_HPP
+
+#include "common.hpp"
+#include "errors.hpp"
+#include "event_count.hpp"
+#include "shm_segment.hpp"
+
+#include <boost/interprocess/creation_tags.hpp>
+#include <boost/interprocess/exceptions.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <string>
+#include <utility>
+
+#include <cstdint>
+
+namespace ipc {
+
+/* Names a block in a BlobPool. A handle is a small standard-layout value, so
+ * it can be sent through any queue in place of the payload itself. */
+struct BlobHandle {
+    uint32_t block;
+    uint32_t generation;
+    uint64_t size;
+};
+
+/* A pool of fixed-size blocks in a POSIX shared memory segment, for payloads
+ * too large to copy through queue slots (camera frames, multi-megabyte
+ * buffers). A producer allocates a block, fills it in place, and sends its
+ * BlobHandle through an ordinary queue; the consumer looks the handle up with
+ * data and releases it when done with it. The payload itself is never
+ * copied, so the cost of a transfer does not depend on its size.
+ *
+ * Blocks are reference counted: allocate returns a block with one reference,
+ * retain adds one (say, to hand the same block to several consumers), and
+ * release drops one, returning the block to the pool when none remain. The
+ * free list is a lock-free stack in the segment, and a producer waiting for
+ * a free block sleeps on an EventCount which release signals.
+ *
+ * Either side may create the pool, with create_only, and the other opens it
+ * by name with open_only, as with a queue's transport. Blocks held by a
+ * process which crashes are not reclaimed until the pool is recreated. */
+class BlobPool {
+public:
+    static bool remove (const char* name) {
+        return ShmSegment::remove(name);
+    }
+
+    /* Create a pool of blockCount blocks of at least blockSize bytes each.
+     * options are SegmentOption flags, as for a queue.
+     *
+     * Throws QueueError if the segment cannot be created. */
+    BlobPool (boost::interprocess::create_only_t, const char* name,
+            size_t blockSize, size_t blockCount, unsigned options = 0) {
+        using namespace boost::interprocess;
+        using std::swap;
+        if (!blockCount || blockCount >= kNil) {
+            throw QueueError("Invalid blob pool size");
+        }
+        blockSize = (blockSize + IPC_CACHE_LINE_SIZE - 1) & ~size_t(IPC_CACHE_LINE_SIZE - 1);
+        try {
+            ShmSegment segment { create_only, name, segmentSize(blockSize, blockCount), options };
+            swap(mSegment, segment);
+        }
+        catch (interprocess_exception& exc) {
+            throw QueueError(std::string("Unable to create blob pool named ") + name);
+        }
+
+        mHeader = new (mSegment.address()) Header();
+        mHeader->blockSize = blockSize;
+        mHeader->blockCount = static_cast<uint32_t>(blockCount);
+        mHeader->options = options;
+        attach();
+        for (uint32_t i = 0; i < blockCount; ++i) {
+            new (&mBlocks[i]) Block();
+            mBlocks[i].next.store(i + 1 < blockCount ? i + 1 : kNil,
+                    std::memory_order_relaxed);
+        }
+        mHeader->freeList.store(0, std::memory_order_relaxed);
+        mHeader->magic.store(kMagic, std::memory_order_release);
+    }
+
+    /* Throws QueueError if the segment does not exist or is not a blob
+     * pool. */
+    BlobPool (boost::interprocess::open_only_t, const char* name) {
+        using namespace boost::interprocess;
+        using std::swap;
+        try {
+            ShmSegment segment { open_only, name };
+            swap(mSegment, segment);
+        }
+        catch (interprocess_exception& exc) {
+            throw QueueError(std::string("Unable to open blob pool named ") + name);
+        }
+
+        mHeader = static_cast<Header*>(mSegment.address());
+        if (mSegment.size() < sizeof(Header) ||
+                mHeader->magic.load(std::memory_order_acquire) != kMagic ||
+                mSegment.size() < segmentSize(mHeader->blockSize, mHeader->blockCount)) {
+            throw QueueError(std::string(name) + " is not a blob pool");
+        }
+        mSegment.applyOptions(mHeader->options);
+        attach();
+    }
+
+    BlobPool (const BlobPool&) = delete;
+    BlobPool& operator= (const BlobPool&) = delete;
+
+    size_t blockSize () const {
+        return mBlockSize;
+    }
+
+    size_t blockCount () const {
+        return mBlockCount;
+    }
+
+    /* Allocate a block for a payload of size bytes, without blocking.
+     * Returns false if every block is in use.
+     *
+     * Throws QueueError if size exceeds the block size. */
+    bool tryAllocate (size_t size, BlobHandle& handle) {
+        checkSize(size);
+        return pop(size, handle);
+    }
+
+    /* Allocate a block for a payload of size bytes, waiting up to timeout for
+     * one to be released. Returns false on timeout.
+     *
+     * Throws QueueError if size exceeds the block size. */
+    template <typename Rep, typename Period>
+    bool allocate (size_t size, BlobHandle& handle,
+            std::chrono::duration<Rep, Period> timeout) {
+        checkSize(size);
+        return mHeader->freed.waitFor([&] () { return pop(size, handle); }, timeout);
+    }
+
+    /* The block's memory, which is blockSize () bytes long and aligned to a
+     * cache line. A handle is only valid between its allocation and its last
+     * release.
+     *
+     * Throws QueueError if handle does not name a block in this pool. */
+    void* data (const BlobHandle& handle) {
+        return mData + checkBlock(handle) * mBlockSize;
+    }
+
+    const void* data (const BlobHandle& handle) const {
+        return mData + checkBlock(handle) * mBlockSize;
+    }
+
+    void retain (const BlobHandle& handle) {
+        block(handle).refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /* Drop a reference to the block, freeing it if it was the last. */
+    void release (const BlobHandle& handle) {
+        auto& b = block(handle);
+        if (b.refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            b.generation.fetch_add(1, std::memory_order_relaxed);
+            push(handle.block);
+            mHeader->freed.notifyAll();
+        }
+    }
+
+private:
+    static const uint32_t kMagic = 0x424c4f42; /* "BLOB" */
+    static const uint32_t kNil = 0xffffffff;
+
+    struct Header {
+        std::atomic<uint32_t> magic;
+        uint32_t blockCount;
+        uint64_t blockSize;
+        uint32_t options;
+
+        /* The index of the first free block in the low 32 bits, and a count
+         * of pops in the high 32 bits, so a block which is popped and pushed
+         * back between another popper's load and compare-exchange does not
+         * fool it (the ABA problem). */
+        alignas(IPC_CACHE_LINE_SIZE) std::atomic<uint64_t> freeList;
+        alignas(IPC_CACHE_LINE_SIZE) EventCount freed;
+    };
+
+    struct Block {
+        std::atomic<uint32_t> refs;
+        std::atomic<uint32_t> generation;
+        std::atomic<uint32_t> next;
+    };
+
+    static size_t segmentSize (size_t blockSize, size_t blockCount) {
+        return dataOffset(blockCount) + blockSize * blockCount;
+    }
+
+    static size_t dataOffset (size_t blockCount) {
+        auto end = sizeof(Header) + blockCount * sizeof(Block);
+        return (end + IPC_CACHE_LINE_SIZE - 1) & ~size_t(IPC_CACHE_LINE_SIZE - 1);
+    }
+
+    void attach () {
+        mBlockSize = mHeader->blockSize;
+        mBlockCount = mHeader->blockCount;
+        mBlocks = reinterpret_cast<Block*>(mHeader + 1);
+        mData = static_cast<unsigned char*>(mSegment.address()) + dataOffset(mBlockCount);
+    }
+
+    void checkSize (size_t size) const {
+        if (size > mBlockSize) {
+            throw QueueError("Blob of " + std::to_string(size) +
+                    " bytes exceeds block size of " + std::to_string(mBlockSize));
+        }
+    }
+
+    size_t checkBlock (const BlobHandle& handle) const {
+        if (handle.block >= mBlockCount) {
+            throw QueueError("Invalid blob handle");
+        }
+        return handle.block;
+    }
+
+    /* Throws QueueError if handle is invalid, or has already been freed. */
+    Block& block (const BlobHandle& handle) {
+        auto& b = mBlocks[checkBlock(handle)];
+        if (b.generation.load(std::memory_order_relaxed) != handle.generation) {
+            throw QueueError("Stale blob handle");
+        }
+        return b;
+    }
+
+    bool pop (size_t size, BlobHandle& handle) {
+        auto head = mHeader->freeList.load(std::memory_order_acquire);
+        while (true) {
+            auto index = static_cast<uint32_t>(head);
+            if (index == kNil) {
+                return false;
+            }
+            auto next = uint64_t(mBlocks[index].next.load(std::memory_order_relaxed));
+            auto tag = (head >> 32) + 1;
+            if (mHeader->freeList.compare_exchange_weak(head, tag << 32 | next,
+                        std::memory_order_acquire)) {
+                auto& b = mBlocks[index];
+                b.refs.store(1, std::memory_order_relaxed);
+                handle.block = index;
+                handle.generation = b.generation.load(std::memory_order_relaxed);
+                handle.size = size;
+                return true;
+            }
+        }
+    }
+
+    void push (uint32_t index) {
+        auto head = mHeader->freeList.load(std::memory_order_relaxed);
+        do {
+            mBlocks[index].next.store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+        } while (!mHeader->freeList.compare_exchange_weak(head,
+                    (head & ~uint64_t(kNil)) | index, std::memory_order_release));
+    }
+
+    ShmSegment mSegment;
+    Header* mHeader = nullptr;
+    Block* mBlocks = nullptr;
+    unsigned char* mData = nullptr;
+    size_t mBlockSize = 0;
+    size_t mBlockCount = 0;
+};
+
+}
+
+#endif
@@ -0,0 +1,475 @@
+#ifndef IPC_BROADCAST_HPP
+#define IPC_BROADCAST_HPP
+
+#include "common.hpp"
+#include "errors.hpp"
+#include "event_count.hpp"
+#include "shm_segment.hpp"
+#include "tmp_file_lock.hpp"
+
+#include "util/log.hpp"
+
+#include <boost/interprocess/creation_tags.hpp>
+#include <boost/interprocess/exceptions.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include <cstdint>
+#include <cstring>
+
+#include <unistd.h>
+
+namespace ipc {
+
+/* What a Publisher does when a subscriber falls a whole ring behind. */
+enum SlowSubscriberPolicy {
+    /* Wait for the slowest subscriber to make room. Subscribers never miss a
+     * message, and read them in place. A subscriber process which crashes is
+     * noticed, and dropped, within stallCheckInterval. */
+    SLOW_SUBSCRIBER_BLOCK,
+
+    /* Never wait: overwrite the oldest message, and let a subscriber which
+     * has been lapped skip ahead to the oldest message still in the ring,
+     * counting what it missed (see Subscriber::lappedMessages). Subscribers
+     * copy each message out before handling it, to detect a message being
+     * overwritten under them. */
+    SLOW_SUBSCRIBER_LAP
+};
+
+namespace detail {
+
+/* The layout of a broadcast ring: this header, kMaxSubscribers cursors, and
+ * then capacity slots. */
+struct BroadcastHeader {
+    static const uint32_t kMagic = 0x42524f44; /* "BROD" */
+    static const size_t kMaxSubscribers = 64;
+
+    std::atomic<uint32_t> magic;
+    uint32_t capacity;
+    uint32_t slotSize;
+    uint32_t options;
+    uint32_t policy;
+
+    /* Set when the publisher shuts down gracefully. */
+    std::atomic<uint32_t> closed;
+
+    /* The publisher's process, so subscribers can tell if it crashed. */
+    std::atomic<uint32_t> publisherPid;
+
+    /* The position of the next message to be published. Positions are 64
+     * bits, so they never wrap. */
+    alignas(IPC_CACHE_LINE_SIZE) std::atomic<uint64_t> writeIndex;
+
+    /* Subscribers sleep on published, and a blocked publisher on notFull. */
+    alignas(IPC_CACHE_LINE_SIZE) EventCount published;
+    alignas(IPC_CACHE_LINE_SIZE) EventCount notFull;
+};
+
+/* A subscriber's position in the ring, i.e., that of the next message it will
+ * read. owner is the pid of the subscriber's process, or 0 if the cursor is
+ * free. A subscriber claims a cursor by compare-and-swap, so any number of
+ * subscribers in one process get cursors of their own. A cursor whose owner
+ * has died is as good as free: a new subscriber may claim it, and a blocked
+ * publisher frees it. */
+struct alignas(IPC_CACHE_LINE_SIZE) BroadcastCursor {
+    std::atomic<uint32_t> owner;
+    std::atomic<uint64_t> position;
+};
+
+/* sequence is 2 * position + 1 while the message for position is being
+ * written, and 2 * position + 2 once it has been, so a reader can tell which
+ * message a slot holds, and whether it changed while being read. */
+template <typename Msg>
+struct BroadcastSlot {
+    std::atomic<uint64_t> sequence;
+    Msg msg;
+};
+
+}
+
+/* The writing end of a broadcast channel, which fans one stream of messages
+ * out to any number (up to 64) of Subscribers, each in its own process or
+ * thread, and each reading every message at its own pace. The publisher
+ * writes each message once, into a ring in a POSIX shared memory segment
+ * named after the channel, and each subscriber keeps its own cursor into the
+ * ring. Compare Producer and Consumer, where each message goes to exactly one
+ * consumer.
+ *
+ * A channel has at most one publisher. The publisher creates the ring, so
+ * it chooses the ring's capacity and the SlowSubscriberPolicy; subscribers
+ * join and leave as they please, and start from the next message published.
+ * A subscriber's position costs the publisher nothing under
+ * SLOW_SUBSCRIBER_LAP. Under SLOW_SUBSCRIBER_BLOCK, the publisher rescans
+ * the cursors only when the ring looks full by its last scan.
+ *
+ * Msg must be standard layout, as for Producer. */
+template <typename Msg>
+class Publisher {
+    static_assert(std::is_standard_layout<Msg>::value,
+            "message type must be a standard layout class");
+    static_assert(alignof(Msg) <= IPC_CACHE_LINE_SIZE,
+            "message type alignment must not exceed a cache line");
+    using Header = detail::BroadcastHeader;
+    using Cursor = detail::BroadcastCursor;
+    using Slot = detail::BroadcastSlot<Msg>;
+public:
+    /* Create the channel's ring, replacing any left by a previous publisher,
+     * with room for capacity messages (rounded up to a power of two).
+     * options are SegmentOption flags.
+     *
+     * Throws QueueError if another publisher is running, or the ring cannot
+     * be created, and FileLockError if there is a problem with the lock
+     * file. */
+    Publisher (const char* name, size_t capacity,
+            SlowSubscriberPolicy policy = SLOW_SUBSCRIBER_BLOCK, unsigned options = 0)
+            : mName(name)
+            , mPublicationMutex(mName + IPC_PRODUCER_SUFFIX) {
+        using namespace boost::interprocess;
+        using std::swap;
+
+        if (!mPublicationMutex.try_lock()) {
+            throw QueueError("Channel " + mName + " already has a publisher");
+        }
+
+        capacity = roundUpToPowerOfTwo(capacity);
+        ShmSegment::remove(name);
+        try {
+            ShmSegment segment { create_only, name, segmentSize<Msg>(capacity), options };
+            swap(mSegment, segment);
+        }
+        catch (interprocess_exception& exc) {
+            mPublicationMutex.unlock();
+            throw QueueError("Unable to create broadcast channel " + mName);
+        }
+
+        mHeader = new (mSegment.address()) Header();
+        mHeader->capacity = static_cast<uint32_t>(capacity);
+        mHeader->slotSize = sizeof(Msg);
+        mHeader->options = options;
+        mHeader->policy = policy;
+        mHeader->publisherPid.store(static_cast<uint32_t>(getpid()), std::memory_order_relaxed);
+        mCursors = reinterpret_cast<Cursor*>(mHeader + 1);
+        mSlots = reinterpret_cast<Slot*>(mCursors + Header::kMaxSubscribers);
+        mCapacity = capacity;
+        mMask = capacity - 1;
+        mPolicy = policy;
+        mHeader->magic.store(Header::kMagic, std::memory_order_release);
+
+        LOG(debug) << "Publisher(" << mName << ") constructed";
+    }
+
+    Publisher (const Publisher&) = delete;
+    Publisher& operator= (const Publisher&) = delete;
+
+    /* Tell subscribers we have gone. They see every message published up to
+     * now, and then nothing more. */
+    ~Publisher () {
+        mHeader->closed.store(1, std::memory_order_release);
+        mHeader->published.notifyAll();
+        try {
+            mPublicationMutex.unlock();
+        }
+        catch (FileLockError& exc) {
+            LOG(warning) << "Publisher(" << mName << ") unable to release publication lock";
+        }
+    }
+
+    size_t capacity () const {
+        return mCapacity;
+    }
+
+    /* The number of subscribers currently attached. */
+    size_t subscribers () const {
+        size_t count = 0;
+        for (size_t i = 0; i < Header::kMaxSubscribers; ++i) {
+            count += mCursors[i].owner.load(std::memory_order_relaxed) != 0;
+        }
+        return count;
+    }
+
+    /* Write msg into the ring for every subscriber. Under
+     * SLOW_SUBSCRIBER_BLOCK, waits for the slowest subscriber if the ring is
+     * full; under SLOW_SUBSCRIBER_LAP, never waits. */
+    void publish (const Msg& msg) {
+        auto w = mWriteIndex;
+        if (mPolicy == SLOW_SUBSCRIBER_BLOCK && w - mCachedMinCursor >= mCapacity) {
+            waitForSubscribers(w);
+        }
+
+        auto& slot = mSlots[w & mMask];
+        slot.sequence.store(2 * w + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        std::memcpy(&slot.msg, &msg, sizeof(Msg));
+        slot.sequence.store(2 * w + 2, std::memory_order_release);
+
+        mWriteIndex = w + 1;
+        mHeader->writeIndex.store(w + 1, std::memory_order_release);
+        mHeader->published.notifyAll();
+    }
+
+private:
+    template <typename M>
+    friend class Subscriber;
+
+    template <typename M>
+    static size_t segmentSize (size_t capacity) {
+        return sizeof(Header) + Header::kMaxSubscribers * sizeof(Cursor) +
+            capacity * sizeof(detail::BroadcastSlot<M>);
+    }
+
+    /* The position of the slowest active subscriber, or w if there are
+     * none. */
+    uint64_t minCursor (uint64_t w) const {
+        auto min = w;
+        for (size_t i = 0; i < Header::kMaxSubscribers; ++i) {
+            if (mCursors[i].owner.load(std::memory_order_acquire)) {
+                min = std::min(min, mCursors[i].position.load(std::memory_order_acquire));
+            }
+        }
+        return min;
+    }
+
+    void waitForSubscribers (uint64_t w) {
+        auto hasRoom = [&] () {
+            mCachedMinCursor = minCursor(w);
+            return w - mCachedMinCursor < mCapacity;
+        };
+        while (!mHeader->notFull.waitFor(hasRoom, stallCheckInterval())) {
+            dropDeadSubscribers();
+        }
+    }
+
+    /* A subscriber which crashed can never advance its cursor. Free it, unless
+     * its owner let it go, or another subscriber claimed it, meanwhile. */
+    void dropDeadSubscribers () {
+        for (size_t i = 0; i < Header::kMaxSubscribers; ++i) {
+            auto owner = mCursors[i].owner.load(std::memory_order_acquire);
+            if (owner && !processAlive(owner) &&
+                    mCursors[i].owner.compare_exchange_strong(owner, 0)) {
+                LOG(warning) << "Publisher(" << mName << ") dropped dead subscriber " << i
+                    << " (pid " << owner << ")";
+            }
+        }
+    }
+
+    std::string mName;
+    tmp_file_lock mPublicationMutex;
+    ShmSegment mSegment;
+    Header* mHeader = nullptr;
+    Cursor* mCursors = nullptr;
+    Slot* mSlots = nullptr;
+    uint64_t mCapacity = 0;
+    uint64_t mMask = 0;
+    SlowSubscriberPolicy mPolicy = SLOW_SUBSCRIBER_BLOCK;
+
+    /* Only we write writeIndex, so we need never read it back. */
+    uint64_t mWriteIndex = 0;
+    uint64_t mCachedMinCursor = 0;
+};
+
+/* The reading end of a broadcast channel; see Publisher. Each subscriber sees
+ * every message published after it attached, in order, unless the channel's
+ * policy is SLOW_SUBSCRIBER_LAP and it falls a whole ring behind. */
+template <typename Msg>
+class Subscriber {
+    using Header = detail::BroadcastHeader;
+    using Cursor = detail::BroadcastCursor;
+    using Slot = detail::BroadcastSlot<Msg>;
+public:
+    /* Attach to the channel's current ring.
+     *
+     * Throws QueueError if there is no ring (start the publisher first, or
+     * retry), if it does not carry Msg, or if the channel already has the
+     * maximum number of subscribers. */
+    explicit Subscriber (const char* name) : mName(name) {
+        using namespace boost::interprocess;
+        using std::swap;
+        try {
+            ShmSegment segment { open_only, name };
+            swap(mSegment, segment);
+        }
+        catch (interprocess_exception& exc) {
+            throw QueueError("Unable to open broadcast channel " + mName);
+        }
+
+        mHeader = static_cast<Header*>(mSegment.address());
+        if (mSegment.size() < sizeof(Header) ||
+                mHeader->magic.load(std::memory_order_acquire) != Header::kMagic ||
+                mHeader->slotSize != sizeof(Msg) ||
+                mSegment.size() < Publisher<Msg>::template segmentSize<Msg>(mHeader->capacity)) {
+            throw QueueError("Channel " + mName + " is not a broadcast channel of this message type");
+        }
+        mSegment.applyOptions(mHeader->options);
+        mCursors = reinterpret_cast<Cursor*>(mHeader + 1);
+        mSlots = reinterpret_cast<Slot*>(mCursors + Header::kMaxSubscribers);
+        mCapacity = mHeader->capacity;
+        mMask = mCapacity - 1;
+        mLap = mHeader->policy == SLOW_SUBSCRIBER_LAP;
+
+        /* Claim the first cursor which is free, or whose owner died without
+         * freeing it. Otherwise, under SLOW_SUBSCRIBER_LAP, whose publisher
+         * never looks, crashed subscribers would use up the cursors. */
+        auto pid = static_cast<uint32_t>(getpid());
+        for (size_t i = 0; i < Header::kMaxSubscribers && !mCursor; ++i) {
+            auto owner = mCursors[i].owner.load(std::memory_order_acquire);
+            if ((!owner || !processAlive(owner)) &&
+                    mCursors[i].owner.compare_exchange_strong(owner, pid)) {
+                mCursor = &mCursors[i];
+            }
+        }
+        if (!mCursor) {
+            throw QueueError("Channel " + mName + " has too many subscribers");
+        }
+
+        /* Start from the latest message. A blocking publisher which scanned
+         * the cursors before it could see ours may still overwrite anything
+         * before the writeIndex it had published by then, so read writeIndex
+         * again once our cursor is visible, and start from there. Until then,
+         * the publisher may see the position the cursor's previous owner left,
+         * which only holds it back, so wake it once we have moved on. */
+        mCursor->position.store(mHeader->writeIndex.load(std::memory_order_acquire),
+                std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        mPosition = mCachedWriteIndex = mHeader->writeIndex.load(std::memory_order_acquire);
+        mCursor->position.store(mPosition, std::memory_order_release);
+        mHeader->notFull.notifyAll();
+
+        LOG(debug) << "Subscriber(" << mName << ") constructed";
+    }
+
+    Subscriber (const Subscriber&) = delete;
+    Subscriber& operator= (const Subscriber&) = delete;
+
+    ~Subscriber () {
+        mCursor->owner.store(0, std::memory_order_release);
+        mHeader->notFull.notifyAll();
+    }
+
+    /* Process up to max messages already published, without blocking, and
+     * return how many were processed. processMessage is called with a
+     * const Msg&, which is valid only until it returns. */
+    template <typename Handler>
+    size_t drain (Handler&& processMessage, size_t max = SIZE_MAX) {
+        size_t count = 0;
+        while (count < max && receiveAndProcess(processMessage)) {
+            ++count;
+        }
+        return count;
+    }
+
+    /* Wait up to timeout for a message, and process it. Returns false on
+     * timeout, or if the publisher has shut down and every message it
+     * published has been processed. */
+    template <typename Rep, typename Period, typename Handler>
+    bool timedReceiveAndProcess (std::chrono::duration<Rep, Period> timeout,
+            Handler&& processMessage) {
+        bool received = false;
+        mHeader->published.waitFor([&] () {
+                    received = receiveAndProcess(processMessage);
+                    return received || mHeader->closed.load(std::memory_order_acquire);
+                }, timeout);
+        return received;
+    }
+
+    /* Whether the publisher which created our ring is still running. Once it
+     * is gone, a new publisher's ring is a different one; construct a new
+     * Subscriber to follow it. */
+    bool publisherPresent () const {
+        return !mHeader->closed.load(std::memory_order_acquire) &&
+            processAlive(mHeader->publisherPid.load(std::memory_order_relaxed));
+    }
+
+    /* The number of messages we missed by being lapped, under
+     * SLOW_SUBSCRIBER_LAP. */
+    uint64_t lappedMessages () const {
+        return mLappedMessages;
+    }
+
+private:
+    /* Moves our cursor past a message on scope exit, so a message delivered
+     * in place stays intact until its handler is done with it. */
+    struct Release {
+        Subscriber& subscriber;
+
+        ~Release () {
+            subscriber.advance();
+        }
+    };
+
+    template <typename Handler>
+    bool receiveAndProcess (Handler& processMessage) {
+        if (mPosition == mCachedWriteIndex) {
+            mCachedWriteIndex = mHeader->writeIndex.load(std::memory_order_acquire);
+            if (mPosition == mCachedWriteIndex) {
+                return false;
+            }
+        }
+
+        if (!mLap) {
+            Release release { *this };
+            processMessage(static_cast<const Msg&>(mSlots[mPosition & mMask].msg));
+            return true;
+        }
+
+        /* Copy the message out, then make sure it was not overwritten while
+         * we copied it. If it was, we have been lapped: skip ahead to the
+         * oldest message the publisher cannot be overwriting yet. */
+        while (true) {
+            if (mCachedWriteIndex - mPosition >= mCapacity) {
+                skipTo(mCachedWriteIndex - mCapacity + 1);
+            }
+            auto& slot = mSlots[mPosition & mMask];
+            auto sequence = slot.sequence.load(std::memory_order_acquire);
+            if (sequence == 2 * mPosition + 2) {
+                std::memcpy(&mScratch, &slot.msg, sizeof(Msg));
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (slot.sequence.load(std::memory_order_relaxed) == sequence) {
+                    break;
+                }
+            }
+            mCachedWriteIndex = mHeader->writeIndex.load(std::memory_order_acquire);
+            skipTo(std::max(mPosition + 1, mCachedWriteIndex - std::min(mCachedWriteIndex, mCapacity - 1)));
+        }
+        Release release { *this };
+        processMessage(static_cast<const Msg&>(mScratch));
+        return true;
+    }
+
+    void skipTo (uint64_t position) {
+        mLappedMessages += position - mPosition;
+        mPosition = position;
+    }
+
+    void advance () {
+        ++mPosition;
+        mCursor->position.store(mPosition, std::memory_order_release);
+        if (!mLap) {
+            mHeader->notFull.notifyAll();
+        }
+    }
+
+    std::string mName;
+    ShmSegment mSegment;
+    Header* mHeader = nullptr;
+    Cursor* mCursors = nullptr;
+    Cursor* mCursor = nullptr;
+    Slot* mSlots = nullptr;
+    uint64_t mCapacity = 0;
+    uint64_t mMask = 0;
+    bool mLap = false;
+
+    uint64_t mPosition = 0;
+    uint64_t mCachedWriteIndex = 0;
+    uint64_t mLappedMessages = 0;
+    Msg mScratch;
+};
+
+}
+
+#endif
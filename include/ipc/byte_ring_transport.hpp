@@ -0,0 +1,324 @@
+#ifndef IPC_BYTE_RING_TRANSPORT_HPP
+#define IPC_BYTE_RING_TRANSPORT_HPP
+
+#include "common.hpp"
+#include "errors.hpp"
+#include "event_count.hpp"
+#include "shm_segment.hpp"
+
+#include <boost/interprocess/exceptions.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <new>
+#include <string>
+#include <utility>
+
+#include <cstdint>
+#include <cstring>
+
+namespace ipc {
+
+/* A single-producer, single-consumer ring of variable-length byte records in
+ * a POSIX shared memory segment. See message_queue_transport.hpp for the
+ * transport interface; this transport departs from it as follows.
+ *
+ * The queue capacity given to the constructor is in bytes, not messages, and
+ * is rounded up to a power of two. Each record is an 8-byte header holding
+ * the payload length, followed by the payload, padded to a multiple of 8
+ * bytes, so a queue holds as many records as their actual sizes allow, and a
+ * send copies only the bytes given to it. A record never wraps around the
+ * end of the ring: if it does not fit in the space left before the end, the
+ * producer marks that space as padding and starts the record at the
+ * beginning, so the consumer always sees a payload as one contiguous run of
+ * bytes, 8-byte aligned. For the same reason, a payload may be at most half
+ * the capacity, less the record header.
+ *
+ * In addition to send (const Msg&), which sends sizeof(Msg) bytes, the
+ * producer side provides sendBytes (const void*, size_t, EventCount&,
+ * Stalled), used by BasicProducer::sendBytes, and reserveBytes and
+ * commitBytes, used by BasicProducer's functions of the same names, to build
+ * a record of variable length in place. The consumer side provides only
+ * tryConsume, and calls its handler with (const void* data, size_t size)
+ * rather than a message; data points into the ring, and the record is
+ * released when the handler returns. Batch receives, and reserve and commit
+ * of a whole Msg, are not supported.
+ *
+ * As with SpscRingTransport, there is exactly one writer, so this transport
+ * may only back an exclusive Producer. */
+template <typename Msg>
+class ByteRingTransport {
+    using Clock = std::chrono::steady_clock;
+public:
+    static const bool multiProducer = false;
+    static const bool canOverwrite = false;
+
+    static bool remove (const char* name) {
+        return ShmSegment::remove(name);
+    }
+
+    ByteRingTransport (boost::interprocess::create_only_t, const char* name,
+            size_t capacity, unsigned options = 0) {
+        using namespace boost::interprocess;
+        using std::swap;
+        capacity = roundUpToPowerOfTwo(std::max<size_t>(capacity, kMinCapacity));
+        try {
+            ShmSegment segment { create_only, name, sizeof(Header) + capacity, options };
+            swap(mSegment, segment);
+        }
+        catch (interprocess_exception& exc) {
+            throw QueueError(std::string("Unable to create queue named ") + name);
+        }
+
+        mHeader = new (mSegment.address()) Header();
+        mHeader->capacity = static_cast<uint32_t>(capacity);
+        mHeader->options = options;
+        mHeader->magic.store(kMagic, std::memory_order_release);
+        attach();
+    }
+
+    ByteRingTransport (boost::interprocess::open_only_t, const char* name) {
+        using namespace boost::interprocess;
+        using std::swap;
+        try {
+            ShmSegment segment { open_only, name };
+            swap(mSegment, segment);
+        }
+        catch (interprocess_exception& exc) {
+            throw QueueError("Unable to open queue");
+        }
+
+        mHeader = static_cast<Header*>(mSegment.address());
+        if (mSegment.size() < sizeof(Header) ||
+                mHeader->magic.load(std::memory_order_acquire) != kMagic ||
+                mSegment.size() < sizeof(Header) + mHeader->capacity) {
+            throw QueueError(std::string("Queue ") + name + " is not a byte ring");
+        }
+        mSegment.applyOptions(mHeader->options);
+        attach();
+    }
+
+    ByteRingTransport (const ByteRingTransport&) = delete;
+    ByteRingTransport& operator= (const ByteRingTransport&) = delete;
+
+    /* The capacity in bytes. */
+    size_t capacity () const {
+        return mCapacity;
+    }
+
+    /* The largest payload a single record may carry. */
+    size_t maxSize () const {
+        return mCapacity / 2 - sizeof(RecordHeader);
+    }
+
+    template <typename Stalled>
+    void send (const Msg& msg, EventCount& consumerEvents, Stalled stalled) {
+        sendBytes(&msg, sizeof(Msg), consumerEvents, stalled);
+    }
+
+    bool trySend (const Msg& msg, EventCount& consumerEvents) {
+        /* With a deadline in the past, we never wait, so never stall. */
+        auto noStallCheck = [] () { };
+        return timedSend(msg, consumerEvents, noStallCheck, Clock::time_point::min());
+    }
+
+    template <typename Stalled>
+    bool timedSend (const Msg& msg, EventCount& consumerEvents, Stalled stalled,
+            Clock::time_point deadline) {
+        if (!write(&msg, sizeof(Msg), consumerEvents, stalled, deadline)) {
+            return false;
+        }
+        consumerEvents.notifyAll();
+        return true;
+    }
+
+    template <typename Stalled>
+    void sendBatch (const Msg* msgs, size_t count, EventCount& consumerEvents,
+            Stalled stalled) {
+        for (size_t i = 0; i < count; ++i) {
+            write(&msgs[i], sizeof(Msg), consumerEvents, stalled, Clock::time_point::max());
+        }
+        consumerEvents.notifyAll();
+    }
+
+    /* Throws QueueError if size exceeds maxSize. */
+    template <typename Stalled>
+    void sendBytes (const void* data, size_t size, EventCount& consumerEvents,
+            Stalled stalled) {
+        write(data, size, consumerEvents, stalled, Clock::time_point::max());
+        consumerEvents.notifyAll();
+    }
+
+    /* Claim room for a record of up to maxSize bytes, and return where its
+     * payload goes, so it can be built in place. Every reserveBytes must be
+     * followed by exactly one commitBytes before the next send.
+     *
+     * Throws QueueError if maxSize exceeds maxSize (). */
+    template <typename Stalled>
+    void* reserveBytes (size_t maxSize, EventCount& consumerEvents, Stalled stalled) {
+        claim(maxSize, consumerEvents, stalled, Clock::time_point::max(), mReserved);
+        mReservedSize = maxSize;
+        return recordAt(mReserved) + 1;
+    }
+
+    /* Publish the record claimed by the last reserveBytes, with the first
+     * size bytes of its payload. */
+    void commitBytes (size_t size, EventCount& consumerEvents) {
+        assert(size <= mReservedSize);
+        publish(mReserved, std::min(size, mReservedSize));
+        consumerEvents.notifyAll();
+    }
+
+    template <typename F>
+    bool tryConsume (F&& f) {
+        auto r = mHeader->readIndex.load(std::memory_order_relaxed);
+        if (r == mCachedWriteIndex) {
+            mCachedWriteIndex = mHeader->writeIndex.load(std::memory_order_acquire);
+            if (r == mCachedWriteIndex) {
+                return false;
+            }
+        }
+
+        auto record = recordAt(r);
+        if (record->size == kPadding) {
+            r += mCapacity - (r & mMask);
+            record = recordAt(r);
+        }
+
+        Release release { *this, r + recordSize(record->size) };
+        f(static_cast<const void*>(record + 1), size_t(record->size));
+        return true;
+    }
+
+private:
+    /* Identifies an initialized ring, and guards against a producer built
+     * against a different layout. */
+    static const uint32_t kMagic = 0x42595445; /* "BYTE" */
+
+    /* Small enough to be harmless, large enough that maxSize is useful. */
+    static const size_t kMinCapacity = 4096;
+
+    /* The size of a record header which marks the rest of the ring, up to
+     * the end, as unused. */
+    static const uint32_t kPadding = 0xffffffff;
+
+    struct Header {
+        std::atomic<uint32_t> magic;
+        uint32_t capacity;
+        uint32_t options;
+
+        alignas(IPC_CACHE_LINE_SIZE) std::atomic<uint32_t> writeIndex;
+        alignas(IPC_CACHE_LINE_SIZE) std::atomic<uint32_t> readIndex;
+        alignas(IPC_CACHE_LINE_SIZE) EventCount notFull;
+    };
+
+    struct alignas(8) RecordHeader {
+        uint32_t size;
+    };
+
+    static_assert(sizeof(RecordHeader) == 8, "record headers must keep payloads 8-byte aligned");
+
+    /* Hands a consumed record back to the producer on scope exit, so a
+     * payload delivered in place stays intact until its handler is done
+     * with it. */
+    struct Release {
+        ByteRingTransport& transport;
+        uint32_t readIndex;
+
+        ~Release () {
+            transport.mHeader->readIndex.store(readIndex, std::memory_order_release);
+            transport.mHeader->notFull.notifyAll();
+        }
+    };
+
+    static uint32_t recordSize (size_t size) {
+        return static_cast<uint32_t>((sizeof(RecordHeader) + size + 7) & ~size_t(7));
+    }
+
+    void attach () {
+        mCapacity = mHeader->capacity;
+        mMask = mCapacity - 1;
+        mData = reinterpret_cast<unsigned char*>(mHeader + 1);
+        mCachedReadIndex = mHeader->readIndex.load(std::memory_order_acquire);
+        mCachedWriteIndex = mHeader->writeIndex.load(std::memory_order_acquire);
+    }
+
+    RecordHeader* recordAt (uint32_t index) const {
+        return reinterpret_cast<RecordHeader*>(mData + (index & mMask));
+    }
+
+    /* Claim room for a record of up to size bytes, padding out the end of
+     * the ring first if the record would not fit before it, and return the
+     * index at which it starts. Does not signal the consumer unless we have
+     * to wait for it. Returns false if there is still no room at deadline. */
+    template <typename Stalled>
+    bool claim (size_t size, EventCount& consumerEvents, Stalled& stalled,
+            Clock::time_point deadline, uint32_t& index) {
+        if (size > maxSize()) {
+            throw QueueError("Message too large for queue");
+        }
+
+        auto w = mHeader->writeIndex.load(std::memory_order_relaxed);
+        auto length = recordSize(size);
+        auto tail = mCapacity - (w & mMask);
+        auto needed = length <= tail ? length : tail + length;
+
+        if (mCapacity - (w - mCachedReadIndex) < needed) {
+            consumerEvents.notifyAll();
+            auto hasSpace = [&] () {
+                mCachedReadIndex = mHeader->readIndex.load(std::memory_order_acquire);
+                return mCapacity - (w - mCachedReadIndex) >= needed;
+            };
+            if (!waitUntil(mHeader->notFull, hasSpace, stalled, deadline)) {
+                return false;
+            }
+        }
+
+        if (length > tail) {
+            recordAt(w)->size = kPadding;
+            w += tail;
+        }
+        index = w;
+        return true;
+    }
+
+    /* Publish a record of size bytes, already written at index. */
+    void publish (uint32_t index, size_t size) {
+        recordAt(index)->size = static_cast<uint32_t>(size);
+        mHeader->writeIndex.store(index + recordSize(size), std::memory_order_release);
+    }
+
+    /* Write one record and publish it, as for claim. */
+    template <typename Stalled>
+    bool write (const void* data, size_t size, EventCount& consumerEvents,
+            Stalled& stalled, Clock::time_point deadline) {
+        uint32_t index;
+        if (!claim(size, consumerEvents, stalled, deadline, index)) {
+            return false;
+        }
+        std::memcpy(recordAt(index) + 1, data, size);
+        publish(index, size);
+        return true;
+    }
+
+    ShmSegment mSegment;
+    Header* mHeader = nullptr;
+    unsigned char* mData = nullptr;
+    uint32_t mCapacity = 0;
+    uint32_t mMask = 0;
+
+    /* Each side's last-seen copy of the other side's index. Refreshed only
+     * when the ring looks full (producer) or empty (consumer). */
+    uint32_t mCachedReadIndex = 0;
+    uint32_t mCachedWriteIndex = 0;
+
+    /* Where the record claimed by reserveBytes starts, and its most bytes. */
+    uint32_t mReserved = 0;
+    size_t mReservedSize = 0;
+};
+
+}
+
+#endif
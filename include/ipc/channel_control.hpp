@@ -0,0 +1,175 @@
+#ifndef IPC_CHANNEL_CONTROL_HPP
+#define IPC_CHANNEL_CONTROL_HPP
+
+#include "common.hpp"
+#include "errors.hpp"
+#include "event_count.hpp"
+#include "shm_segment.hpp"
+
+#include <boost/interprocess/exceptions.hpp>
+
+#include <atomic>
+#include <string>
+#include <utility>
+
+#include <cstdint>
+
+#include <unistd.h>
+
+namespace ipc {
+
+/* Counters describing a queue's traffic, for monitoring (see ipcstat). They
+ * are updated with relaxed atomics, off the transports' own cache lines, and
+ * only ever read by monitors, so keeping them costs the senders and the
+ * consumer an uncontended add or two per message. An exclusive producer does
+ * not even need an atomic add, since nobody else writes its counters.
+ *
+ * Messages an overflow policy drops or discards are counted as sent, and
+ * also in the control block's droppedMessages, so the number of messages in
+ * the queue is depth (block). */
+struct ChannelStats {
+    /* Written by producers. Only send and timedSend measure the time they
+     * spend blocked on a full queue. */
+    std::atomic<uint64_t> messagesSent;
+    std::atomic<uint64_t> bytesSent;
+    std::atomic<uint64_t> fullQueueEvents;
+    std::atomic<uint64_t> blockedNanoseconds;
+
+    /* Written by the consumer. messagesLost counts messages left in the
+     * queue when a new consumer replaced it. highWaterMark is the deepest the
+     * queue has been seen to be; the consumer samples the depth every
+     * kDepthSampleInterval messages, so brief peaks between samples may be
+     * missed. capacity (after any rounding) and messageSize (sizeof(Msg))
+     * describe the current consumer's queue. */
+    alignas(IPC_CACHE_LINE_SIZE) std::atomic<uint64_t> messagesReceived;
+    std::atomic<uint64_t> messagesLost;
+    std::atomic<uint64_t> highWaterMark;
+    std::atomic<uint64_t> consumerStarts;
+    std::atomic<uint64_t> capacity;
+    std::atomic<uint64_t> messageSize;
+
+    static const uint64_t kDepthSampleInterval = 64;
+};
+
+/* Per-queue state shared by a consumer and its producers, independent of the
+ * queue's transport. Every field must be valid when zeroed; see
+ * ChannelControl. */
+struct ChannelControlBlock {
+    /* Incremented when a consumer attaches to or detaches from the queue, so
+     * it is odd while a consumer is attached. Producers remember the epoch
+     * they connected under; if it changes, the consumer which owned their
+     * queue is gone. A consumer which crashes leaves the epoch odd, so its
+     * successor advances the epoch by two instead of one. */
+    std::atomic<uint32_t> consumerEpoch;
+
+    /* Process ID of the most recently attached consumer, which producers
+     * check now and then to notice a consumer which crashed. */
+    std::atomic<uint32_t> consumerPid;
+
+    /* Producers waiting for a consumer sleep on consumerEvents. A consumer
+     * signals it once it holds the consumption lock. */
+    EventCount consumerEvents;
+
+    /* The consumer sleeps on events. Producers signal it after every send,
+     * and after attaching to or detaching from the queue. */
+    alignas(IPC_CACHE_LINE_SIZE) EventCount events;
+
+    /* Incremented whenever a producer attaches or detaches, so the consumer
+     * knows when it is worth checking the production lock. */
+    std::atomic<uint32_t> producerEpoch;
+
+    /* The number of messages producers have dropped, or discarded from the
+     * queue, because of their overflow policies. */
+    std::atomic<uint64_t> droppedMessages;
+
+    alignas(IPC_CACHE_LINE_SIZE) ChannelStats stats;
+};
+
+/* The number of messages in the queue, as far as its stats can tell. The
+ * counters are read one at a time while they change, so this is
+ * approximate. */
+inline uint64_t depth (const ChannelControlBlock& block) {
+    auto& stats = block.stats;
+    auto gone = stats.messagesReceived.load(std::memory_order_relaxed) +
+        stats.messagesLost.load(std::memory_order_relaxed) +
+        block.droppedMessages.load(std::memory_order_relaxed);
+    auto sent = stats.messagesSent.load(std::memory_order_relaxed);
+    return sent > gone ? sent - gone : 0;
+}
+
+/* A handle on a queue's ChannelControlBlock, which lives in a shared memory
+ * segment named after the queue with IPC_CONTROL_SUFFIX appended. Unlike the
+ * queue itself, which the consumer recreates on startup, the control segment
+ * persists, and either side may be the one to create it. */
+class ChannelControl {
+public:
+    /* Open or create the control segment for the queue named name.
+     *
+     * Throws QueueError if the segment cannot be created or mapped. */
+    explicit ChannelControl (const std::string& name) {
+        using std::swap;
+        auto segmentName = name + IPC_CONTROL_SUFFIX;
+        try {
+            ShmSegment segment { boost::interprocess::open_or_create,
+                segmentName.c_str(), sizeof(ChannelControlBlock) };
+            swap(mSegment, segment);
+        }
+        catch (boost::interprocess::interprocess_exception& exc) {
+            throw QueueError("Unable to open control segment " + segmentName);
+        }
+        mBlock = static_cast<ChannelControlBlock*>(mSegment.address());
+    }
+
+    ChannelControl (const ChannelControl&) = delete;
+    ChannelControl& operator= (const ChannelControl&) = delete;
+
+    ChannelControlBlock* operator-> () const {
+        return mBlock;
+    }
+
+    ChannelControlBlock& operator* () const {
+        return *mBlock;
+    }
+
+    /* Advance consumerEpoch to a new odd value, and return it. */
+    uint32_t attachConsumer () {
+        mBlock->consumerPid.store(static_cast<uint32_t>(getpid()), std::memory_order_relaxed);
+        mBlock->stats.consumerStarts.fetch_add(1, std::memory_order_relaxed);
+
+        /* Whatever was left in the previous consumer's queue is gone. */
+        mBlock->stats.messagesLost.fetch_add(depth(*mBlock), std::memory_order_relaxed);
+        auto epoch = mBlock->consumerEpoch.load(std::memory_order_relaxed);
+        uint32_t next;
+        do {
+            next = (epoch & 1) ? epoch + 2 : epoch + 1;
+        } while (!mBlock->consumerEpoch.compare_exchange_weak(epoch, next,
+                    std::memory_order_acq_rel));
+        return next;
+    }
+
+    /* Tell waiting producers that a consumer has taken the consumption lock. */
+    void consumerReady () {
+        mBlock->consumerEvents.notifyAll();
+    }
+
+    /* Tell the consumer that a producer has attached or detached. */
+    void producerChanged () {
+        mBlock->producerEpoch.fetch_add(1, std::memory_order_release);
+        mBlock->events.notifyAll();
+    }
+
+    /* Advance consumerEpoch to an even value, provided it still equals epoch
+     * (i.e., another consumer has not already taken over the queue). */
+    void detachConsumer (uint32_t epoch) {
+        mBlock->consumerEpoch.compare_exchange_strong(epoch, epoch + 1,
+                std::memory_order_acq_rel);
+    }
+
+private:
+    ShmSegment mSegment;
+    ChannelControlBlock* mBlock = nullptr;
+};
+
+}
+
+#endif
@@ -1,7 +1,65 @@
 #ifndef IPC_COMMON_HPP
 #define IPC_COMMON_HPP
 
+#include "errors.hpp"
+
+#include <chrono>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+
+#include <signal.h>
+#include <time.h>
+
 #define IPC_CONSUMER_SUFFIX "-consumer"
 #define IPC_PRODUCER_SUFFIX "-producer"
+#define IPC_CONTROL_SUFFIX "-control"
+#define IPC_CLIENT_SUFFIX "-client"
+#define IPC_REPLY_SUFFIX "-reply"
+
+/* Shared memory structures which are written by different processes keep
+ * their hot fields this far apart, to avoid false sharing. */
+#define IPC_CACHE_LINE_SIZE 64
+
+namespace ipc {
+
+/* How often a producer blocked on a full queue wakes up to make sure the
+ * consumer is still alive. */
+inline std::chrono::milliseconds stallCheckInterval () {
+    return std::chrono::milliseconds(100);
+}
+
+/* CLOCK_MONOTONIC at the resolution of the scheduler tick, a few
+ * milliseconds, for deadlines checked on every message: it costs a few
+ * nanoseconds to read, a fraction of what steady_clock costs. */
+inline std::chrono::nanoseconds coarseNow () {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+}
+
+/* Whether the process pid is running, for shared memory structures which
+ * record their owner's pid. A pid of 0 means no owner. The pid may since have
+ * been reused, so this can be wrong in the conservative direction only. */
+inline bool processAlive (uint32_t pid) {
+    return pid && (!kill(static_cast<pid_t>(pid), 0) || errno == EPERM);
+}
+
+/* Ring buffers index their slots with free-running 32-bit counters, so their
+ * capacities are powers of two no larger than 2^31. Throws QueueError if n
+ * is too large to round up. */
+inline size_t roundUpToPowerOfTwo (size_t n) {
+    if (n > (size_t(1) << 31)) {
+        throw QueueError("Queue capacity too large");
+    }
+    size_t p = 1;
+    while (p < n) {
+        p <<= 1;
+    }
+    return p;
+}
+
+}
 
 #endif
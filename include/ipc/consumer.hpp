@@ -2,55 +2,88 @@
 #define IPC_CONSUMER_HPP
 
 #include "common.hpp"
+#include "channel_control.hpp"
+#include "doorbell.hpp"
 #include "tmp_file_lock.hpp"
 #include "errors.hpp"
+#include "latency_trace.hpp"
+#include "message_queue_transport.hpp"
 
 #include "util/log.hpp"
-#include "util/std_chrono_duration_to_posix_time_duration.hpp"
 
 #include <boost/scope_exit.hpp>
-#include <boost/interprocess/ipc/message_queue.hpp>
+#include <boost/interprocess/creation_tags.hpp>
+#include <boost/interprocess/sync/scoped_lock.hpp>
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <string>
 #include <thread>
+#include <vector>
 
 namespace ipc {
 
-template <typename Msg, size_t N = 100>
+/* Transport selects the mechanism which carries messages from producers to
+ * this consumer; it must match the Transport of the producers. See
+ * message_queue_transport.hpp for the options. N is the default queue
+ * capacity, used when none is given to the constructor. */
+template <typename Msg, size_t N = 100,
+         template <typename> class Transport = MessageQueueTransport>
 class Consumer {
+    using Clock = std::chrono::steady_clock;
 public:
     enum FailState {
         NO_ERROR,
         NO_PRODUCER
     };
 
-    Consumer (const char* name)
+    /* Create the queue named name, replacing any existing queue by that name,
+     * with room for capacity messages. The ring transports round capacity up
+     * to a power of two. Producers discover the capacity when they attach.
+     *
+     * options is a combination of SegmentOption flags (see shm_segment.hpp)
+     * controlling how the queue's memory is mapped; producers apply the same
+     * flags to their own mappings. MessageQueueTransport ignores them.
+     *
+     * Messages still in a queue it replaces are lost. For messages which
+     * must outlive the consumer, see JournalReader in journal.hpp.
+     *
+     * Throws QueueError if the queue cannot be created, and FileLockError if
+     * the consumption lock cannot be taken. */
+    Consumer (const char* name, size_t capacity = N, unsigned options = 0)
             : mName(name)
+            , mCapacity(capacity)
+            , mControl(mName)
             , mConsumptionMutex(mName + IPC_CONSUMER_SUFFIX)
             , mProductionMutex(mName + IPC_PRODUCER_SUFFIX) {
         using namespace boost::interprocess;
         using std::swap;
 
-        if (!message_queue::remove(name)) {
+        if (!Transport<Msg>::remove(name)) {
             LOG(debug) << "Unable to remove message queue " << mName;
         }
 
-        try {
-            mQueue.reset(new message_queue(create_only, name, N, sizeof(Msg)));
-        }
-        catch (interprocess_exception& exc) {
-            throw QueueError(std::string("Unable to create queue named ") + mName);
-        }
+        mQueue.reset(new Transport<Msg>(create_only, name, capacity, options));
+        mControl->stats.capacity.store(mQueue->capacity(), std::memory_order_relaxed);
+        mControl->stats.messageSize.store(sizeof(Msg), std::memory_order_relaxed);
+
+        /* Advertise the new queue through the control block before taking the
+         * consumption lock, so a producer which sees the lock held also sees
+         * the epoch it belongs to. */
+        mEpoch = mControl.attachConsumer();
 
         scoped_lock<tmp_file_lock> consumptionLock { mConsumptionMutex };
         swap(mConsumptionLock, consumptionLock);
+        mControl.consumerReady();
 
         LOG(debug) << "Consumer(" << mName << ") constructed";
     }
 
     ~Consumer () {
         stopServiceThread();
+        mControl.detachConsumer(mEpoch);
     }
 
     /* Start a thread to service the queue. As messages come in, the service
@@ -63,31 +96,64 @@ public:
      * spawnProducerTimeout interval, then subsequently disappears, the service
      * thread is also stopped.
      *
-     * Since we can only detect a producer process by checking to see if it has
-     * acquired the queue's production lock, and there is no way to block
-     * waiting for another process to acquire a lock, we must poll the mutex at
-     * intervals to see if the producer has spawned. This interval is
-     * pollingTimeout.
+     * processMessage receives the message by reference. With the ring
+     * transports the reference points directly into the queue's shared
+     * memory, and the slot is handed back to producers only when
+     * processMessage returns, so the message is never copied on this side.
+     * Do not keep the reference past the call, and do not hold on to the
+     * slot longer than necessary: a full queue blocks its producers.
+     *
+     * processMessage may be any callable taking const Msg&. Its type is a
+     * template parameter, so a lambda is called directly from the receive
+     * loop and small handlers are inlined into it; a std::function works
+     * too, at the cost of an indirect call per message.
+     *
+     * The service thread sleeps until something happens: producers signal the
+     * queue's control block whenever they send a message, and whenever they
+     * attach to or detach from the queue, and stopServiceThread signals it
+     * too. The service thread is therefore idle when the queue is, and
+     * stopServiceThread returns as soon as the current message, if any, has
+     * been processed.
      *
-     * pollingTimeout is also the interval at which the stop-thread flag is
-     * checked. Therefore, pollingTimeout plus some small epsilon is the
-     * maximum amount of time client code should have to wait for
-     * stopServiceThread to execute.
+     * A producer process which crashes cannot signal its departure, so the
+     * service thread also wakes up every pollingTimeout to check whether the
+     * queue's production lock has been abandoned. pollingTimeout no longer
+     * bounds message latency or shutdown time, so it can be generous.
      *
-     * Since a producer process's lifetime might fit into the pollingTimeout
-     * window, there is a very likely chance that we cannot detect short-lived
-     * processes which open the queue, send some messages, then exit. For this
-     * reason, the queue is checked continuously during the initial
-     * spawnProducerTimeout interval, and if a message is received, the queue
-     * is exhausted before checking the production mutex. This guarantees that
-     * we will receive all messages from a short-lived process. */
-    template <typename Duration1, typename Duration2>
-    void startServiceThread (std::function<void(Msg)> processMessage,
+     * A producer process's lifetime might be short enough that it opens the
+     * queue, sends some messages, and exits before the service thread checks
+     * on it. For this reason, receiving a message counts as having seen a
+     * producer, and the queue is exhausted before the service thread acts on
+     * a missing producer. This guarantees that we will receive all messages
+     * from a short-lived process. */
+    template <typename Handler, typename Duration1, typename Duration2>
+    void startServiceThread (Handler processMessage,
             Duration1 spawnProducerTimeout, Duration2 pollingTimeout) {
         assert(!mServiceThread.joinable());
         LOG(debug) << "Consumer starting service thread";
-        mServiceThread = std::thread([=] () {
-            serviceThread(processMessage, spawnProducerTimeout, pollingTimeout);
+        mServiceThread = std::thread([=] () mutable {
+            serviceThread([&] () { return receiveAndProcess(processMessage); },
+                    spawnProducerTimeout, pollingTimeout);
+        });
+    }
+
+    /* Like startServiceThread, but the service thread hands processBatch
+     * every message currently available in the queue at once, as a
+     * contiguous array, instead of making one call per message. The queue
+     * is drained with non-blocking receives, and the service thread only
+     * sleeps once it is empty, so at high message rates the per-message cost
+     * of waking up and dispatching is amortized over the whole batch.
+     *
+     * At most capacity messages are delivered per call. */
+    template <typename Handler, typename Duration1, typename Duration2>
+    void startBatchServiceThread (Handler processBatch,
+            Duration1 spawnProducerTimeout, Duration2 pollingTimeout) {
+        assert(!mServiceThread.joinable());
+        LOG(debug) << "Consumer starting batch service thread";
+        mBatch.resize(mCapacity);
+        mServiceThread = std::thread([=] () mutable {
+            serviceThread([&] () { return receiveAndProcessBatch(processBatch); },
+                    spawnProducerTimeout, pollingTimeout);
         });
     }
 
@@ -98,54 +164,191 @@ public:
         }
     }
 
-    /* Signal the service thread to exit gracefully. This function should block
-     * for at most ~pollingTimeout duration, where pollingTimeout is the
-     * argument to startServiceThread. */
+    /* Signal the service thread to exit gracefully, and wait for it to do so.
+     * The service thread is woken immediately, so this blocks only as long as
+     * it takes to finish processing the current message. */
     void stopServiceThread () {
         LOG(debug) << "Consumer stopping service thread";
         bool expected = false;
         if (mServiceThread.joinable() &&
                 mStopServiceThreadFlag.compare_exchange_strong(expected, true)) {
+            mControl->events.notifyAll();
             joinServiceThread();
         }
     }
 
-    template <typename Rep, typename Period>
+    template <typename Rep, typename Period, typename Handler>
     bool timedReceiveAndProcess (std::chrono::duration<Rep, Period> timeout,
-            std::function<void(Msg)> processMessage) {
-        Msg message;
-
-        /* Things we have to receive because we're using Boost.Interprocess
-         * message_queues, but don't care about. */
-        boost::interprocess::message_queue::size_type nReceivedBytes;
-        unsigned int priority;
-
-        auto stopTime = boost::posix_time::microsec_clock::universal_time() +
-            stdChronoDurationToPosixTimeDuration(timeout);
-        if (mQueue->timed_receive(&message, sizeof(message), nReceivedBytes, priority, stopTime)) {
-            LOG(debug) << "Consumer got msg with size " << nReceivedBytes
-                       << ", priority " << priority;
-            processMessage(message);
-            return true;
+            Handler&& processMessage) {
+        return mControl->events.waitFor([&] () { return receiveAndProcess(processMessage); },
+                timeout);
+    }
+
+    /* Wait up to timeout for a message, then drain every message available
+     * (up to the capacity) and hand them to processBatch in a single call. Returns the
+     * number of messages processed, which is zero on timeout. */
+    template <typename Rep, typename Period, typename Handler>
+    size_t timedReceiveAndProcessBatch (std::chrono::duration<Rep, Period> timeout,
+            Handler&& processBatch) {
+        mBatch.resize(mCapacity);
+        size_t count = 0;
+        mControl->events.waitFor([&] () {
+                    count = receiveAndProcessBatch(processBatch);
+                    return count != 0;
+                }, timeout);
+        return count;
+    }
+
+    /* Process up to max messages which are already in the queue, without
+     * blocking, and return how many were processed. processMessage is called
+     * as for startServiceThread.
+     *
+     * If eventFd has been called, drain also rearms it first, and leaves it
+     * readable if it stopped at max rather than at an empty queue. */
+    template <typename Handler>
+    size_t drain (Handler&& processMessage, size_t max = SIZE_MAX) {
+        if (mDoorbell) {
+            mDoorbell->clear();
+            mControl->events.armDoorbell(mDoorbell->id());
         }
-        else {
-            return false;
+        size_t count = 0;
+        while (count < max && mQueue->tryConsume(processMessage)) {
+            ++count;
+        }
+        countReceived(count);
+        if (mDoorbell && count == max) {
+            mDoorbell->ring();
+        }
+        return count;
+    }
+
+    /* A file descriptor which becomes readable when there may be messages to
+     * drain, for servicing the queue from an epoll (or select, or io_uring)
+     * event loop rather than a service thread. When it is readable, call
+     * drain, which makes it unreadable again until a producer sends another
+     * message; spurious readiness is possible, and harmless. Producers also
+     * ring it when they attach or detach, so a loop which wants to notice
+     * their departure can call beginService once and serviceStep in place of
+     * drain, with a timer for serviceWakeTime ().
+     *
+     * The descriptor belongs to the consumer; do not close it or read from
+     * it. It is readable when first returned, so the first drain picks up
+     * anything already queued. A producer rings it with a few system calls,
+     * but only when the consumer has drained the queue and rearmed it, so a
+     * busy queue costs no more than it does with a service thread.
+     *
+     * Throws QueueError if the descriptor cannot be created. */
+    int eventFd () {
+        if (!mDoorbell) {
+            mDoorbell.reset(new Doorbell);
+            mDoorbell->ring();
         }
+        return mDoorbell->fd();
+    }
+
+    /* The pieces of the service thread's loop, for servicing the queue from
+     * a thread of your own; ConsumerReactor uses them to service many queues
+     * from one thread. Call beginService once, with the same arguments as
+     * startServiceThread. Then call serviceStep whenever events () is
+     * signalled, or serviceWakeTime () passes, until it returns false. Only
+     * one thread may service a queue at a time, and a queue serviced this
+     * way must not also have a service thread.
+     *
+     * serviceStep processes up to budget messages, and stores how many it
+     * processed in processed. If there were none, it checks on the queue's producers when
+     * there is reason to, as the service thread does. It returns false, with
+     * the fail state set to NO_PRODUCER, once the producers are gone and the
+     * queue has been drained. */
+    template <typename R1, typename P1, typename R2, typename P2>
+    void beginService (std::chrono::duration<R1, P1> spawnProducerTimeout,
+            std::chrono::duration<R2, P2> pollingTimeout) {
+        auto now = Clock::now();
+        mService.spawnDeadline = now + spawnProducerTimeout;
+        mService.nextPoll = now;
+        mService.pollingTimeout = std::chrono::duration_cast<Clock::duration>(pollingTimeout);
+        mService.producerEpoch = mControl->producerEpoch.load(std::memory_order_acquire);
+        mService.producerSeen = false;
+    }
+
+    template <typename Handler>
+    bool serviceStep (Handler& processMessage, size_t budget, size_t& processed) {
+        auto receiveAndProcess = [&] () { return drain(processMessage, budget); };
+        return serviceStepWith(receiveAndProcess, processed);
+    }
+
+    std::chrono::steady_clock::time_point serviceWakeTime () const {
+        return mService.producerSeen ? mService.nextPoll
+            : std::min(mService.nextPoll, mService.spawnDeadline);
+    }
+
+    /* The event count producers signal when they send a message or come and
+     * go, and which a servicing thread sleeps on. */
+    EventCount& events () {
+        return mControl->events;
     }
 
     FailState failState () const {
         return mFailState;
     }
 
+    /* The number of messages producers have dropped, or discarded from the
+     * queue, because of their overflow policies, since the queue's control
+     * segment was created. */
+    uint64_t droppedMessages () const {
+        return mControl->droppedMessages.load(std::memory_order_relaxed);
+    }
+
+    /* The latencies traced so far, if the transport traces them (see
+     * traced_transport.hpp), or null. */
+    const LatencyTrace* latencyTrace () const {
+        return latencyTraceOf(*mQueue);
+    }
+
 private:
-    /* XXX This is important: if you go into a loop in this function which
+    template <typename Handler>
+    bool receiveAndProcess (Handler& processMessage) {
+        if (!mQueue->tryConsume(processMessage)) {
+            return false;
+        }
+        countReceived(1);
+        return true;
+    }
+
+    template <typename Handler>
+    size_t receiveAndProcessBatch (Handler& processBatch) {
+        auto count = mQueue->tryConsumeBatch(mBatch.data(), mBatch.size(), processBatch);
+        countReceived(count);
+        return count;
+    }
+
+    /* Update the queue's stats; see ChannelStats. We are the only writer of
+     * our counters, so they need no atomic adds. Every
+     * kDepthSampleInterval messages, note how deep the queue is. */
+    void countReceived (uint64_t count) {
+        auto& stats = mControl->stats;
+        auto before = stats.messagesReceived.load(std::memory_order_relaxed);
+        stats.messagesReceived.store(before + count, std::memory_order_relaxed);
+        if (before / ChannelStats::kDepthSampleInterval !=
+                (before + count) / ChannelStats::kDepthSampleInterval) {
+            auto current = depth(*mControl);
+            if (current > stats.highWaterMark.load(std::memory_order_relaxed)) {
+                stats.highWaterMark.store(current, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /* receiveAndProcess must process whatever is available in the queue, if
+     * anything, without blocking, and return how many messages it processed
+     * (or whether it processed any).
+     *
+     * XXX This is important: if you go into a loop in this function which
      * might block for a while (more than a few milliseconds), consider
      * checking mStopServiceThreadFlag on every test of the conditional.
      *
      * XXX This is also important: if you change the implementation here,
      * update the comments above startServiceThread. */
-    template <typename R1, typename P1, typename R2, typename P2>
-    void serviceThread (std::function<void(Msg)> processMessage,
+    template <typename ReceiveAndProcess, typename R1, typename P1, typename R2, typename P2>
+    void serviceThread (ReceiveAndProcess receiveAndProcess,
             std::chrono::duration<R1, P1> spawnProducerTimeout,
             std::chrono::duration<R2, P2> pollingTimeout) {
         BOOST_SCOPE_EXIT(void) {
@@ -154,50 +357,101 @@ private:
 
         LOG(debug) << "Consumer service thread started";
 
-        {
-            /* Wait for and process the first burst of messages, or until
-             * spawnProducerTimeout elapses. */
-            auto stopTime = std::chrono::steady_clock::now() + spawnProducerTimeout;
-            bool gotMessage = false;
-            while (!mStopServiceThreadFlag &&
-                    std::chrono::steady_clock::now() < stopTime &&
-                    !gotMessage) {
-                gotMessage = timedReceiveAndProcess(pollingTimeout, processMessage);
+        beginService(spawnProducerTimeout, pollingTimeout);
+        size_t processed;
+        while (!mStopServiceThreadFlag) {
+            if (!serviceStepWith(receiveAndProcess, processed)) {
+                break;
             }
-
-            if (gotMessage) {
-                while (!mStopServiceThreadFlag &&
-                        timedReceiveAndProcess(pollingTimeout, processMessage))
-                    ;
+            if (processed) {
+                continue;
             }
-        }
 
-        while (!mStopServiceThreadFlag) {
-            if (mProductionMutex.try_lock()) {
-                mProductionMutex.unlock();
-                mFailState = NO_PRODUCER;
-                LOG(debug) << "No producer present";
+            auto key = mControl->events.prepareWait();
+            if (mStopServiceThreadFlag) {
+                continue;
+            }
+            if (!serviceStepWith(receiveAndProcess, processed)) {
                 break;
             }
-
-            while (!mStopServiceThreadFlag &&
-                    timedReceiveAndProcess(pollingTimeout, processMessage))
-                ;
+            if (processed) {
+                continue;
+            }
+            mControl->events.wait(key, serviceWakeTime() - Clock::now());
         }
 
         /* Who knows, we might need to be restarted. */
         mStopServiceThreadFlag = false;
     }
 
+    /* Process whatever receiveAndProcess finds. If it finds nothing, the
+     * queue is empty, so check on the producers if a producer has come or
+     * gone, or it is time to poll for crashed producers, or our patience for
+     * the first producer has run out. */
+    template <typename ReceiveAndProcess>
+    bool serviceStepWith (ReceiveAndProcess& receiveAndProcess, size_t& processed) {
+        processed = receiveAndProcess();
+        if (processed) {
+            mService.producerSeen = true;
+            return true;
+        }
+
+        auto now = Clock::now();
+        auto epoch = mControl->producerEpoch.load(std::memory_order_acquire);
+        if (epoch != mService.producerEpoch || now >= mService.nextPoll ||
+                (!mService.producerSeen && now >= mService.spawnDeadline)) {
+            mService.producerEpoch = epoch;
+            mService.nextPoll = now + mService.pollingTimeout;
+            if (mProductionMutex.try_lock()) {
+                mProductionMutex.unlock();
+                if (mService.producerSeen || now >= mService.spawnDeadline) {
+                    /* Collect anything sent just before the last producer
+                     * left. */
+                    while (!mStopServiceThreadFlag) {
+                        size_t count = receiveAndProcess();
+                        if (!count) {
+                            break;
+                        }
+                        processed += count;
+                    }
+                    mFailState = NO_PRODUCER;
+                    LOG(debug) << "No producer present";
+                    return false;
+                }
+            }
+            else {
+                mService.producerSeen = true;
+            }
+        }
+        return true;
+    }
+
+    /* What the service loop knows about the queue's producers. */
+    struct ServiceState {
+        Clock::time_point spawnDeadline;
+        Clock::time_point nextPoll;
+        Clock::duration pollingTimeout;
+        uint32_t producerEpoch;
+        bool producerSeen;
+    };
+
     std::atomic<FailState> mFailState = { NO_ERROR };
     std::atomic<bool> mStopServiceThreadFlag = { false } ;
     std::thread mServiceThread;
 
     std::string mName;
-    std::unique_ptr<boost::interprocess::message_queue> mQueue = nullptr;
-    boost::interprocess::scoped_lock<tmp_file_lock> mConsumptionLock;
+    size_t mCapacity;
+    ChannelControl mControl;
+    uint32_t mEpoch = 0;
+    std::unique_ptr<Transport<Msg>> mQueue = nullptr;
+    std::vector<Msg> mBatch;
+    ServiceState mService = ServiceState();
+    std::unique_ptr<Doorbell> mDoorbell;
+
+    /* The mutexes must outlive the lock, so they are declared first. */
     tmp_file_lock mConsumptionMutex;
     tmp_file_lock mProductionMutex;
+    boost::interprocess::scoped_lock<tmp_file_lock> mConsumptionLock;
 };
 
 }
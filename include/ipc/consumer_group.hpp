@@ -0,0 +1,248 @@
+#ifndef IPC_CONSUMER_GROUP_HPP
+#define IPC_CONSUMER_GROUP_HPP
+
+#include "common.hpp"
+#include "event_count.hpp"
+
+#include "util/log.hpp"
+
+#include <boost/scope_exit.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <cstdint>
+
+namespace ipc {
+
+namespace detail {
+
+/* A bounded single-producer, single-consumer ring in ordinary memory, which
+ * carries messages from a ConsumerGroup's dispatcher to one of its
+ * workers. */
+template <typename Msg>
+class WorkRing {
+public:
+    explicit WorkRing (size_t capacity)
+            : mSlots(roundUpToPowerOfTwo(capacity))
+            , mMask(static_cast<uint32_t>(mSlots.size() - 1)) {
+        mReadIndex = 0;
+        mWriteIndex = 0;
+    }
+
+    size_t size () const {
+        return mWriteIndex.load(std::memory_order_relaxed) -
+            mReadIndex.load(std::memory_order_relaxed);
+    }
+
+    /* Dispatcher side: wait for room, then append msg. */
+    void push (const Msg& msg) {
+        auto w = mWriteIndex.load(std::memory_order_relaxed);
+        auto hasRoom = [&] () {
+            return w - mReadIndex.load(std::memory_order_acquire) <= mMask;
+        };
+        while (!hasRoom()) {
+            auto key = mNotFull.prepareWait();
+            if (hasRoom()) {
+                break;
+            }
+            mNotFull.wait(key);
+        }
+        mSlots[w & mMask] = msg;
+        mWriteIndex.store(w + 1, std::memory_order_release);
+        mNotEmpty.notifyAll();
+    }
+
+    /* Worker side: process every message available, and return how many
+     * there were. */
+    template <typename Handler>
+    size_t drain (Handler& processMessage) {
+        auto r = mReadIndex.load(std::memory_order_relaxed);
+        auto w = mWriteIndex.load(std::memory_order_acquire);
+        for (auto i = r; i != w; ++i) {
+            processMessage(static_cast<const Msg&>(mSlots[i & mMask]));
+            mReadIndex.store(i + 1, std::memory_order_release);
+            mNotFull.notifyAll();
+        }
+        return w - r;
+    }
+
+    EventCount& notEmpty () {
+        return mNotEmpty;
+    }
+
+private:
+    std::vector<Msg> mSlots;
+    uint32_t mMask;
+
+    /* Padded rather than aligned, since C++11's new ignores alignment
+     * beyond the fundamental. */
+    char mPad0[IPC_CACHE_LINE_SIZE];
+    std::atomic<uint32_t> mWriteIndex;
+    EventCount mNotEmpty {};
+    char mPad1[IPC_CACHE_LINE_SIZE];
+    std::atomic<uint32_t> mReadIndex;
+    EventCount mNotFull {};
+    char mPad2[IPC_CACHE_LINE_SIZE];
+};
+
+/* The KeyOf of a ConsumerGroup without key affinity. */
+struct NoKey { };
+
+}
+
+/* Spreads one queue's messages over several worker threads, for handlers
+ * too heavy for a single service thread to keep up with. A ConsumerGroup is
+ * a handler: hand it to Consumer::startServiceThread (or a ConsumerReactor),
+ * and the service thread passes each message on to a worker, which calls
+ * processMessage. Use makeConsumerGroup or makeKeyedConsumerGroup, below, to
+ * make one:
+ *
+ *   auto group = ipc::makeKeyedConsumerGroup<Msg>(4, process,
+ *           [] (const Msg& msg) { return msg.deviceId; });
+ *   consumer.startServiceThread(std::ref(*group), spawnTimeout, pollingTimeout);
+ *   ...
+ *   consumer.joinServiceThread();
+ *   group->join();
+ *
+ * Each worker has a bounded in-memory ring of messages waiting for it.
+ * Without a key, a message goes to the worker with the fewest waiting, so
+ * the workers share the load as if they pulled from one queue, and messages
+ * are processed in no particular order. With a key, messages with the same
+ * key always go to the same worker (by hash of the key), so each key's
+ * messages are processed in the order they were sent, while different keys
+ * proceed in parallel. Either way, a full worker ring holds up the service
+ * thread, which in turn leaves messages in the queue to hold up producers.
+ *
+ * processMessage is called from several threads at once, so it must be
+ * thread safe; it is copied into each worker. Messages are copied out of
+ * the queue, so Msg must be copy-assignable, as the transports' messages
+ * are. */
+template <typename Msg, typename Handler, typename KeyOf = detail::NoKey>
+class ConsumerGroup {
+public:
+    ConsumerGroup (size_t workers, Handler processMessage, KeyOf keyOf = KeyOf(),
+            size_t depth = 1024)
+            : mKeyOf(keyOf) {
+        workers = std::max<size_t>(workers, 1);
+        for (size_t i = 0; i < workers; ++i) {
+            mRings.emplace_back(new detail::WorkRing<Msg>(depth));
+        }
+        for (size_t i = 0; i < workers; ++i) {
+            auto ring = mRings[i].get();
+            mWorkers.emplace_back([this, ring, processMessage] () mutable {
+                work(*ring, processMessage);
+            });
+        }
+    }
+
+    ConsumerGroup (const ConsumerGroup&) = delete;
+    ConsumerGroup& operator= (const ConsumerGroup&) = delete;
+
+    ~ConsumerGroup () {
+        join();
+    }
+
+    size_t workers () const {
+        return mRings.size();
+    }
+
+    /* Pass msg on to a worker. Called by the service thread; only one thread
+     * may dispatch at a time. */
+    void operator() (const Msg& msg) {
+        mRings[chooseWorker(msg, std::is_same<KeyOf, detail::NoKey>())]->push(msg);
+    }
+
+    /* Let the workers finish the messages already dispatched to them, then
+     * wait for them to exit. Call this once nothing more will be dispatched,
+     * e.g., after joining the service thread. */
+    void join () {
+        if (!mClosed.exchange(true)) {
+            LOG(debug) << "Consumer group closing";
+            for (auto& ring : mRings) {
+                ring->notEmpty().notifyAll();
+            }
+        }
+        for (auto& worker : mWorkers) {
+            if (worker.joinable()) {
+                worker.join();
+            }
+        }
+    }
+
+private:
+    /* The least loaded worker, starting the search after the last one
+     * chosen so that ties go round robin. */
+    size_t chooseWorker (const Msg&, std::true_type) {
+        auto best = mNext;
+        auto bestSize = mRings[best]->size();
+        for (size_t i = 1; i < mRings.size() && bestSize; ++i) {
+            auto candidate = (mNext + i) % mRings.size();
+            auto size = mRings[candidate]->size();
+            if (size < bestSize) {
+                best = candidate;
+                bestSize = size;
+            }
+        }
+        mNext = (best + 1) % mRings.size();
+        return best;
+    }
+
+    size_t chooseWorker (const Msg& msg, std::false_type) {
+        using Key = typename std::decay<decltype(mKeyOf(msg))>::type;
+        return std::hash<Key>()(mKeyOf(msg)) % mRings.size();
+    }
+
+    void work (detail::WorkRing<Msg>& ring, Handler& processMessage) {
+        BOOST_SCOPE_EXIT(void) {
+            LOG(debug) << "Exiting consumer group worker";
+        } BOOST_SCOPE_EXIT_END
+
+        while (true) {
+            if (ring.drain(processMessage)) {
+                continue;
+            }
+            auto key = ring.notEmpty().prepareWait();
+            if (ring.drain(processMessage)) {
+                continue;
+            }
+            if (mClosed) {
+                break;
+            }
+            ring.notEmpty().wait(key);
+        }
+    }
+
+    KeyOf mKeyOf;
+    size_t mNext = 0;
+    std::atomic<bool> mClosed = { false };
+    std::vector<std::unique_ptr<detail::WorkRing<Msg>>> mRings;
+    std::vector<std::thread> mWorkers;
+};
+
+/* A ConsumerGroup of worker threads without key affinity. */
+template <typename Msg, typename Handler>
+std::unique_ptr<ConsumerGroup<Msg, Handler>>
+makeConsumerGroup (size_t workers, Handler processMessage, size_t depth = 1024) {
+    return std::unique_ptr<ConsumerGroup<Msg, Handler>>(
+            new ConsumerGroup<Msg, Handler>(workers, processMessage, detail::NoKey(), depth));
+}
+
+/* A ConsumerGroup of worker threads, where messages for which keyOf returns
+ * equal keys go to the same worker. The key type must have a std::hash. */
+template <typename Msg, typename Handler, typename KeyOf>
+std::unique_ptr<ConsumerGroup<Msg, Handler, KeyOf>>
+makeKeyedConsumerGroup (size_t workers, Handler processMessage, KeyOf keyOf,
+        size_t depth = 1024) {
+    return std::unique_ptr<ConsumerGroup<Msg, Handler, KeyOf>>(
+            new ConsumerGroup<Msg, Handler, KeyOf>(workers, processMessage, keyOf, depth));
+}
+
+}
+
+#endif
@@ -0,0 +1,225 @@
+#ifndef IPC_CONSUMER_REACTOR_HPP
+#define IPC_CONSUMER_REACTOR_HPP
+
+#include "common.hpp"
+#include "event_count.hpp"
+
+#include "util/log.hpp"
+
+#include <boost/scope_exit.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <cstdint>
+
+namespace ipc {
+
+/* Services many Consumers from a fixed number of threads, instead of one
+ * service thread per Consumer. A process listening on dozens of queues
+ * otherwise needs dozens of mostly idle threads, each with its own stack and
+ * its own wakeups.
+ *
+ * Each thread owns the queues added to it, and takes up to budget messages
+ * from each in turn, so one busy queue cannot starve the others. When all of
+ * its queues are empty, the thread sleeps on all of their event counts at
+ * once (see EventCount::waitAny), until a producer signals one of them, a
+ * queue is due to check for crashed producers, or the reactor is stopped.
+ * Each queue otherwise behaves as it would with its own service thread,
+ * including the spawnProducerTimeout and pollingTimeout semantics described
+ * above Consumer::startServiceThread, and a queue drops out of its thread
+ * once its producers are gone, with failState () == NO_PRODUCER. The
+ * threads exit when they have no queues left, or when stop is called.
+ *
+ * A thread sleeps efficiently on up to kFutexWaitAnyMax - 1 queues; with
+ * more, it polls them every millisecond. Handlers of queues serviced by the
+ * same thread run one at a time, so a slow handler delays the other queues
+ * on its thread. */
+class ConsumerReactor {
+public:
+    explicit ConsumerReactor (size_t threads = 1, size_t budget = 64)
+            : mWorkers(std::max<size_t>(threads, 1))
+            , mBudget(std::max<size_t>(budget, 1)) { }
+
+    ConsumerReactor (const ConsumerReactor&) = delete;
+    ConsumerReactor& operator= (const ConsumerReactor&) = delete;
+
+    ~ConsumerReactor () {
+        stop();
+    }
+
+    /* Service consumer, calling processMessage for each of its messages as
+     * Consumer::startServiceThread would. The consumer must outlive the
+     * reactor's threads, must not have a service thread of its own, and must
+     * be added before start. It is assigned to the thread with the fewest
+     * queues. */
+    template <typename Consumer, typename Handler, typename Duration1, typename Duration2>
+    void add (Consumer& consumer, Handler processMessage,
+            Duration1 spawnProducerTimeout, Duration2 pollingTimeout) {
+        assert(!mStarted);
+        auto worker = std::min_element(mWorkers.begin(), mWorkers.end(),
+                [] (const Worker& a, const Worker& b) {
+                    return a.sources.size() < b.sources.size();
+                });
+        worker->sources.emplace_back(new ConsumerSource<Consumer, Handler, Duration1, Duration2>(
+                    consumer, processMessage, spawnProducerTimeout, pollingTimeout));
+    }
+
+    void start () {
+        assert(!mStarted);
+        LOG(debug) << "Consumer reactor starting " << mWorkers.size() << " threads";
+        mStarted = true;
+        for (auto& worker : mWorkers) {
+            if (!worker.sources.empty()) {
+                Worker* w = &worker;
+                worker.thread = std::thread([this, w] () { run(*w); });
+            }
+        }
+    }
+
+    /* Wait for every thread to run out of queues. */
+    void join () {
+        for (auto& worker : mWorkers) {
+            if (worker.thread.joinable()) {
+                worker.thread.join();
+            }
+        }
+    }
+
+    /* Signal every thread to exit, and wait for them to do so. As with
+     * Consumer::stopServiceThread, this blocks only as long as it takes to
+     * finish processing the current message. */
+    void stop () {
+        LOG(debug) << "Consumer reactor stopping";
+        mStopFlag = true;
+        mStopEvents.notifyAll();
+        join();
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    /* One queue, type-erased so a thread can hold Consumers of different
+     * message types and transports. */
+    struct Source {
+        virtual ~Source () { }
+        virtual void begin () = 0;
+        virtual bool step (size_t budget, size_t& processed) = 0;
+        virtual EventCount& events () = 0;
+        virtual Clock::time_point wakeTime () const = 0;
+    };
+
+    template <typename Consumer, typename Handler, typename Duration1, typename Duration2>
+    struct ConsumerSource : Source {
+        ConsumerSource (Consumer& consumer, Handler processMessage,
+                Duration1 spawnProducerTimeout, Duration2 pollingTimeout)
+                : mConsumer(consumer)
+                , mProcessMessage(processMessage)
+                , mSpawnProducerTimeout(spawnProducerTimeout)
+                , mPollingTimeout(pollingTimeout) { }
+
+        void begin () override {
+            mConsumer.beginService(mSpawnProducerTimeout, mPollingTimeout);
+        }
+
+        bool step (size_t budget, size_t& processed) override {
+            return mConsumer.serviceStep(mProcessMessage, budget, processed);
+        }
+
+        EventCount& events () override {
+            return mConsumer.events();
+        }
+
+        Clock::time_point wakeTime () const override {
+            return mConsumer.serviceWakeTime();
+        }
+
+        Consumer& mConsumer;
+        Handler mProcessMessage;
+        Duration1 mSpawnProducerTimeout;
+        Duration2 mPollingTimeout;
+    };
+
+    struct Worker {
+        std::vector<std::unique_ptr<Source>> sources;
+        std::thread thread;
+    };
+
+    /* Give each active source a turn, and drop the ones whose producers are
+     * gone. Returns whether anything happened, in which case the caller
+     * should go round again before sleeping. */
+    bool serviceAll (std::vector<Source*>& active) {
+        bool progress = false;
+        for (size_t i = 0; i < active.size() && !mStopFlag; ) {
+            size_t processed;
+            if (!active[i]->step(mBudget, processed)) {
+                active.erase(active.begin() + i);
+                progress = true;
+                continue;
+            }
+            progress = progress || processed;
+            ++i;
+        }
+        return progress;
+    }
+
+    void run (Worker& worker) {
+        BOOST_SCOPE_EXIT(void) {
+            LOG(debug) << "Exiting consumer reactor thread";
+        } BOOST_SCOPE_EXIT_END
+
+        LOG(debug) << "Consumer reactor thread started with "
+            << worker.sources.size() << " queues";
+
+        std::vector<Source*> active;
+        for (auto& source : worker.sources) {
+            source->begin();
+            active.push_back(source.get());
+        }
+
+        /* The stop event count goes last in the wait set. */
+        std::vector<EventCount*> counts;
+        std::vector<uint32_t> keys;
+
+        while (!mStopFlag && !active.empty()) {
+            if (serviceAll(active)) {
+                continue;
+            }
+
+            counts.clear();
+            keys.clear();
+            for (auto source : active) {
+                counts.push_back(&source->events());
+                keys.push_back(source->events().prepareWait());
+            }
+            counts.push_back(&mStopEvents);
+            keys.push_back(mStopEvents.prepareWait());
+
+            if (mStopFlag || serviceAll(active)) {
+                continue;
+            }
+
+            auto wakeTime = Clock::time_point::max();
+            for (auto source : active) {
+                wakeTime = std::min(wakeTime, source->wakeTime());
+            }
+            EventCount::waitAny(counts.data(), keys.data(), counts.size(),
+                    wakeTime - Clock::now());
+        }
+    }
+
+    std::vector<Worker> mWorkers;
+    size_t mBudget;
+    bool mStarted = false;
+    std::atomic<bool> mStopFlag = { false };
+    EventCount mStopEvents;
+};
+
+}
+
+#endif
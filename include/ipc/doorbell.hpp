@@ -0,0 +1,119 @@
+#ifndef IPC_DOORBELL_HPP
+#define IPC_DOORBELL_HPP
+
+#include "errors.hpp"
+
+#include <boost/filesystem.hpp>
+
+#include <atomic>
+#include <string>
+
+#include <cerrno>
+#include <cstdint>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace ipc {
+
+/* A pollable file descriptor which any process can make readable, so a
+ * consumer can wait for its queue in an epoll (or select, or io_uring) event
+ * loop alongside its other descriptors. The descriptor is the read end of a
+ * named pipe in the system temporary directory; ringing it writes a byte,
+ * and clear reads them all back out.
+ *
+ * A doorbell is identified across processes by a 64-bit id, the creating
+ * process's pid and a counter, from which the pipe's path is derived. This is
+ * what an EventCount stores when a doorbell is armed on it; see
+ * EventCount::armDoorbell. */
+class Doorbell {
+public:
+    /* Create the named pipe and open it.
+     *
+     * Throws QueueError if the pipe cannot be created or opened. */
+    Doorbell () : mId(nextId()), mPath(path(mId)) {
+        ::unlink(mPath.c_str());
+        if (::mkfifo(mPath.c_str(), 0600) == -1) {
+            throw QueueError("Unable to create doorbell " + mPath);
+        }
+        /* Opening for writing too means we never see end-of-file when no
+         * producer has the pipe open, and lets us ring ourselves. */
+        mFd = ::open(mPath.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (mFd == -1) {
+            ::unlink(mPath.c_str());
+            throw QueueError("Unable to open doorbell " + mPath);
+        }
+    }
+
+    Doorbell (const Doorbell&) = delete;
+    Doorbell& operator= (const Doorbell&) = delete;
+
+    ~Doorbell () {
+        ::close(mFd);
+        ::unlink(mPath.c_str());
+    }
+
+    uint64_t id () const {
+        return mId;
+    }
+
+    /* Readable whenever the doorbell has been rung since the last clear. */
+    int fd () const {
+        return mFd;
+    }
+
+    /* Make fd () readable. */
+    void ring () {
+        writeByte(mFd);
+    }
+
+    /* Make fd () unreadable until the next ring. */
+    void clear () {
+        char buf[64];
+        while (::read(mFd, buf, sizeof(buf)) > 0)
+            ;
+    }
+
+    /* Ring the doorbell with the given id, from any process. The doorbell
+     * may be gone, and a full pipe is already readable, so errors are
+     * ignored. This costs an open, a write and a close, so it is reserved for
+     * waking a consumer which is actually asleep. */
+    static void ring (uint64_t id) {
+        int fd = ::open(path(id).c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd != -1) {
+            writeByte(fd);
+            ::close(fd);
+        }
+    }
+
+private:
+    static uint64_t nextId () {
+        static std::atomic<uint32_t> counter = { 0 };
+        return uint64_t(::getpid()) << 32 | ++counter;
+    }
+
+    static std::string path (uint64_t id) {
+        boost::system::error_code ec;
+        auto dir = boost::filesystem::temp_directory_path(ec);
+        if (ec) {
+            dir = "/tmp";
+        }
+        return (dir / ("ipc-doorbell-" + std::to_string(id >> 32) + "-" +
+                    std::to_string(id & 0xffffffff))).string();
+    }
+
+    static void writeByte (int fd) {
+        char c = 1;
+        while (::write(fd, &c, 1) == -1 && errno == EINTR)
+            ;
+    }
+
+    uint64_t mId;
+    std::string mPath;
+    int mFd = -1;
+};
+
+}
+
+#endif
@@ -13,6 +13,13 @@ public:
     }
 };
 
+class QueueFull : std::exception {
+public:
+    const char* what () {
+        return "Queue is full";
+    }
+};
+
 class QueueError : std::exception {
 public:
     explicit QueueError (std::string msg) : mMsg(msg) { }
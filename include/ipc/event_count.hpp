@@ -0,0 +1,153 @@
+#ifndef IPC_EVENT_COUNT_HPP
+#define IPC_EVENT_COUNT_HPP
+
+#include "common.hpp"
+#include "doorbell.hpp"
+#include "futex.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+#include <cstdint>
+
+namespace ipc {
+
+/* An event count lets lock-free data structures in shared memory block
+ * without a mutex. A waiter announces itself with prepareWait, rechecks its
+ * condition, and then calls wait only if the condition is still false. A
+ * notifier changes the shared state, then calls notifyAll. Because the waiter
+ * announces itself before its final check, and the notifier only skips the
+ * system call when no waiter has announced itself, no wakeup can be lost.
+ *
+ * The state is a single 32-bit word: bit 0 is set by waiters, and the
+ * remaining bits count notifications. notifyAll clears the bit as it wakes
+ * everybody up, so a burst of notifications costs at most one system call
+ * per time a waiter goes to sleep. The common case--notifying with nobody
+ * waiting--costs a fence and a load, which is what makes this suitable for
+ * per-message hot paths. A waiter may also arm a Doorbell, to be woken
+ * through a file descriptor instead of a futex.
+ *
+ * EventCount is standard layout and all-zeroes is its initial state, so it
+ * may be placed directly into a freshly truncated shared memory segment. */
+class EventCount {
+public:
+    uint32_t prepareWait () {
+        return mState.fetch_or(1, std::memory_order_seq_cst) | 1;
+    }
+
+    /* Block until notifyAll is called after the prepareWait which returned
+     * key, or until timeout elapses. May return spuriously. */
+    template <typename Rep, typename Period>
+    void wait (uint32_t key, std::chrono::duration<Rep, Period> timeout) {
+        futexWait(mState, key, timeout);
+    }
+
+    void wait (uint32_t key) {
+        futexWait(mState, key);
+    }
+
+    /* Block until any counts[i] is notified after the prepareWait which
+     * returned keys[i], or until timeout elapses. May return spuriously.
+     * Efficient for up to kFutexWaitAnyMax event counts; beyond that, this
+     * polls. */
+    template <typename Rep, typename Period>
+    static void waitAny (EventCount* const* counts, const uint32_t* keys, size_t count,
+            std::chrono::duration<Rep, Period> timeout) {
+        std::atomic<uint32_t>* words[kFutexWaitAnyMax];
+        if (count > kFutexWaitAnyMax) {
+            /* Too many to wait on at once, so just nap; the caller polls. */
+            futexWaitAny(words, keys, 0, std::min<std::chrono::nanoseconds>(timeout,
+                        std::chrono::milliseconds(1)));
+            return;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            words[i] = &counts[i]->mState;
+        }
+        futexWaitAny(words, keys, count, timeout);
+    }
+
+    /* Like prepareWait, but rather than (or as well as) calling wait, the
+     * waiter sleeps on the Doorbell with the given id, which the next
+     * notifyAll rings. The doorbell is disarmed once rung. */
+    uint32_t armDoorbell (uint64_t doorbell) {
+        mDoorbell.store(doorbell, std::memory_order_relaxed);
+        return prepareWait();
+    }
+
+    void notifyAll () {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto state = mState.load(std::memory_order_relaxed);
+        while (state & 1) {
+            if (mState.compare_exchange_weak(state, (state + 2) & ~1u,
+                        std::memory_order_acquire, std::memory_order_relaxed)) {
+                futexWakeAll(mState);
+                if (mDoorbell.load(std::memory_order_relaxed)) {
+                    if (auto doorbell = mDoorbell.exchange(0, std::memory_order_relaxed)) {
+                        Doorbell::ring(doorbell);
+                    }
+                }
+                return;
+            }
+        }
+    }
+
+    /* Wait until ready() returns true, or until timeout elapses. Returns the
+     * final value of ready(). ready is evaluated a small number of times
+     * before blocking, since the condition is often satisfied by the time a
+     * reader gets around to waiting. */
+    template <typename Predicate, typename Rep, typename Period>
+    bool waitFor (Predicate ready, std::chrono::duration<Rep, Period> timeout) {
+        for (int i = 0; i < kSpinCount; ++i) {
+            if (ready()) {
+                return true;
+            }
+        }
+
+        auto stopTime = std::chrono::steady_clock::now() + timeout;
+        while (true) {
+            auto key = prepareWait();
+            if (ready()) {
+                return true;
+            }
+            auto now = std::chrono::steady_clock::now();
+            if (now >= stopTime) {
+                return false;
+            }
+            wait(key, stopTime - now);
+        }
+    }
+
+private:
+    static const int kSpinCount = 16;
+
+    std::atomic<uint32_t> mState;
+
+    /* The id of the Doorbell armed on us, if any. */
+    std::atomic<uint64_t> mDoorbell;
+};
+
+/* Wait on events until ready() returns true or deadline passes, calling
+ * stalled() every stallCheckInterval while we wait, as the transports do when
+ * a queue is full. stalled may throw to abandon the wait. Returns the final
+ * value of ready(). */
+template <typename Predicate, typename Stalled>
+bool waitUntil (EventCount& events, Predicate ready, Stalled& stalled,
+        std::chrono::steady_clock::time_point deadline) {
+    using Clock = std::chrono::steady_clock;
+    while (true) {
+        auto now = Clock::now();
+        if (now >= deadline) {
+            return ready();
+        }
+        auto slice = std::min<Clock::duration>(deadline - now, stallCheckInterval());
+        if (events.waitFor(ready, slice)) {
+            return true;
+        }
+        stalled();
+    }
+}
+
+}
+
+#endif
@@ -0,0 +1,259 @@
+#ifndef IPC_FLAT_HPP
+#define IPC_FLAT_HPP
+
+#include "errors.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <new>
+#include <string>
+#include <type_traits>
+
+#include <cstdint>
+#include <cstring>
+
+namespace ipc {
+
+/* A flat encoding for messages with variable-length strings and arrays, so
+ * they need not be hand-flattened into fixed-size char arrays. A message is
+ * an ordinary standard-layout struct, its root, whose variable-length fields
+ * are FlatStrings and FlatArrays. These hold an offset, relative to the
+ * field itself, to their contents, which follow the root in the same buffer.
+ * Because the offsets are relative, the buffer means the same thing wherever
+ * it is mapped, so a consumer reads the fields in place, with no
+ * deserialization step, and the encoded message can go through any queue:
+ *
+ *   struct Fill { uint64_t quantity; double price; };
+ *   struct Order {
+ *       uint64_t id;
+ *       ipc::FlatString symbol;
+ *       ipc::FlatArray<Fill> fills;
+ *   };
+ *
+ * A producer builds the message directly in the outgoing slot, either a
+ * fixed-size FlatBuffer reserved with BasicProducer::reserve, or a
+ * variable-length record reserved with BasicProducer::reserveBytes:
+ *
+ *   ipc::FlatBuilder<Order> builder { producer.reserveBytes(1024), 1024 };
+ *   builder.root().id = 42;
+ *   builder.set(builder.root().symbol, "IBM");
+ *   auto fills = builder.allocate(builder.root().fills, 2);
+ *   ...
+ *   producer.commitBytes(builder.size());
+ *
+ * and the consumer's handler reads it where it lies:
+ *
+ *   [] (const void* data, size_t size) {
+ *       auto& order = ipc::flatRoot<Order>(data, size);
+ *       use(order.symbol.str(), order.fills[0].price);
+ *   }
+ *
+ * Array elements may themselves contain FlatStrings and FlatArrays. The
+ * encoding trusts its producer, as the rest of the library does: offsets are
+ * not checked when they are read. */
+
+/* A string of chars, NUL-terminated for convenience. All-zeroes is the empty
+ * string. */
+class FlatString {
+public:
+    const char* data () const {
+        return mSize ? reinterpret_cast<const char*>(this) + mOffset : "";
+    }
+
+    const char* c_str () const {
+        return data();
+    }
+
+    size_t size () const {
+        return mSize;
+    }
+
+    bool empty () const {
+        return !mSize;
+    }
+
+    std::string str () const {
+        return std::string(data(), mSize);
+    }
+
+private:
+    template <typename Root>
+    friend class FlatBuilder;
+
+    int32_t mOffset;
+    uint32_t mSize;
+};
+
+/* An array of standard-layout Ts. All-zeroes is the empty array. */
+template <typename T>
+class FlatArray {
+    static_assert(std::is_standard_layout<T>::value && std::is_trivially_copyable<T>::value,
+            "flat array elements must be trivially copyable standard layout types");
+public:
+    const T* data () const {
+        return reinterpret_cast<const T*>(reinterpret_cast<const char*>(this) + mOffset);
+    }
+
+    T* data () {
+        return reinterpret_cast<T*>(reinterpret_cast<char*>(this) + mOffset);
+    }
+
+    size_t size () const {
+        return mSize;
+    }
+
+    bool empty () const {
+        return !mSize;
+    }
+
+    const T& operator[] (size_t index) const {
+        assert(index < mSize);
+        return data()[index];
+    }
+
+    T& operator[] (size_t index) {
+        assert(index < mSize);
+        return data()[index];
+    }
+
+    const T* begin () const {
+        return data();
+    }
+
+    const T* end () const {
+        return data() + mSize;
+    }
+
+private:
+    template <typename Root>
+    friend class FlatBuilder;
+
+    int32_t mOffset;
+    uint32_t mSize;
+};
+
+/* A fixed-size message type holding a flat Root and up to Capacity -
+ * sizeof(Root) bytes of strings and arrays, for transports with fixed-size
+ * slots:
+ *
+ *   ipc::Producer<ipc::FlatBuffer<Order, 1024>, ipc::SpscRingTransport> producer { ... };
+ *   ipc::FlatBuilder<Order> builder { producer.reserve() };
+ *   ...
+ *   producer.commit();
+ *
+ * Every message costs Capacity bytes of queue space, however little of it
+ * is used; ByteRingTransport with reserveBytes sends only what is used. */
+template <typename Root, size_t Capacity>
+struct FlatBuffer {
+    static_assert(Capacity >= sizeof(Root), "flat buffer too small for its root");
+
+    alignas(Root) alignas(8) unsigned char bytes[Capacity];
+
+    const Root& root () const {
+        return *reinterpret_cast<const Root*>(bytes);
+    }
+};
+
+/* The root of a flat message received as bytes.
+ *
+ * Throws QueueError if the message is too short to hold a Root. */
+template <typename Root>
+const Root& flatRoot (const void* data, size_t size) {
+    if (size < sizeof(Root)) {
+        throw QueueError("Flat message too short");
+    }
+    return *static_cast<const Root*>(data);
+}
+
+/* Builds a flat message in a caller-supplied buffer, such as a reserved
+ * queue slot. The root is value-initialized (so every string and array
+ * starts out empty), and each set or allocate appends to what has been
+ * built so far. size () is the number of bytes to send.
+ *
+ * Throws QueueError if the message outgrows the buffer. */
+template <typename Root>
+class FlatBuilder {
+    static_assert(std::is_standard_layout<Root>::value && std::is_trivially_copyable<Root>::value,
+            "a flat message root must be a trivially copyable standard layout type");
+public:
+    FlatBuilder (void* buffer, size_t capacity)
+            : mBuffer(static_cast<unsigned char*>(buffer))
+            , mCapacity(capacity)
+            , mSize(sizeof(Root)) {
+        assert(reinterpret_cast<uintptr_t>(buffer) % alignof(Root) == 0);
+        if (capacity < sizeof(Root)) {
+            throw QueueError("Flat message buffer too small");
+        }
+        new (mBuffer) Root();
+    }
+
+    template <size_t Capacity>
+    explicit FlatBuilder (FlatBuffer<Root, Capacity>& buffer)
+            : FlatBuilder(buffer.bytes, Capacity) { }
+
+    Root& root () {
+        return *reinterpret_cast<Root*>(mBuffer);
+    }
+
+    size_t size () const {
+        return mSize;
+    }
+
+    /* field must be part of this message: the root, or an array element. */
+    void set (FlatString& field, const char* data, size_t size) {
+        auto dest = static_cast<char*>(append(field, size + 1, 1));
+        std::memcpy(dest, data, size);
+        dest[size] = '\0';
+        field.mSize = static_cast<uint32_t>(size);
+    }
+
+    void set (FlatString& field, const char* str) {
+        set(field, str, std::strlen(str));
+    }
+
+    void set (FlatString& field, const std::string& str) {
+        set(field, str.data(), str.size());
+    }
+
+    /* Make field an array of count value-initialized elements, and return
+     * them to be filled in. */
+    template <typename T>
+    T* allocate (FlatArray<T>& field, size_t count) {
+        auto dest = static_cast<T*>(append(field, count * sizeof(T), alignof(T)));
+        for (size_t i = 0; i < count; ++i) {
+            new (dest + i) T();
+        }
+        field.mSize = static_cast<uint32_t>(count);
+        return dest;
+    }
+
+    template <typename T>
+    void set (FlatArray<T>& field, const T* data, size_t count) {
+        std::copy(data, data + count, allocate(field, count));
+    }
+
+private:
+    /* Claim size bytes, aligned to align, at the end of the message, and
+     * point field at them. */
+    template <typename Field>
+    void* append (Field& field, size_t size, size_t align) {
+        auto fieldAddress = reinterpret_cast<unsigned char*>(&field);
+        assert(fieldAddress >= mBuffer && fieldAddress + sizeof(Field) <= mBuffer + mSize);
+
+        auto start = (mSize + align - 1) & ~(align - 1);
+        if (start + size > mCapacity || start + size < start) {
+            throw QueueError("Flat message exceeds its buffer");
+        }
+        mSize = start + size;
+        field.mOffset = static_cast<int32_t>(mBuffer + start - fieldAddress);
+        return mBuffer + start;
+    }
+
+    unsigned char* mBuffer;
+    size_t mCapacity;
+    size_t mSize;
+};
+
+}
+
+#endif
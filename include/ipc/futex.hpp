@@ -0,0 +1,134 @@
+#ifndef IPC_FUTEX_HPP
+#define IPC_FUTEX_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include <cstdint>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <climits>
+#include <ctime>
+#endif
+
+namespace ipc {
+
+/* Thin wrappers around the Linux futex system call, operating on 32-bit
+ * atomics which may live in shared memory. The process-shared (non-private)
+ * flavor of the futex operations is used, so a waiter in one process can be
+ * woken by another process which has the same memory mapped, at whatever
+ * address.
+ *
+ * On other platforms these degrade to a short sleep, so waiters effectively
+ * poll at a fine granularity. That is slower, but correct, since every caller
+ * rechecks its condition after futexWait returns. */
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+        "futex words must be plain 32-bit integers");
+
+/* Block while *word == expected, for at most timeout. May return early or
+ * spuriously; the caller must recheck its condition. */
+template <typename Rep, typename Period>
+void futexWait (std::atomic<uint32_t>& word, uint32_t expected,
+        std::chrono::duration<Rep, Period> timeout) {
+    if (timeout <= timeout.zero()) {
+        return;
+    }
+#ifdef __linux__
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(timeout).count();
+    struct timespec ts;
+    ts.tv_sec = static_cast<time_t>(ns / 1000000000);
+    ts.tv_nsec = static_cast<long>(ns % 1000000000);
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT,
+            expected, &ts, nullptr, 0);
+#else
+    if (word.load() == expected) {
+        std::this_thread::sleep_for(std::min<std::chrono::microseconds>(
+                std::chrono::duration_cast<std::chrono::microseconds>(timeout),
+                std::chrono::microseconds(100)));
+    }
+#endif
+}
+
+/* Block while *word == expected, with no timeout. */
+inline void futexWait (std::atomic<uint32_t>& word, uint32_t expected) {
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT,
+            expected, nullptr, nullptr, 0);
+#else
+    futexWait(word, expected, std::chrono::microseconds(100));
+#endif
+}
+
+/* The most words futexWaitAny can wait on without falling back to polling. */
+const size_t kFutexWaitAnyMax = 128;
+
+/* Block while *words[i] == expected[i] for every i, for at most timeout.
+ * This is futex_waitv, available since Linux 5.16. With more than
+ * kFutexWaitAnyMax words, or on older kernels, we sleep for at most a
+ * millisecond instead, so the caller polls. May return early or spuriously;
+ * the caller must recheck its conditions. */
+template <typename Rep, typename Period>
+void futexWaitAny (std::atomic<uint32_t>* const* words, const uint32_t* expected,
+        size_t count, std::chrono::duration<Rep, Period> timeout) {
+    if (timeout <= timeout.zero()) {
+        return;
+    }
+#if defined(__linux__) && defined(SYS_futex_waitv)
+    if (count && count <= kFutexWaitAnyMax) {
+        /* Same layout as struct futex_waitv, which older headers lack. */
+        struct Waiter {
+            uint64_t val;
+            uint64_t uaddr;
+            uint32_t flags;
+            uint32_t reserved;
+        } waiters[kFutexWaitAnyMax];
+        for (size_t i = 0; i < count; ++i) {
+            waiters[i].val = expected[i];
+            waiters[i].uaddr = reinterpret_cast<uintptr_t>(words[i]);
+            waiters[i].flags = 2; /* FUTEX2_SIZE_U32, process-shared */
+            waiters[i].reserved = 0;
+        }
+
+        /* futex_waitv takes an absolute timeout. */
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(timeout).count() +
+            ts.tv_nsec;
+        ts.tv_sec += static_cast<time_t>(ns / 1000000000);
+        ts.tv_nsec = static_cast<long>(ns % 1000000000);
+        if (syscall(SYS_futex_waitv, waiters, count, 0, &ts, CLOCK_MONOTONIC) != -1 ||
+                errno != ENOSYS) {
+            return;
+        }
+    }
+#endif
+    for (size_t i = 0; i < count; ++i) {
+        if (words[i]->load() != expected[i]) {
+            return;
+        }
+    }
+    std::this_thread::sleep_for(std::min<std::chrono::microseconds>(
+            std::chrono::duration_cast<std::chrono::microseconds>(timeout),
+            std::chrono::milliseconds(1)));
+}
+
+/* Wake every process and thread blocked in futexWait on word. */
+inline void futexWakeAll (std::atomic<uint32_t>& word) {
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE,
+            INT_MAX, nullptr, nullptr, 0);
+#else
+    (void)word;
+#endif
+}
+
+}
+
+#endif
@@ -0,0 +1,159 @@
+#ifndef IPC_HISTOGRAM_HPP
+#define IPC_HISTOGRAM_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <memory>
+
+#include <cstdint>
+
+namespace ipc {
+
+/* A histogram of latencies, or any other non-negative integers, in the style
+ * of HdrHistogram: values below 2048 are counted exactly, and larger values
+ * in buckets 1/1024 as wide as the power of two they fall in, so every
+ * recorded value, however large, is reproduced to three significant digits.
+ * Values of 2^40 and more (over 18 minutes, in nanoseconds) are counted as
+ * 2^40 - 1.
+ *
+ * Recording is wait-free, a few relaxed atomic increments, so any number of
+ * threads may record at once while others read. Reads are not a consistent
+ * snapshot of concurrent recording, which is fine for monitoring. The
+ * buckets take about 250 kB. */
+class LatencyHistogram {
+public:
+    LatencyHistogram () : mBuckets(new std::atomic<uint64_t>[kBucketCount]) {
+        reset();
+    }
+
+    LatencyHistogram (const LatencyHistogram&) = delete;
+    LatencyHistogram& operator= (const LatencyHistogram&) = delete;
+
+    /* Record value count times. */
+    void record (uint64_t value, uint64_t count = 1) {
+        if (value > kMaxValue) {
+            value = kMaxValue;
+        }
+        mBuckets[bucketIndex(value)].fetch_add(count, std::memory_order_relaxed);
+        mCount.fetch_add(count, std::memory_order_relaxed);
+        mSum.fetch_add(value * count, std::memory_order_relaxed);
+        auto max = mMax.load(std::memory_order_relaxed);
+        while (value > max && !mMax.compare_exchange_weak(max, value, std::memory_order_relaxed))
+            ;
+        auto min = mMin.load(std::memory_order_relaxed);
+        while (value < min && !mMin.compare_exchange_weak(min, value, std::memory_order_relaxed))
+            ;
+    }
+
+    /* Add every value recorded in other to this histogram. */
+    void merge (const LatencyHistogram& other) {
+        for (size_t i = 0; i < kBucketCount; ++i) {
+            if (auto n = other.mBuckets[i].load(std::memory_order_relaxed)) {
+                mBuckets[i].fetch_add(n, std::memory_order_relaxed);
+            }
+        }
+        mCount.fetch_add(other.count(), std::memory_order_relaxed);
+        mSum.fetch_add(other.mSum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        if (other.count()) {
+            auto max = other.max();
+            auto current = mMax.load(std::memory_order_relaxed);
+            while (max > current && !mMax.compare_exchange_weak(current, max, std::memory_order_relaxed))
+                ;
+            auto min = other.min();
+            current = mMin.load(std::memory_order_relaxed);
+            while (min < current && !mMin.compare_exchange_weak(current, min, std::memory_order_relaxed))
+                ;
+        }
+    }
+
+    void reset () {
+        for (size_t i = 0; i < kBucketCount; ++i) {
+            mBuckets[i].store(0, std::memory_order_relaxed);
+        }
+        mCount.store(0, std::memory_order_relaxed);
+        mSum.store(0, std::memory_order_relaxed);
+        mMax.store(0, std::memory_order_relaxed);
+        mMin.store(std::numeric_limits<uint64_t>::max(), std::memory_order_relaxed);
+    }
+
+    uint64_t count () const {
+        return mCount.load(std::memory_order_relaxed);
+    }
+
+    /* The largest and smallest values recorded, exactly. Both are zero if
+     * nothing has been recorded. */
+    uint64_t max () const {
+        return mMax.load(std::memory_order_relaxed);
+    }
+
+    uint64_t min () const {
+        return count() ? mMin.load(std::memory_order_relaxed) : 0;
+    }
+
+    double mean () const {
+        auto n = count();
+        return n ? double(mSum.load(std::memory_order_relaxed)) / n : 0;
+    }
+
+    /* The smallest value which at least percentile percent of the recorded
+     * values do not exceed, to within the bucket resolution. Zero if nothing
+     * has been recorded. */
+    uint64_t valueAtPercentile (double percentile) const {
+        auto n = count();
+        if (!n) {
+            return 0;
+        }
+        percentile = std::min(std::max(percentile, 0.0), 100.0);
+        auto target = std::max<uint64_t>(1, static_cast<uint64_t>(percentile / 100 * n + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kBucketCount; ++i) {
+            seen += mBuckets[i].load(std::memory_order_relaxed);
+            if (seen >= target) {
+                return std::min(highestEquivalentValue(i), max());
+            }
+        }
+        return max();
+    }
+
+private:
+    static const int kSubBucketBits = 10;
+    static const uint64_t kSubBucketCount = uint64_t(1) << kSubBucketBits;
+    static const int kMaxValueBits = 40;
+    static const uint64_t kMaxValue = (uint64_t(1) << kMaxValueBits) - 1;
+    static const size_t kBucketCount = (kMaxValueBits - kSubBucketBits + 1) * kSubBucketCount;
+
+    static int log2 (uint64_t value) {
+        return 63 - __builtin_clzll(value);
+    }
+
+    /* Values below 2 * kSubBucketCount index themselves. Above that, a value
+     * keeps its top kSubBucketBits + 1 bits, and each power of two gets the
+     * next kSubBucketCount buckets. */
+    static size_t bucketIndex (uint64_t value) {
+        if (value < 2 * kSubBucketCount) {
+            return value;
+        }
+        auto shift = log2(value) - kSubBucketBits;
+        return (shift + 1) * kSubBucketCount + ((value >> shift) - kSubBucketCount);
+    }
+
+    static uint64_t highestEquivalentValue (size_t index) {
+        if (index < 2 * kSubBucketCount) {
+            return index;
+        }
+        auto shift = index / kSubBucketCount - 1;
+        auto lowest = (index % kSubBucketCount + kSubBucketCount) << shift;
+        return lowest + (uint64_t(1) << shift) - 1;
+    }
+
+    std::unique_ptr<std::atomic<uint64_t>[]> mBuckets;
+    std::atomic<uint64_t> mCount;
+    std::atomic<uint64_t> mSum;
+    std::atomic<uint64_t> mMax;
+    std::atomic<uint64_t> mMin;
+};
+
+}
+
+#endif
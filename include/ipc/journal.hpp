@@ -0,0 +1,796 @@
+#ifndef IPC_JOURNAL_HPP
+#define IPC_JOURNAL_HPP
+
+#include "common.hpp"
+#include "errors.hpp"
+#include "event_count.hpp"
+
+#include "util/log.hpp"
+
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace ipc {
+
+namespace detail {
+
+/* The layout of a journal's head file. The messages themselves live in
+ * segment files alongside it, each holding segmentCapacity slots and named
+ * after the position of its first message. */
+struct JournalHeader {
+    static const uint32_t kMagic = 0x4a524e4c; /* "JRNL" */
+
+    std::atomic<uint32_t> magic;
+    uint32_t slotSize;
+    uint64_t segmentCapacity;
+
+    /* Writers append one message at a time under appendMutex, a robust
+     * process-shared mutex, so a writer which dies holding it cannot wedge
+     * the others. */
+    pthread_mutex_t appendMutex;
+
+    /* The position the next message will be written at. Every message before
+     * it is complete. Positions are 64 bits, so they never wrap. */
+    alignas(IPC_CACHE_LINE_SIZE) std::atomic<uint64_t> writeIndex;
+
+    /* Every message before durableIndex has been synced to disk. */
+    std::atomic<uint64_t> durableIndex;
+
+    /* The position of the next message the reader will process. */
+    alignas(IPC_CACHE_LINE_SIZE) std::atomic<uint64_t> readIndex;
+
+    /* The reader sleeps on published. */
+    alignas(IPC_CACHE_LINE_SIZE) EventCount published;
+};
+
+/* The checksum lets recovery tell a message which reached the disk whole
+ * from one torn by a crash. */
+template <typename Msg>
+struct JournalSlot {
+    uint64_t position;
+    uint64_t checksum;
+    Msg msg;
+};
+
+/* FNV-1a, a word at a time, seeded with the message's position. */
+inline uint64_t journalChecksum (uint64_t position, const void* data, size_t size) {
+    const uint64_t kPrime = 0x100000001b3;
+    auto hash = (0xcbf29ce484222325 ^ position) * kPrime;
+    auto bytes = static_cast<const unsigned char*>(data);
+    for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t), bytes += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, bytes, sizeof(word));
+        hash = (hash ^ word) * kPrime;
+    }
+    if (size) {
+        uint64_t word = 0;
+        memcpy(&word, bytes, size);
+        hash = (hash ^ word) * kPrime;
+    }
+    return hash ^ (hash >> 32);
+}
+
+inline std::string journalSegmentPath (const std::string& directory, uint64_t base) {
+    char name[32];
+    snprintf(name, sizeof(name), "%020llu.journal", static_cast<unsigned long long>(base));
+    return directory + "/" + name;
+}
+
+/* An flock(2) on a file in the journal's directory. Unlike the fcntl locks
+ * behind tmp_file_lock, these are held per open file, so a reader and a
+ * writer in the same process still exclude each other. */
+class JournalLock {
+public:
+    explicit JournalLock (const std::string& path)
+            : mPath(path)
+            , mFd(open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644)) {
+        if (mFd == -1) {
+            throw FileLockError("Unable to open " + mPath);
+        }
+    }
+
+    ~JournalLock () {
+        close(mFd);
+    }
+
+    JournalLock (const JournalLock&) = delete;
+    JournalLock& operator= (const JournalLock&) = delete;
+
+    void lock () {
+        while (flock(mFd, LOCK_EX)) {
+            if (errno != EINTR) {
+                throw FileLockError("Error locking " + mPath);
+            }
+        }
+    }
+
+    bool tryLock () {
+        return !flock(mFd, LOCK_EX | LOCK_NB);
+    }
+
+    void lockSharable () {
+        while (flock(mFd, LOCK_SH)) {
+            if (errno != EINTR) {
+                throw FileLockError("Error locking " + mPath);
+            }
+        }
+    }
+
+    void unlock () {
+        flock(mFd, LOCK_UN);
+    }
+
+private:
+    std::string mPath;
+    int mFd;
+};
+
+/* Holds a journal's appendMutex. If the last holder died with it, whatever
+ * it was appending was never published, since writeIndex had not moved, and
+ * is simply written over. */
+class JournalAppendLock {
+public:
+    explicit JournalAppendLock (pthread_mutex_t& mutex) : mMutex(mutex) {
+        auto error = pthread_mutex_lock(&mMutex);
+        if (error == EOWNERDEAD) {
+            LOG(warning) << "Journal writer died while appending; carrying on";
+            pthread_mutex_consistent(&mMutex);
+        }
+        else if (error) {
+            throw QueueError(std::string("Unable to lock journal: ") + strerror(error));
+        }
+    }
+
+    ~JournalAppendLock () {
+        pthread_mutex_unlock(&mMutex);
+    }
+
+    JournalAppendLock (const JournalAppendLock&) = delete;
+    JournalAppendLock& operator= (const JournalAppendLock&) = delete;
+
+private:
+    pthread_mutex_t& mMutex;
+};
+
+inline void initAppendMutex (pthread_mutex_t& mutex) {
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&mutex, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+}
+
+/* Write zeros to file from offset up to size bytes, so that a full disk is
+ * reported here rather than as a SIGBUS on first writing a page. Writing the
+ * zeros, rather than using fallocate, also spares every later sync the cost
+ * of converting unwritten extents. Returns 0, or the errno of the write which
+ * failed. */
+inline int zeroFillJournalFile (int file, size_t offset, size_t size) {
+    static const char zeros[1 << 16] = { };
+    while (offset < size) {
+        auto written = pwrite(file, zeros, std::min(sizeof(zeros), size - offset), offset);
+        if (written <= 0) {
+            return errno;
+        }
+        offset += written;
+    }
+    return 0;
+}
+
+/* Map a file of exactly size bytes into region, and keep a descriptor to it
+ * in fd for syncing. If create, a missing file is created and filled with
+ * zeros. Otherwise returns false if the file does not exist, or is not yet
+ * fully allocated. Throws QueueError. */
+inline bool mapJournalFile (const std::string& path, size_t size, bool create,
+        boost::interprocess::mapped_region& region, int& fd) {
+    using namespace boost::interprocess;
+    using std::swap;
+
+    auto file = open(path.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+    if (file == -1) {
+        if (!create && errno == ENOENT) {
+            return false;
+        }
+        throw QueueError("Unable to open journal file " + path + ": " + strerror(errno));
+    }
+    struct stat status;
+    if (fstat(file, &status)) {
+        close(file);
+        throw QueueError("Unable to stat journal file " + path);
+    }
+    if (status.st_size < off_t(size)) {
+        if (!create) {
+            close(file);
+            return false;
+        }
+        if (auto error = zeroFillJournalFile(file, size_t(status.st_size), size)) {
+            close(file);
+            throw QueueError("Unable to allocate journal file " + path + ": " + strerror(error));
+        }
+    }
+
+    try {
+        file_mapping mapping { path.c_str(), read_write };
+        mapped_region mapped { mapping, read_write, 0, size };
+        swap(region, mapped);
+    }
+    catch (interprocess_exception& exc) {
+        close(file);
+        throw QueueError("Unable to map journal file " + path);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    fd = file;
+    return true;
+}
+
+/* Segment files are filled in under this suffix, and then linked into
+ * place. */
+#define IPC_JOURNAL_NEW_SUFFIX ".new"
+
+/* Create the file at path, of size bytes of zeros, unless it already exists,
+ * without holding up writers. The zeros go into a file of its own, which is
+ * then linked into place, so a writer which creates the same file meanwhile,
+ * and appends to it, never has its messages zeroed. Throws QueueError. */
+inline void prepareJournalFile (const std::string& path, size_t size) {
+    static std::atomic<unsigned> counter { 0 };
+    if (!access(path.c_str(), F_OK)) {
+        return;
+    }
+    auto temporary = path + IPC_JOURNAL_NEW_SUFFIX + std::to_string(getpid()) + "-" +
+        std::to_string(counter.fetch_add(1, std::memory_order_relaxed));
+    auto file = open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (file == -1) {
+        throw QueueError("Unable to create journal file " + temporary + ": " + strerror(errno));
+    }
+    auto error = zeroFillJournalFile(file, 0, size);
+    close(file);
+    if (!error && link(temporary.c_str(), path.c_str()) && errno != EEXIST) {
+        error = errno;
+    }
+    unlink(temporary.c_str());
+    if (error) {
+        throw QueueError("Unable to allocate journal file " + path + ": " + strerror(error));
+    }
+}
+
+/* Create the journal in directory if need be, and map its head file into
+ * head. Whoever finds the head file empty initializes it, under an flock on
+ * the head file itself. Throws QueueError if the journal holds messages of
+ * another size. */
+inline JournalHeader* openJournal (const std::string& directory, size_t slotSize,
+        size_t segmentCapacity, boost::interprocess::mapped_region& head, int& headFd) {
+    try {
+        boost::filesystem::create_directories(directory);
+    }
+    catch (boost::filesystem::filesystem_error& exc) {
+        throw QueueError("Unable to create journal directory " + directory);
+    }
+
+    auto path = directory + "/head";
+    JournalLock initLock { path };
+    initLock.lock();
+    mapJournalFile(path, sizeof(JournalHeader), true, head, headFd);
+
+    auto header = static_cast<JournalHeader*>(head.get_address());
+    if (header->magic.load(std::memory_order_acquire) != JournalHeader::kMagic) {
+        header = new (head.get_address()) JournalHeader();
+        header->slotSize = static_cast<uint32_t>(slotSize);
+        header->segmentCapacity = std::max<size_t>(segmentCapacity, 1);
+        initAppendMutex(header->appendMutex);
+        header->magic.store(JournalHeader::kMagic, std::memory_order_release);
+        if (fdatasync(headFd)) {
+            throw QueueError("Unable to sync journal " + directory);
+        }
+    }
+    initLock.unlock();
+
+    if (header->slotSize != slotSize) {
+        throw QueueError("Journal " + directory + " does not hold messages of this type");
+    }
+    return header;
+}
+
+/* Whether commitInterval has passed since lastCommit, for a reader's
+ * position. Reading the clock costs more than the rest of processing a
+ * message, so it is read only every kCommitCheckInterval calls, counted in
+ * unchecked, unless commitInterval is zero. A late commit only means that the
+ * next reader may get a few messages again. */
+inline bool commitDue (std::chrono::milliseconds commitInterval,
+        std::chrono::steady_clock::time_point lastCommit, unsigned& unchecked) {
+    const unsigned kCommitCheckInterval = 16;
+    if (commitInterval.count() && ++unchecked < kCommitCheckInterval) {
+        return false;
+    }
+    unchecked = 0;
+    return std::chrono::steady_clock::now() - lastCommit >= commitInterval;
+}
+
+/* Repair a journal after a crash: messages since the last sync which did not
+ * reach the disk whole are dropped, along with everything after them, so
+ * writers carry on from the last whole message. The caller must hold the
+ * journal's writer lock exclusively, so that no writer is running. */
+template <typename Msg>
+void recoverJournal (const std::string& directory, JournalHeader& header,
+        boost::interprocess::mapped_region& head) {
+    using Slot = JournalSlot<Msg>;
+
+    /* Nobody holds the mutex now, but after a reboot it may still say
+     * otherwise. */
+    initAppendMutex(header.appendMutex);
+
+    /* A writer which died preparing a segment left its zeros behind. */
+    namespace fs = boost::filesystem;
+    try {
+        for (fs::directory_iterator it { directory }, last; it != last; ++it) {
+            if (it->path().filename().string().find(".journal" IPC_JOURNAL_NEW_SUFFIX) !=
+                    std::string::npos) {
+                fs::remove(it->path());
+            }
+        }
+    }
+    catch (fs::filesystem_error& exc) {
+        LOG(warning) << "Unable to remove unused journal segments: " << exc.what();
+    }
+
+    /* Messages before durableIndex are on disk. The reader may have processed
+     * messages after it, and deleted their segments, before they reached the
+     * disk; they are gone either way, so start past them, and do not reuse
+     * their positions. */
+    auto capacity = header.segmentCapacity;
+    auto writeIndex = header.writeIndex.load(std::memory_order_relaxed);
+    auto end = std::max(header.durableIndex.load(std::memory_order_relaxed),
+            header.readIndex.load(std::memory_order_relaxed));
+
+    boost::interprocess::mapped_region segment;
+    int fd = -1;
+    uint64_t mapped = std::numeric_limits<uint64_t>::max();
+    while (end < writeIndex) {
+        auto index = end / capacity;
+        if (index != mapped) {
+            if (!mapJournalFile(journalSegmentPath(directory, index * capacity),
+                        capacity * sizeof(Slot), false, segment, fd)) {
+                break;
+            }
+            mapped = index;
+        }
+        auto& slot = static_cast<Slot*>(segment.get_address())[end % capacity];
+        if (slot.position != end ||
+                slot.checksum != journalChecksum(end, &slot.msg, sizeof(Msg))) {
+            break;
+        }
+        ++end;
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+
+    if (end < writeIndex) {
+        LOG(warning) << "Journal " << directory << " lost " << writeIndex - end
+                     << " messages which were not synced";
+    }
+    header.writeIndex.store(end, std::memory_order_release);
+    header.durableIndex.store(std::min(header.durableIndex.load(std::memory_order_relaxed), end),
+            std::memory_order_relaxed);
+    head.flush(0, sizeof(JournalHeader), false);
+}
+
+}
+
+/* The writing end of a journal: a durable channel which keeps its messages
+ * in memory-mapped files in a directory, so they survive the reader (see
+ * JournalReader) restarting, or not running at all, and with regular syncs,
+ * a crash of the whole machine. Compare Producer and Consumer, where a
+ * queue lives only as long as its consumer.
+ *
+ * Sending appends the message to the current segment file through its
+ * mapping, under a process-shared mutex, so any number of writers, in any
+ * number of processes, may append to the same journal. A send never waits
+ * for the reader: the journal grows on disk until the reader catches up, a
+ * segment of segmentCapacity messages at a time, and the reader deletes each
+ * segment once it is done with it. Allocating a segment means writing it full
+ * of zeros, which takes a while, so the writer which sends the message
+ * halfway through a segment creates the next one, outside the mutex.
+ *
+ * A message is in the page cache once send returns, so it survives the
+ * writer process crashing. To survive the machine crashing, it must also be
+ * synced to disk. Syncs are group commits: a send syncs every message sent
+ * since the last sync, by any writer, once commitInterval has passed since
+ * this writer's last sync (by the coarse clock, so up to a scheduler tick
+ * late), so one fdatasync covers a whole interval's worth of messages. A
+ * commitInterval of zero syncs on every send. sync syncs
+ * right away, e.g., before a writer goes quiet, and the destructor syncs.
+ *
+ * Msg must be trivially copyable, and must not hold pointers, since it
+ * outlives the process which wrote it. */
+template <typename Msg>
+class JournalWriter {
+    static_assert(std::is_trivially_copyable<Msg>::value,
+            "journal messages must be trivially copyable");
+    using Header = detail::JournalHeader;
+    using Slot = detail::JournalSlot<Msg>;
+public:
+    /* Open the journal in directory, creating the directory and the journal
+     * if need be. segmentCapacity applies only to a new journal. If no other
+     * writer is running, first repair any damage from a crash.
+     *
+     * Throws QueueError if the journal cannot be created or opened, and
+     * FileLockError if there is a problem with its lock files. */
+    JournalWriter (const std::string& directory,
+            std::chrono::milliseconds commitInterval = std::chrono::milliseconds(10),
+            size_t segmentCapacity = 65536)
+            : mDirectory(directory)
+            , mHeader(detail::openJournal(mDirectory, sizeof(Slot), segmentCapacity, mHead, mHeadFd))
+            , mWriterLock(mDirectory + "/writers.lock")
+            , mCapacity(mHeader->segmentCapacity)
+            , mCommitInterval(commitInterval)
+            , mNextCommit(coarseNow() + commitInterval) {
+        if (mWriterLock.tryLock()) {
+            detail::recoverJournal<Msg>(mDirectory, *mHeader, mHead);
+        }
+        mWriterLock.lockSharable();
+        prepareSegment(mHeader->writeIndex.load(std::memory_order_relaxed) / mCapacity);
+        LOG(debug) << "JournalWriter(" << mDirectory << ") constructed";
+    }
+
+    ~JournalWriter () {
+        try {
+            sync();
+        }
+        catch (QueueError& exc) {
+            LOG(warning) << "JournalWriter(" << mDirectory << ") unable to sync: " << exc.what();
+        }
+        if (mSegmentFd != -1) {
+            close(mSegmentFd);
+        }
+        close(mHeadFd);
+        mWriterLock.unlock();
+    }
+
+    JournalWriter (const JournalWriter&) = delete;
+    JournalWriter& operator= (const JournalWriter&) = delete;
+
+    /* Append msg to the journal, and sync if commitInterval has passed.
+     * The send halfway through each segment also creates the next segment,
+     * which takes as long as writing a segment's worth of zeros, but does not
+     * hold up other writers. A send which finds its segment missing, because
+     * that failed, creates it while holding them up.
+     *
+     * Throws QueueError if a new segment cannot be allocated or a sync
+     * fails. */
+    void send (const Msg& msg) {
+        uint64_t position;
+        {
+            detail::JournalAppendLock lock { mHeader->appendMutex };
+            position = mHeader->writeIndex.load(std::memory_order_relaxed);
+            auto& slot = slotAt(position);
+            slot.msg = msg;
+            slot.position = position;
+            slot.checksum = detail::journalChecksum(position, &slot.msg, sizeof(Msg));
+            mHeader->writeIndex.store(position + 1, std::memory_order_release);
+            mWritten = position + 1;
+        }
+        mHeader->published.notifyAll();
+
+        if (position % mCapacity == mCapacity / 2) {
+            prepareSegment(position / mCapacity + 1);
+        }
+
+        if (!mCommitInterval.count() || coarseNow() >= mNextCommit) {
+            sync();
+        }
+    }
+
+    /* Make every message this writer has sent durable, along with every
+     * message other writers sent before them. Throws QueueError if the
+     * system cannot sync. */
+    void sync () {
+        mNextCommit = coarseNow() + mCommitInterval;
+        auto durable = mHeader->durableIndex.load(std::memory_order_acquire);
+        if (durable >= mWritten) {
+            return;
+        }
+        for (auto index = durable / mCapacity; index <= (mWritten - 1) / mCapacity; ++index) {
+            syncSegment(index);
+        }
+        while (durable < mWritten &&
+                !mHeader->durableIndex.compare_exchange_weak(durable, mWritten,
+                    std::memory_order_release, std::memory_order_acquire))
+            ;
+        if (fdatasync(mHeadFd)) {
+            throw QueueError("Unable to sync journal " + mDirectory);
+        }
+    }
+
+    /* The number of messages ever written to the journal. */
+    uint64_t position () const {
+        return mHeader->writeIndex.load(std::memory_order_relaxed);
+    }
+
+    /* The number of messages, from the first, which have been synced to
+     * disk. */
+    uint64_t durablePosition () const {
+        return mHeader->durableIndex.load(std::memory_order_relaxed);
+    }
+
+private:
+    Slot& slotAt (uint64_t position) {
+        auto index = position / mCapacity;
+        if (index != mSegmentIndex) {
+            detail::mapJournalFile(detail::journalSegmentPath(mDirectory, index * mCapacity),
+                    mCapacity * sizeof(Slot), true, mSegment, mSegmentFd);
+            mSegmentIndex = index;
+        }
+        return static_cast<Slot*>(mSegment.get_address())[position % mCapacity];
+    }
+
+    /* Create segment index ahead of time. If that fails, slotAt tries again,
+     * and reports the error. */
+    void prepareSegment (uint64_t index) {
+        try {
+            detail::prepareJournalFile(detail::journalSegmentPath(mDirectory, index * mCapacity),
+                    mCapacity * sizeof(Slot));
+        }
+        catch (QueueError& exc) {
+            LOG(warning) << "JournalWriter(" << mDirectory << ") " << exc.what();
+        }
+    }
+
+    /* A segment behind ours is opened just for the sync, and one the reader
+     * has already deleted needs no syncing. */
+    void syncSegment (uint64_t index) {
+        if (index == mSegmentIndex) {
+            if (fdatasync(mSegmentFd)) {
+                throw QueueError("Unable to sync journal " + mDirectory);
+            }
+            return;
+        }
+        auto path = detail::journalSegmentPath(mDirectory, index * mCapacity);
+        auto fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+        if (fd == -1) {
+            return;
+        }
+        auto failed = fdatasync(fd);
+        close(fd);
+        if (failed) {
+            throw QueueError("Unable to sync journal " + mDirectory);
+        }
+    }
+
+    std::string mDirectory;
+    boost::interprocess::mapped_region mHead;
+    int mHeadFd = -1;
+    Header* mHeader;
+    detail::JournalLock mWriterLock;
+    uint64_t mCapacity;
+
+    boost::interprocess::mapped_region mSegment;
+    int mSegmentFd = -1;
+    uint64_t mSegmentIndex = std::numeric_limits<uint64_t>::max();
+
+    std::chrono::milliseconds mCommitInterval;
+    std::chrono::nanoseconds mNextCommit;
+    uint64_t mWritten = 0;
+};
+
+/* The reading end of a journal (see JournalWriter). A journal has at most
+ * one reader at a time, which processes every message in order, in place in
+ * the mapped segment files, and keeps its position in the journal's head
+ * file, so a new reader carries on where the last one left off.
+ *
+ * The position moves past a message only once the handler returns, so a
+ * reader which crashes, or whose handler throws, gets the message again next
+ * time: delivery is at least once. The position is in the page cache as
+ * soon as it moves, so it survives the reader process crashing; like
+ * messages, it is synced to disk every commitInterval, or by commit. A
+ * segment file is deleted once the reader's position is past it, and synced.
+ *
+ * Every position before the writers' is a whole message, so the reader
+ * needs no locks: a message is ready when the write index is past it. */
+template <typename Msg>
+class JournalReader {
+    static_assert(std::is_trivially_copyable<Msg>::value,
+            "journal messages must be trivially copyable");
+    using Header = detail::JournalHeader;
+    using Slot = detail::JournalSlot<Msg>;
+    using Clock = std::chrono::steady_clock;
+public:
+    /* Open the journal in directory, creating the directory and the journal
+     * if need be. segmentCapacity applies only to a new journal. If no writer
+     * is running, first repair any damage from a crash.
+     *
+     * Throws QueueError if the journal already has a reader, or cannot be
+     * created or opened, and FileLockError if there is a problem with its
+     * lock files. */
+    JournalReader (const std::string& directory,
+            std::chrono::milliseconds commitInterval = std::chrono::milliseconds(10),
+            size_t segmentCapacity = 65536)
+            : mDirectory(directory)
+            , mHeader(detail::openJournal(mDirectory, sizeof(Slot), segmentCapacity, mHead, mHeadFd))
+            , mReaderLock(mDirectory + "/reader.lock")
+            , mCapacity(mHeader->segmentCapacity)
+            , mCommitInterval(commitInterval)
+            , mLastCommit(Clock::now()) {
+        if (!mReaderLock.tryLock()) {
+            close(mHeadFd);
+            throw QueueError("Journal " + mDirectory + " already has a reader");
+        }
+        detail::JournalLock writerLock { mDirectory + "/writers.lock" };
+        if (writerLock.tryLock()) {
+            detail::recoverJournal<Msg>(mDirectory, *mHeader, mHead);
+            writerLock.unlock();
+        }
+        mReadIndex = mHeader->readIndex.load(std::memory_order_relaxed);
+        removeSegmentsBefore(mReadIndex / mCapacity);
+        LOG(debug) << "JournalReader(" << mDirectory << ") constructed at " << mReadIndex;
+    }
+
+    ~JournalReader () {
+        try {
+            commit();
+        }
+        catch (QueueError& exc) {
+            LOG(warning) << "JournalReader(" << mDirectory << ") unable to sync: " << exc.what();
+        }
+        if (mSegmentFd != -1) {
+            close(mSegmentFd);
+        }
+        close(mHeadFd);
+        mReaderLock.unlock();
+    }
+
+    JournalReader (const JournalReader&) = delete;
+    JournalReader& operator= (const JournalReader&) = delete;
+
+    /* Process the next message with processMessage(const Msg&), if one is
+     * ready. Returns whether there was one. */
+    template <typename Handler>
+    bool tryReceiveAndProcess (Handler&& processMessage) {
+        if (!ready()) {
+            return false;
+        }
+        process(processMessage);
+        return true;
+    }
+
+    /* Like tryReceiveAndProcess, but wait up to timeout for a message. */
+    template <typename Rep, typename Period, typename Handler>
+    bool timedReceiveAndProcess (std::chrono::duration<Rep, Period> timeout,
+            Handler&& processMessage) {
+        if (!mHeader->published.waitFor([this] () { return ready(); }, timeout)) {
+            return false;
+        }
+        process(processMessage);
+        return true;
+    }
+
+    /* Sync the reader's position to disk. Throws QueueError if the system
+     * cannot sync. */
+    void commit () {
+        mLastCommit = Clock::now();
+        if (fdatasync(mHeadFd)) {
+            throw QueueError("Unable to sync journal " + mDirectory);
+        }
+    }
+
+    /* The position of the next message to be processed, counting from the
+     * journal's first message. */
+    uint64_t position () const {
+        return mReadIndex;
+    }
+
+    /* The number of messages written but not yet processed. */
+    uint64_t backlog () const {
+        return mHeader->writeIndex.load(std::memory_order_relaxed) - mReadIndex;
+    }
+
+    /* The number of messages skipped because they were corrupt on disk. */
+    uint64_t corruptMessages () const {
+        return mCorruptMessages;
+    }
+
+private:
+    bool ready () const {
+        return mReadIndex < mHeader->writeIndex.load(std::memory_order_acquire);
+    }
+
+    template <typename Handler>
+    void process (Handler& processMessage) {
+        auto& slot = slotAt(mReadIndex);
+        if (slot.position == mReadIndex &&
+                slot.checksum == detail::journalChecksum(mReadIndex, &slot.msg, sizeof(Msg))) {
+            processMessage(static_cast<const Msg&>(slot.msg));
+        }
+        else {
+            LOG(warning) << "Journal " << mDirectory << " message " << mReadIndex
+                         << " is corrupt; skipping it";
+            ++mCorruptMessages;
+        }
+        mHeader->readIndex.store(++mReadIndex, std::memory_order_release);
+
+        if (!(mReadIndex % mCapacity)) {
+            /* Done with the segment: make sure the position past it is on
+             * disk before deleting it. */
+            commit();
+            removeSegmentsBefore(mReadIndex / mCapacity);
+        }
+        else if (detail::commitDue(mCommitInterval, mLastCommit, mUncheckedCommits)) {
+            commit();
+        }
+    }
+
+    Slot& slotAt (uint64_t position) {
+        auto index = position / mCapacity;
+        if (index != mSegmentIndex) {
+            auto path = detail::journalSegmentPath(mDirectory, index * mCapacity);
+            if (!detail::mapJournalFile(path, mCapacity * sizeof(Slot), false, mSegment, mSegmentFd)) {
+                throw QueueError("Journal segment " + path + " is missing");
+            }
+            mSegmentIndex = index;
+        }
+        return static_cast<Slot*>(mSegment.get_address())[position % mCapacity];
+    }
+
+    /* Delete the segment files before segment index, including any left by
+     * a reader which crashed between syncing its position and deleting
+     * them. */
+    void removeSegmentsBefore (uint64_t index) {
+        namespace fs = boost::filesystem;
+        try {
+            for (fs::directory_iterator it { mDirectory }, end; it != end; ++it) {
+                auto name = it->path().filename().string();
+                if (name.size() == 28 && name.compare(20, 8, ".journal") == 0 &&
+                        std::stoull(name.substr(0, 20)) / mCapacity < index) {
+                    fs::remove(it->path());
+                }
+            }
+        }
+        catch (fs::filesystem_error& exc) {
+            LOG(warning) << "Unable to remove old journal segments: " << exc.what();
+        }
+    }
+
+    std::string mDirectory;
+    boost::interprocess::mapped_region mHead;
+    int mHeadFd = -1;
+    Header* mHeader;
+    detail::JournalLock mReaderLock;
+    uint64_t mCapacity;
+
+    boost::interprocess::mapped_region mSegment;
+    int mSegmentFd = -1;
+    uint64_t mSegmentIndex = std::numeric_limits<uint64_t>::max();
+
+    std::chrono::milliseconds mCommitInterval;
+    Clock::time_point mLastCommit;
+    unsigned mUncheckedCommits = 0;
+    uint64_t mReadIndex = 0;
+    uint64_t mCorruptMessages = 0;
+};
+
+}
+
+#endif
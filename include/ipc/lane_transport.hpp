@@ -0,0 +1,254 @@
+#ifndef IPC_LANE_TRANSPORT_HPP
+#define IPC_LANE_TRANSPORT_HPP
+
+#include "common.hpp"
+#include "errors.hpp"
+#include "event_count.hpp"
+#include "mpsc_ring_transport.hpp"
+
+#include <boost/interprocess/creation_tags.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+
+#include <cstdint>
+
+namespace ipc {
+
+namespace detail {
+
+constexpr bool allZero () {
+    return true;
+}
+
+template <typename... Rest>
+constexpr bool allZero (unsigned first, Rest... rest) {
+    return !first && allZero(rest...);
+}
+
+}
+
+/* A queue made of several independent queues, or lanes, so urgent messages
+ * (shutdown, reconfiguration) can overtake bulk data. See
+ * message_queue_transport.hpp for the transport interface.
+ *
+ * Each lane is a separate queue of the Ring transport, with the full
+ * capacity, named after the queue with "-lane" and the lane number appended.
+ * Lanes are numbered from zero, and a higher lane is more urgent, as with
+ * message_queue priorities. The ordinary transport operations (send,
+ * trySend, reserve, and so on) use lane 0; BasicProducer::send (msg, lane)
+ * chooses a lane. Messages within a lane keep their order; messages in
+ * different lanes do not.
+ *
+ * Weights (one per lane, so there are sizeof...(Weights) lanes) decide how
+ * the consumer drains the lanes. If every weight is zero, draining is strict:
+ * the consumer always takes from the highest lane which has a message, so a
+ * saturated urgent lane starves the others. Otherwise, the consumer visits
+ * the lanes in turn, highest first, taking up to a lane's weight in messages
+ * before moving on; a lane with weight zero is then never drained. Either
+ * way, choosing a lane costs one check per lane, rather than the sorted
+ * insertion message_queue does for priorities.
+ *
+ * Use PriorityLanes or WeightedLanes below to name a LaneTransport as a
+ * Transport parameter. */
+template <typename Msg, template <typename> class Ring, unsigned... Weights>
+class LaneTransport {
+    static_assert(sizeof...(Weights) >= 1, "a lane transport needs at least one lane");
+public:
+    static const size_t lanes = sizeof...(Weights);
+    static const bool multiProducer = Ring<Msg>::multiProducer;
+    static const bool canOverwrite = Ring<Msg>::canOverwrite;
+
+    static bool remove (const char* name) {
+        bool removed = true;
+        for (size_t i = 0; i < lanes; ++i) {
+            removed = Ring<Msg>::remove(laneName(name, i).c_str()) && removed;
+        }
+        return removed;
+    }
+
+    LaneTransport (boost::interprocess::create_only_t, const char* name,
+            size_t capacity, unsigned options = 0) {
+        using namespace boost::interprocess;
+        for (size_t i = 0; i < lanes; ++i) {
+            mLanes[i].reset(new Ring<Msg>(create_only, laneName(name, i).c_str(),
+                        capacity, options));
+        }
+    }
+
+    LaneTransport (boost::interprocess::open_only_t, const char* name) {
+        using namespace boost::interprocess;
+        for (size_t i = 0; i < lanes; ++i) {
+            mLanes[i].reset(new Ring<Msg>(open_only, laneName(name, i).c_str()));
+        }
+    }
+
+    LaneTransport (const LaneTransport&) = delete;
+    LaneTransport& operator= (const LaneTransport&) = delete;
+
+    /* Throws QueueError if there is no such lane. */
+    Ring<Msg>& lane (size_t index) {
+        if (index >= lanes) {
+            throw QueueError("No lane " + std::to_string(index));
+        }
+        return *mLanes[index];
+    }
+
+    /* The capacity of each lane. */
+    size_t capacity () const {
+        return mLanes[0]->capacity();
+    }
+
+    template <typename Stalled>
+    void send (const Msg& msg, EventCount& consumerEvents, Stalled stalled) {
+        mLanes[0]->send(msg, consumerEvents, stalled);
+    }
+
+    template <typename Stalled>
+    void sendBatch (const Msg* msgs, size_t count, EventCount& consumerEvents,
+            Stalled stalled) {
+        mLanes[0]->sendBatch(msgs, count, consumerEvents, stalled);
+    }
+
+    bool trySend (const Msg& msg, EventCount& consumerEvents) {
+        return mLanes[0]->trySend(msg, consumerEvents);
+    }
+
+    template <typename Stalled>
+    bool timedSend (const Msg& msg, EventCount& consumerEvents, Stalled stalled,
+            std::chrono::steady_clock::time_point deadline) {
+        return mLanes[0]->timedSend(msg, consumerEvents, stalled, deadline);
+    }
+
+    template <typename Stalled>
+    size_t sendOverwriting (const Msg& msg, EventCount& consumerEvents, Stalled stalled) {
+        return mLanes[0]->sendOverwriting(msg, consumerEvents, stalled);
+    }
+
+    template <typename Stalled>
+    Msg& reserve (Stalled stalled) {
+        return mLanes[0]->reserve(stalled);
+    }
+
+    template <typename Stalled>
+    void commit (EventCount& consumerEvents, Stalled stalled) {
+        mLanes[0]->commit(consumerEvents, stalled);
+    }
+
+    template <typename F>
+    bool tryConsume (F&& f) {
+        if (kStrict) {
+            for (size_t i = lanes; i--; ) {
+                if (mLanes[i]->tryConsume(f)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /* Visit every lane once, plus the current lane again, in case it
+         * was out of credit when we started. */
+        for (size_t i = 0; i <= lanes; ++i) {
+            if (mCredit && mLanes[mLane]->tryConsume(f)) {
+                --mCredit;
+                return true;
+            }
+            nextLane();
+        }
+        return false;
+    }
+
+    template <typename F>
+    size_t tryConsumeBatch (Msg* scratch, size_t max, F&& f) {
+        if (kStrict) {
+            for (size_t i = lanes; i--; ) {
+                if (auto count = mLanes[i]->tryConsumeBatch(scratch, max, f)) {
+                    return count;
+                }
+            }
+            return 0;
+        }
+
+        for (size_t i = 0; i <= lanes; ++i) {
+            if (mCredit) {
+                if (auto count = mLanes[mLane]->tryConsumeBatch(scratch,
+                            std::min<size_t>(max, mCredit), f)) {
+                    mCredit -= static_cast<uint32_t>(count);
+                    return count;
+                }
+            }
+            nextLane();
+        }
+        return 0;
+    }
+
+private:
+    static const unsigned kWeights[sizeof...(Weights)];
+    static const bool kStrict = detail::allZero(Weights...);
+
+    static std::string laneName (const char* name, size_t index) {
+        return std::string(name) + "-lane" + std::to_string(index);
+    }
+
+    /* Move down to the next lane, wrapping around to the highest, and give
+     * it its weight in credit. */
+    void nextLane () {
+        mLane = mLane ? mLane - 1 : lanes - 1;
+        mCredit = kWeights[mLane];
+    }
+
+    std::unique_ptr<Ring<Msg>> mLanes[sizeof...(Weights)];
+
+    /* The lane weighted draining is currently visiting, and how many more
+     * messages it may take from it. */
+    size_t mLane = lanes - 1;
+    uint32_t mCredit = kWeights[lanes - 1];
+};
+
+template <typename Msg, template <typename> class Ring, unsigned... Weights>
+const unsigned LaneTransport<Msg, Ring, Weights...>::kWeights[sizeof...(Weights)] = { Weights... };
+
+template <typename Msg, template <typename> class Ring, unsigned... Weights>
+const size_t LaneTransport<Msg, Ring, Weights...>::lanes;
+
+namespace detail {
+
+/* StrictLanes<N> has a Transport alias with N zero weights. */
+template <size_t N, unsigned... Zeroes>
+struct StrictLanes : StrictLanes<N - 1, 0, Zeroes...> { };
+
+template <unsigned... Zeroes>
+struct StrictLanes<0, Zeroes...> {
+    template <typename Msg, template <typename> class Ring>
+    using Transport = LaneTransport<Msg, Ring, Zeroes...>;
+};
+
+}
+
+/* Lanes drained in strict priority order, e.g.
+ *
+ *   Consumer<Msg, 1024, PriorityLanes<2>::Transport>
+ *
+ * for a bulk lane 0 and an urgent lane 1. */
+template <size_t Lanes, template <typename> class Ring = MpscRingTransport>
+struct PriorityLanes {
+    template <typename Msg>
+    using Transport = typename detail::StrictLanes<Lanes>::template Transport<Msg, Ring>;
+};
+
+/* Lanes drained by weight, one weight per lane, e.g.
+ *
+ *   Consumer<Msg, 1024, WeightedLanes<MpscRingTransport, 1, 8>::Transport>
+ *
+ * takes up to eight messages from lane 1 for every one from lane 0. */
+template <template <typename> class Ring, unsigned... Weights>
+struct WeightedLanes {
+    template <typename Msg>
+    using Transport = LaneTransport<Msg, Ring, Weights...>;
+};
+
+}
+
+#endif
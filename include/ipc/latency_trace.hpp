@@ -0,0 +1,85 @@
+#ifndef IPC_LATENCY_TRACE_HPP
+#define IPC_LATENCY_TRACE_HPP
+
+#include "histogram.hpp"
+
+#include <atomic>
+#include <chrono>
+
+#include <cstdint>
+
+/* Per-message latency tracing (see traced_transport.hpp) is compiled in only
+ * if IPC_TRACE_LATENCY is nonzero, e.g., with cmake -DIPC_TRACE_LATENCY=ON.
+ * Otherwise Traced transports are their untraced rings, and tracing costs
+ * nothing at all. */
+#ifndef IPC_TRACE_LATENCY
+#define IPC_TRACE_LATENCY 0
+#endif
+
+namespace ipc {
+
+/* What a consumer has learned by tracing its messages, in nanoseconds:
+ *
+ *   - queueLatency: from the producer's send to the consumer taking the
+ *     message out of the queue
+ *   - handlerLatency: from taking the message out of the queue to the
+ *     handler returning. A batch handler's time counts once for every
+ *     message in the batch.
+ *   - sequenceGaps: the number of messages which went missing between a
+ *     producer's send and the consumer, e.g., discarded by
+ *     OVERFLOW_OVERWRITE_OLDEST
+ *
+ * The consumer records as it goes, and any thread may read at any time; see
+ * LatencyHistogram. */
+class LatencyTrace {
+public:
+    const LatencyHistogram& queueLatency () const {
+        return mQueueLatency;
+    }
+
+    const LatencyHistogram& handlerLatency () const {
+        return mHandlerLatency;
+    }
+
+    uint64_t sequenceGaps () const {
+        return mSequenceGaps.load(std::memory_order_relaxed);
+    }
+
+    /* Start over, e.g., after a warm-up period. Recording concurrently with
+     * a reset may leave a few stray values. */
+    void reset () {
+        mQueueLatency.reset();
+        mHandlerLatency.reset();
+        mSequenceGaps.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    template <typename Msg, template <typename> class Ring>
+    friend class TracedTransport;
+
+    LatencyHistogram mQueueLatency;
+    LatencyHistogram mHandlerLatency;
+    std::atomic<uint64_t> mSequenceGaps = { 0 };
+};
+
+/* Transports which do not trace have no LatencyTrace. TracedTransport
+ * overloads this. */
+template <typename Transport>
+LatencyTrace* latencyTraceOf (Transport&) {
+    return nullptr;
+}
+
+namespace detail {
+
+/* The clock messages are stamped with: CLOCK_MONOTONIC, which, unlike the
+ * TSC, every process agrees on without calibration. */
+inline uint64_t traceClock () {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+}
+
+}
+
+#endif
@@ -0,0 +1,244 @@
+#ifndef IPC_MESSAGE_QUEUE_TRANSPORT_HPP
+#define IPC_MESSAGE_QUEUE_TRANSPORT_HPP
+
+#include "common.hpp"
+#include "errors.hpp"
+#include "event_count.hpp"
+
+#include "util/async_log.hpp"
+#include "util/log.hpp"
+#include "util/std_chrono_duration_to_posix_time_duration.hpp"
+
+#include <boost/interprocess/ipc/message_queue.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+
+namespace ipc {
+
+/* Transports are the layer underneath Consumer and BasicProducer which
+ * actually moves messages between processes. A transport is a class template
+ * over the message type which provides:
+ *
+ *   - static const bool multiProducer: whether more than one process may send
+ *     on the same queue at once, i.e., whether it may back a SharedProducer
+ *   - static bool remove (const char* name): destroy any queue named name
+ *   - a constructor taking (create_only, name, capacity, options), used by
+ *     Consumer, where options is a combination of SegmentOption flags (see
+ *     shm_segment.hpp). Transports which map their own shared memory record
+ *     the options alongside the queue.
+ *   - a constructor taking (open_only, name), used by BasicProducer, which
+ *     discovers the capacity (and mapping options) from the queue itself
+ *   - size_t capacity () const: the capacity the queue was created with,
+ *     after any rounding
+ *   - void send (const Msg&, EventCount& consumerEvents, Stalled stalled),
+ *     which blocks while the queue is full, calling stalled() every
+ *     stallCheckInterval while it waits; stalled may throw to abandon the
+ *     send. consumerEvents is signalled once the message is published.
+ *   - bool trySend (const Msg&, EventCount& consumerEvents), which returns
+ *     false immediately if the queue is full
+ *   - bool timedSend (const Msg&, EventCount&, Stalled,
+ *     std::chrono::steady_clock::time_point deadline), which blocks like send
+ *     but returns false if the queue is still full at deadline
+ *   - static const bool canOverwrite, and if it is true,
+ *     size_t sendOverwriting (const Msg&, EventCount&, Stalled), which makes
+ *     room in a full queue by discarding the oldest messages in it, and
+ *     returns how many it discarded
+ *   - void sendBatch (const Msg*, size_t, EventCount&, Stalled), which does
+ *     the same for an array of messages, publishing them together where
+ *     possible and signalling consumerEvents as few times as it can
+ *   - Msg& reserve (Stalled stalled), which waits as send does for room in
+ *     the queue and returns a message for the caller to fill in, and
+ *     void commit (EventCount& consumerEvents, Stalled stalled), which
+ *     publishes it. Transports backed by shared memory slots return the slot
+ *     itself, so the message is never copied on the producer side. At most
+ *     one reservation may be outstanding per transport object.
+ *   - bool tryConsume (F f), which calls f (const Msg&) with the message at
+ *     the head of the queue, or returns false immediately if the queue is
+ *     empty. Where possible the reference points into the queue, and the
+ *     slot is only released to producers once f returns (or throws).
+ *   - size_t tryConsumeBatch (Msg* scratch, size_t max, F f), which calls
+ *     f (const Msg*, size_t) once with up to max available messages, and
+ *     returns how many it delivered, or zero without calling f if there were
+ *     none. The messages are delivered in place if they are contiguous in the
+ *     queue, and otherwise copied into scratch.
+ *
+ * The consumer sleeps on the consumerEvents EventCount, which lives in the
+ * queue's ChannelControlBlock rather than in the transport.
+ *
+ * Construction failures are reported with QueueError.
+ *
+ * MessageQueueTransport is the default: a Boost.Interprocess message_queue.
+ * It is portable and supports any number of producers, at the cost of a
+ * process-shared mutex and condition variable on every operation. */
+template <typename Msg>
+class MessageQueueTransport {
+public:
+    static const bool multiProducer = true;
+    static const bool canOverwrite = true;
+
+    static bool remove (const char* name) {
+        return boost::interprocess::message_queue::remove(name);
+    }
+
+    /* message_queue maps its own memory, so options are ignored. */
+    MessageQueueTransport (boost::interprocess::create_only_t, const char* name,
+            size_t capacity, unsigned = 0) {
+        using namespace boost::interprocess;
+        try {
+            mQueue.reset(new message_queue(create_only, name, capacity, sizeof(Msg)));
+        }
+        catch (interprocess_exception& exc) {
+            throw QueueError(std::string("Unable to create queue named ") + name);
+        }
+    }
+
+    MessageQueueTransport (boost::interprocess::open_only_t, const char* name) {
+        using namespace boost::interprocess;
+        try {
+            mQueue.reset(new message_queue(open_only, name));
+        }
+        catch (interprocess_exception& exc) {
+            throw QueueError("Unable to open queue");
+        }
+    }
+
+    size_t capacity () const {
+        return mQueue->get_max_msg();
+    }
+
+    template <typename Stalled>
+    void send (const Msg& msg, EventCount& consumerEvents, Stalled stalled) {
+        if (!mQueue->try_send(&msg, sizeof(msg), 0)) {
+            while (!mQueue->timed_send(&msg, sizeof(msg), 0,
+                        boost::posix_time::microsec_clock::universal_time() +
+                        stdChronoDurationToPosixTimeDuration(stallCheckInterval()))) {
+                stalled();
+            }
+        }
+        consumerEvents.notifyAll();
+    }
+
+    bool trySend (const Msg& msg, EventCount& consumerEvents) {
+        if (!mQueue->try_send(&msg, sizeof(msg), 0)) {
+            return false;
+        }
+        consumerEvents.notifyAll();
+        return true;
+    }
+
+    template <typename Stalled>
+    bool timedSend (const Msg& msg, EventCount& consumerEvents, Stalled stalled,
+            std::chrono::steady_clock::time_point deadline) {
+        using Clock = std::chrono::steady_clock;
+        if (!mQueue->try_send(&msg, sizeof(msg), 0)) {
+            while (true) {
+                auto now = Clock::now();
+                if (now >= deadline) {
+                    return false;
+                }
+                auto slice = std::min<Clock::duration>(deadline - now, stallCheckInterval());
+                if (mQueue->timed_send(&msg, sizeof(msg), 0,
+                            boost::posix_time::microsec_clock::universal_time() +
+                            stdChronoDurationToPosixTimeDuration(slice))) {
+                    break;
+                }
+                stalled();
+            }
+        }
+        consumerEvents.notifyAll();
+        return true;
+    }
+
+    /* The queue is protected by a mutex, so we can simply receive the
+     * messages we want to discard. The consumer may beat us to them, in
+     * which case there is nothing to discard. We receive them directly, not
+     * with tryReceive, which logs on the consumer's behalf. */
+    template <typename Stalled>
+    size_t sendOverwriting (const Msg& msg, EventCount& consumerEvents, Stalled) {
+        size_t discarded = 0;
+        Msg oldest;
+        boost::interprocess::message_queue::size_type nReceivedBytes;
+        unsigned int priority;
+        while (!mQueue->try_send(&msg, sizeof(msg), 0)) {
+            if (mQueue->try_receive(&oldest, sizeof(oldest), nReceivedBytes, priority)) {
+                ++discarded;
+            }
+        }
+        consumerEvents.notifyAll();
+        return discarded;
+    }
+
+    /* message_queue has no batch operations, so a batch costs one mutex
+     * round trip per message. The consumer is only signalled before we block
+     * and at the end. */
+    template <typename Stalled>
+    void sendBatch (const Msg* msgs, size_t count, EventCount& consumerEvents,
+            Stalled stalled) {
+        for (size_t i = 0; i < count; ++i) {
+            if (!mQueue->try_send(&msgs[i], sizeof(Msg), 0)) {
+                consumerEvents.notifyAll();
+                send(msgs[i], consumerEvents, stalled);
+            }
+        }
+        consumerEvents.notifyAll();
+    }
+
+    /* message_queue copies messages in and out of its own buffers, so the
+     * reservation is staged in this object and sent on commit. */
+    template <typename Stalled>
+    Msg& reserve (Stalled) {
+        return mStaging;
+    }
+
+    template <typename Stalled>
+    void commit (EventCount& consumerEvents, Stalled stalled) {
+        send(mStaging, consumerEvents, stalled);
+    }
+
+    template <typename F>
+    bool tryConsume (F&& f) {
+        Msg msg;
+        if (tryReceive(msg)) {
+            f(static_cast<const Msg&>(msg));
+            return true;
+        }
+        return false;
+    }
+
+    template <typename F>
+    size_t tryConsumeBatch (Msg* scratch, size_t max, F&& f) {
+        size_t count = 0;
+        while (count < max && tryReceive(scratch[count])) {
+            ++count;
+        }
+        if (count) {
+            f(static_cast<const Msg*>(scratch), count);
+        }
+        return count;
+    }
+
+private:
+    bool tryReceive (Msg& msg) {
+        /* Things we have to receive because we're using Boost.Interprocess
+         * message_queues, but don't care about. */
+        boost::interprocess::message_queue::size_type nReceivedBytes;
+        unsigned int priority;
+
+        if (mQueue->try_receive(&msg, sizeof(msg), nReceivedBytes, priority)) {
+            ALOG(debug) << "Consumer got msg with size " << nReceivedBytes
+                       << ", priority " << priority;
+            return true;
+        }
+        return false;
+    }
+
+    std::unique_ptr<boost::interprocess::message_queue> mQueue;
+    Msg mStaging;
+};
+
+}
+
+#endif
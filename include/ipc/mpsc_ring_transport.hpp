@@ -0,0 +1,371 @@
+#ifndef IPC_MPSC_RING_TRANSPORT_HPP
+#define IPC_MPSC_RING_TRANSPORT_HPP
+
+#include "common.hpp"
+#include "errors.hpp"
+#include "event_count.hpp"
+#include "shm_segment.hpp"
+
+#include <boost/interprocess/exceptions.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include <cstdint>
+#include <cstring>
+
+namespace ipc {
+
+/* A multi-producer, single-consumer ring buffer in a POSIX shared memory
+ * segment, after Dmitry Vyukov's bounded queue. See
+ * message_queue_transport.hpp for the transport interface.
+ *
+ * Every slot carries a sequence number which says whose turn it is: a slot at
+ * ring position pos is free for the producer which claimed pos when its
+ * sequence equals pos, and holds a message for the consumer when its sequence
+ * equals pos + 1. A producer claims a position with a single fetch-add on
+ * enqueueIndex, so producers never wait on each other--only on the consumer,
+ * when the ring is full. The consumer then hands the slot to the producer one
+ * lap ahead by setting its sequence to pos + capacity.
+ *
+ * The consumer claims a position by advancing dequeueIndex with a
+ * compare-and-swap rather than a plain store, because a producer sending with
+ * sendOverwriting may claim the oldest message and discard it. Whoever claims
+ * a position is the one to release its slot, so a message the consumer is
+ * reading in place is never discarded from under it.
+ *
+ * A producer which dies between claiming a position and publishing it stalls
+ * the consumer at that position. Since a dying producer also drops its
+ * production lock, the consumer will notice that no producer is present once
+ * the last one exits, but messages behind the stalled slot are lost. */
+template <typename Msg>
+class MpscRingTransport {
+    static_assert(alignof(Msg) <= IPC_CACHE_LINE_SIZE,
+            "message type alignment must not exceed a cache line");
+public:
+    static const bool multiProducer = true;
+    static const bool canOverwrite = true;
+
+    static bool remove (const char* name) {
+        return ShmSegment::remove(name);
+    }
+
+    MpscRingTransport (boost::interprocess::create_only_t, const char* name,
+            size_t capacity, unsigned options = 0) {
+        using namespace boost::interprocess;
+        using std::swap;
+        /* In a one-slot ring, a slot released for the next lap (pos +
+         * capacity) would look published (pos + 1). */
+        capacity = roundUpToPowerOfTwo(std::max<size_t>(capacity, 2));
+        try {
+            ShmSegment segment { create_only, name, sizeof(Header) + capacity * sizeof(Slot), options };
+            swap(mSegment, segment);
+        }
+        catch (interprocess_exception& exc) {
+            throw QueueError(std::string("Unable to create queue named ") + name);
+        }
+
+        mHeader = new (mSegment.address()) Header();
+        mHeader->capacity = static_cast<uint32_t>(capacity);
+        mHeader->options = options;
+        mHeader->slotSize = sizeof(Slot);
+        auto slots = reinterpret_cast<Slot*>(mHeader + 1);
+        for (uint32_t i = 0; i < capacity; ++i) {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        mHeader->magic.store(kMagic, std::memory_order_release);
+        attach();
+    }
+
+    MpscRingTransport (boost::interprocess::open_only_t, const char* name) {
+        using namespace boost::interprocess;
+        using std::swap;
+        try {
+            ShmSegment segment { open_only, name };
+            swap(mSegment, segment);
+        }
+        catch (interprocess_exception& exc) {
+            throw QueueError("Unable to open queue");
+        }
+
+        mHeader = static_cast<Header*>(mSegment.address());
+        if (mSegment.size() < sizeof(Header) ||
+                mHeader->magic.load(std::memory_order_acquire) != kMagic ||
+                mHeader->slotSize != sizeof(Slot) ||
+                mSegment.size() < sizeof(Header) + mHeader->capacity * sizeof(Slot)) {
+            throw QueueError(std::string("Queue ") + name + " is not a ring of this message type");
+        }
+        mSegment.applyOptions(mHeader->options);
+        attach();
+    }
+
+    MpscRingTransport (const MpscRingTransport&) = delete;
+    MpscRingTransport& operator= (const MpscRingTransport&) = delete;
+
+    size_t capacity () const {
+        return mCapacity;
+    }
+
+    template <typename Stalled>
+    void send (const Msg& msg, EventCount& consumerEvents, Stalled stalled) {
+        auto pos = mHeader->enqueueIndex.fetch_add(1, std::memory_order_relaxed);
+        publish(pos, msg, stalled);
+        consumerEvents.notifyAll();
+    }
+
+    /* A blind fetch-add could claim a position we cannot fill, so trySend
+     * claims only a free position, with a compare-and-swap. */
+    bool trySend (const Msg& msg, EventCount& consumerEvents) {
+        uint32_t pos;
+        if (!tryClaim(pos)) {
+            return false;
+        }
+        fill(pos, msg);
+        consumerEvents.notifyAll();
+        return true;
+    }
+
+    template <typename Stalled>
+    bool timedSend (const Msg& msg, EventCount& consumerEvents, Stalled stalled,
+            std::chrono::steady_clock::time_point deadline) {
+        uint32_t pos;
+        if (!waitUntil(mHeader->notFull, [&] () { return tryClaim(pos); },
+                    stalled, deadline)) {
+            return false;
+        }
+        fill(pos, msg);
+        consumerEvents.notifyAll();
+        return true;
+    }
+
+    /* Claim a position as send does, then discard the oldest messages, up to
+     * and including the one a lap behind us in our slot, until our slot comes
+     * free. We may still have to wait: the oldest position may belong to a
+     * producer which has not yet published it, or our slot may hold a message
+     * which the consumer is reading, in which case nothing more is
+     * discarded. */
+    template <typename Stalled>
+    size_t sendOverwriting (const Msg& msg, EventCount& consumerEvents, Stalled stalled) {
+        auto pos = mHeader->enqueueIndex.fetch_add(1, std::memory_order_relaxed);
+        size_t discarded = 0;
+        auto makeRoom = [&] () {
+            while (!isFree(pos)) {
+                if (!discardOldest(pos - mCapacity)) {
+                    return false;
+                }
+                ++discarded;
+            }
+            return true;
+        };
+        while (!mHeader->notFull.waitFor(makeRoom, stallCheckInterval())) {
+            stalled();
+        }
+        fill(pos, msg);
+        consumerEvents.notifyAll();
+        return discarded;
+    }
+
+    /* Claim a run of positions with one fetch-add (at most a ring's worth at
+     * a time, so we never lap ourselves), then fill them in order. */
+    template <typename Stalled>
+    void sendBatch (const Msg* msgs, size_t count, EventCount& consumerEvents,
+            Stalled stalled) {
+        while (count) {
+            auto n = static_cast<uint32_t>(std::min<size_t>(count, mCapacity));
+            auto pos = mHeader->enqueueIndex.fetch_add(n, std::memory_order_relaxed);
+            for (uint32_t i = 0; i < n; ++i) {
+                if (!isFree(pos + i)) {
+                    consumerEvents.notifyAll();
+                }
+                publish(pos + i, msgs[i], stalled);
+            }
+            msgs += n;
+            count -= n;
+        }
+        consumerEvents.notifyAll();
+    }
+
+    /* Claim a position and wait for its slot, as send does, but leave the
+     * slot unpublished until commit. Until then the consumer cannot get past
+     * it, so a reservation should be committed promptly. */
+    template <typename Stalled>
+    Msg& reserve (Stalled stalled) {
+        auto pos = mHeader->enqueueIndex.fetch_add(1, std::memory_order_relaxed);
+        waitForSlot(pos, stalled);
+        mReservedPos = pos;
+        return *new (&mSlots[pos & mMask].storage) Msg;
+    }
+
+    template <typename Stalled>
+    void commit (EventCount& consumerEvents, Stalled) {
+        mSlots[mReservedPos & mMask].sequence.store(mReservedPos + 1,
+                std::memory_order_release);
+        consumerEvents.notifyAll();
+    }
+
+    template <typename F>
+    bool tryConsume (F&& f) {
+        uint32_t pos;
+        if (!claimPublished(pos, 1)) {
+            return false;
+        }
+
+        Release release { *this, mSlots[pos & mMask], pos };
+        f(*reinterpret_cast<const Msg*>(&mSlots[pos & mMask].storage));
+        return true;
+    }
+
+    /* Slots are interleaved with their sequence numbers, so a batch is
+     * copied out into scratch, releasing each slot as we go. */
+    template <typename F>
+    size_t tryConsumeBatch (Msg* scratch, size_t max, F&& f) {
+        uint32_t pos;
+        auto count = claimPublished(pos, static_cast<uint32_t>(std::min<size_t>(max, mCapacity)));
+        if (!count) {
+            return 0;
+        }
+
+        for (uint32_t i = 0; i < count; ++i) {
+            auto& slot = mSlots[(pos + i) & mMask];
+            std::memcpy(&scratch[i], &slot.storage, sizeof(Msg));
+            slot.sequence.store(pos + i + mCapacity, std::memory_order_release);
+        }
+        mHeader->notFull.notifyAll();
+        f(static_cast<const Msg*>(scratch), size_t(count));
+        return count;
+    }
+
+private:
+    /* Identifies an initialized ring, and guards against a producer built
+     * against a different layout. */
+    static const uint32_t kMagic = 0x4d505343; /* "MPSC" */
+
+    struct Header {
+        std::atomic<uint32_t> magic;
+        uint32_t capacity;
+        uint32_t slotSize;
+        uint32_t options;
+
+        alignas(IPC_CACHE_LINE_SIZE) std::atomic<uint32_t> enqueueIndex;
+        alignas(IPC_CACHE_LINE_SIZE) std::atomic<uint32_t> dequeueIndex;
+        alignas(IPC_CACHE_LINE_SIZE) EventCount notFull;
+    };
+
+    struct Slot {
+        std::atomic<uint32_t> sequence;
+        typename std::aligned_storage<sizeof(Msg), alignof(Msg)>::type storage;
+    };
+
+    bool isFree (uint32_t pos) const {
+        return mSlots[pos & mMask].sequence.load(std::memory_order_acquire) == pos;
+    }
+
+    /* Hands a slot consumed in place to the producer one lap ahead on scope
+     * exit, so the message stays intact until its handler is done with it. */
+    struct Release {
+        MpscRingTransport& transport;
+        Slot& slot;
+        uint32_t pos;
+
+        ~Release () {
+            slot.sequence.store(pos + transport.mCapacity, std::memory_order_release);
+            transport.mHeader->notFull.notifyAll();
+        }
+    };
+
+    /* Claim the run of up to max published messages at dequeueIndex by
+     * advancing dequeueIndex past them. Returns the length of the run, and
+     * its first position in pos. */
+    uint32_t claimPublished (uint32_t& pos, uint32_t max) {
+        pos = mHeader->dequeueIndex.load(std::memory_order_relaxed);
+        while (true) {
+            uint32_t count = 0;
+            while (count < max && mSlots[(pos + count) & mMask].sequence.load(
+                        std::memory_order_acquire) == pos + count + 1) {
+                ++count;
+            }
+            if (!count || mHeader->dequeueIndex.compare_exchange_weak(pos, pos + count,
+                        std::memory_order_relaxed)) {
+                return count;
+            }
+        }
+    }
+
+    /* Claim the oldest message, if it is no later than position last, and
+     * release its slot without reading it. Returns false if there is no such
+     * published message to discard. */
+    bool discardOldest (uint32_t last) {
+        auto pos = mHeader->dequeueIndex.load(std::memory_order_relaxed);
+        while (int32_t(last - pos) >= 0 &&
+                mSlots[pos & mMask].sequence.load(std::memory_order_acquire) == pos + 1) {
+            if (mHeader->dequeueIndex.compare_exchange_weak(pos, pos + 1,
+                        std::memory_order_relaxed)) {
+                mSlots[pos & mMask].sequence.store(pos + mCapacity, std::memory_order_release);
+                mHeader->notFull.notifyAll();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /* Claim the position at enqueueIndex if its slot is free. */
+    bool tryClaim (uint32_t& pos) {
+        pos = mHeader->enqueueIndex.load(std::memory_order_relaxed);
+        while (isFree(pos)) {
+            if (mHeader->enqueueIndex.compare_exchange_weak(pos, pos + 1,
+                        std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /* Wait for the slot at pos to come around to us. */
+    template <typename Stalled>
+    void waitForSlot (uint32_t pos, Stalled& stalled) {
+        if (!isFree(pos)) {
+            while (!mHeader->notFull.waitFor([&] () { return isFree(pos); },
+                        stallCheckInterval())) {
+                stalled();
+            }
+        }
+    }
+
+    /* Wait for the slot at pos, then fill it. */
+    template <typename Stalled>
+    void publish (uint32_t pos, const Msg& msg, Stalled& stalled) {
+        waitForSlot(pos, stalled);
+        fill(pos, msg);
+    }
+
+    /* Fill the free slot at pos, and publish it. */
+    void fill (uint32_t pos, const Msg& msg) {
+        auto& slot = mSlots[pos & mMask];
+        std::memcpy(&slot.storage, &msg, sizeof(Msg));
+        slot.sequence.store(pos + 1, std::memory_order_release);
+    }
+
+    void attach () {
+        mCapacity = mHeader->capacity;
+        mMask = mCapacity - 1;
+        mSlots = reinterpret_cast<Slot*>(mHeader + 1);
+    }
+
+    ShmSegment mSegment;
+    Header* mHeader = nullptr;
+    Slot* mSlots = nullptr;
+    uint32_t mCapacity = 0;
+    uint32_t mMask = 0;
+
+    /* The position claimed by the outstanding reservation, if any. */
+    uint32_t mReservedPos = 0;
+};
+
+}
+
+#endif
@@ -2,14 +2,18 @@
 #define IPC_PRODUCER_HPP
 
 #include "common.hpp"
+#include "channel_control.hpp"
 #include "tmp_file_lock.hpp"
 #include "errors.hpp"
+#include "message_queue_transport.hpp"
 
 #include "util/log.hpp"
 
-#include <boost/interprocess/ipc/message_queue.hpp>
+#include <boost/interprocess/creation_tags.hpp>
 #include <boost/interprocess/sync/sharable_lock.hpp>
+#include <boost/interprocess/sync/scoped_lock.hpp>
 
+#include <atomic>
 #include <chrono>
 #include <string>
 #include <thread>
@@ -17,6 +21,25 @@
 
 namespace ipc {
 
+/* What BasicProducer::send does when the queue is full.
+ *
+ * OVERFLOW_BLOCK waits for the consumer to make room. This is the default.
+ *
+ * OVERFLOW_FAIL throws QueueFull.
+ *
+ * OVERFLOW_DROP_NEWEST discards the message being sent.
+ *
+ * OVERFLOW_OVERWRITE_OLDEST discards the oldest messages in the queue to
+ * make room, so the consumer always sees the most recent ones. Only
+ * transports which support it accept this policy (MessageQueueTransport and
+ * MpscRingTransport); on others, setOverflowPolicy throws QueueError. */
+enum OverflowPolicy {
+    OVERFLOW_BLOCK,
+    OVERFLOW_FAIL,
+    OVERFLOW_DROP_NEWEST,
+    OVERFLOW_OVERWRITE_OLDEST
+};
+
 /* Provide a write-only interface to a named interprocess queue. Use lock files
  * to synchronize access to this queue. Note that this implies that a
  * BasicProducer cannot communicate with another user's Consumer object, due to
@@ -29,7 +52,8 @@ namespace ipc {
  * same memory layout if compiled in C) of type Msg. This is enforced with a
  * static_assert. Do not attempt to pass pointers, or objects containing
  * pointers, across process boundaries--the memory addresses they point to will
- * no longer be valid.
+ * no longer be valid. To pass large payloads without copying them, send a
+ * BlobHandle to a block in a BlobPool (see blob_pool.hpp) instead.
  *
  * Lock is the template which will be used to get a production lock. Specify
  * boost::interprocess::scoped_lock to instantiate an exclusive producer, or
@@ -41,13 +65,24 @@ namespace ipc {
  *
  * A shared producer may be one of many writers to the message queue.
  *
+ * Transport is the mechanism which carries messages to the consumer, and must
+ * match the Consumer's Transport. A shared producer requires a transport which
+ * supports multiple producers; this is enforced with a static_assert.
+ *
  * Behavior is undefined if two producer objects (exclusive or shared)
  * referring to the same message queue are instantiated in the same process.
  */
-template <typename Msg, template <typename> class Lock>
+template <typename Msg, template <typename> class Lock,
+         template <typename> class Transport = MessageQueueTransport>
 class BasicProducer {
     static_assert(std::is_standard_layout<Msg>::value,
             "message type must be a standard layout class");
+    static_assert(Transport<Msg>::multiProducer ||
+            !std::is_same<Lock<tmp_file_lock>,
+                boost::interprocess::sharable_lock<tmp_file_lock>>::value,
+            "a shared producer requires a multi-producer transport");
+    static const bool kExclusive = !std::is_same<Lock<tmp_file_lock>,
+            boost::interprocess::sharable_lock<tmp_file_lock>>::value;
 public:
     /* Obtain a production lock on the queue named name. This lock will be
      * shared or unique depending on the semantics of Lock.
@@ -63,9 +98,12 @@ public:
      *
      * Throws FileLockError if there is a problem with the lock files which are
      * used to synchronize the queue. There is no realistic recovery in this
-     * situation, though using another name for the queue may work. */
+     * situation, though using another name for the queue may work.
+     *
+     * Throws QueueError if the queue's control segment cannot be opened. */
     BasicProducer (const char* name)
             : mName(name)
+            , mControl(mName)
             , mConsumptionMutex(mName + IPC_CONSUMER_SUFFIX)
             , mProductionMutex(mName + IPC_PRODUCER_SUFFIX) {
         using std::swap;
@@ -73,15 +111,32 @@ public:
         /* TODO timed wait and throw exception in case daemon is stalled? */
         Lock<tmp_file_lock> productionLock { mProductionMutex };
         swap(mProductionLock, productionLock);
+        mControl.producerChanged();
 
         LOG(debug) << "Producer(" << mName << ") constructed";
     }
 
+    /* Release the production lock and tell the consumer we have gone, so it
+     * need not wait for its next poll to find out. */
+    ~BasicProducer () {
+        try {
+            if (mProductionLock.owns()) {
+                mProductionLock.unlock();
+            }
+        }
+        catch (FileLockError& exc) {
+            LOG(warning) << "Producer(" << mName << ") unable to release production lock";
+        }
+        mControl.producerChanged();
+    }
+
     /* By convention, the consumer process is the one to prepare the underlying
      * message queue at the operating system level. It signals its completion
      * of this task by obtaining a consumption lock, at which point it is safe
      * for the producer process (us) to open the message queue. waitForConsumer
-     * waits for the consumer queue's lock, then opens the message queue.
+     * waits for the consumer queue's lock, then opens the message queue. The
+     * wait is a sleep on the queue's control block, which the consumer signals
+     * as soon as it has the lock, so no polling is involved.
      *
      * This function may be called multiple times. For instance, if a consumer
      * process crashes, the send function will throw a NoConsumer exception.
@@ -99,30 +154,41 @@ public:
         using namespace boost::interprocess;
         LOG(debug) << "Waiting for consumer ...";
 
+        /* Consumers signal consumerEvents once they hold the consumption
+         * lock, so we can sleep until one does. We announce ourselves before
+         * each check, so a consumer which appears in between still wakes us. */
         auto stopTime = std::chrono::steady_clock::now() + timeout;
-        while (mConsumptionMutex.try_lock()) {
-            mConsumptionMutex.unlock();
-            if (std::chrono::steady_clock::now() >= stopTime) {
+        uint32_t epoch;
+        while (true) {
+            auto key = mControl->consumerEvents.prepareWait();
+            if (consumerPresent(epoch)) {
+                break;
+            }
+            auto now = std::chrono::steady_clock::now();
+            if (now >= stopTime) {
                 LOG(debug) << "Timed out waiting for consumer";
                 return false;
             }
-            /* XXX Might have to tune this value, but probably not critical for
-             * it to be user-specifiable yet. */
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            mControl->consumerEvents.wait(key, stopTime - now);
         }
 
         LOG(debug) << "Consumer connected!";
 
-        try {
-            mQueue.reset(new message_queue(open_only, mName.c_str()));
-        }
-        catch (interprocess_exception& exc) {
-            throw QueueError("Unable to open queue");
-        }
+        mQueue.reset(new Transport<Msg>(open_only, mName.c_str()));
+        mConsumerEpoch = epoch;
+        mConsumerPid = mControl->consumerPid.load(std::memory_order_relaxed);
+        mNextLivenessCheck = coarseNow() + stallCheckInterval();
 
         return true;
     }
 
+    /* The capacity of the queue, as chosen by the consumer. This function may
+     * ONLY be called after waitForConsumer. */
+    size_t capacity () const {
+        assert(mQueue);
+        return mQueue->capacity();
+    }
+
     /* Send a message to the consumer endpoint. This function may ONLY be
      * called after waitForConsumer, otherwise a null pointer will be
      * dereferenced. The reason send does not call waitForConsumer implicitly
@@ -130,44 +196,403 @@ public:
      * for the consumer to appear, nor is it intuitive for us to provide a
      * timeout argument to that effect in the send interface.
      *
-     * Throws NoConsumer if the consumer process no longer has the consumption
-     * lock on the message queue, which signifies that the other end has hung
-     * up.
+     * Throws NoConsumer if the consumer which was present at waitForConsumer
+     * has since shut down or been replaced, which signifies that the other end
+     * has hung up. This check is a single load from the queue's control block.
+     * A consumer which crashes cannot announce its departure, so at most once
+     * every stallCheckInterval, send also checks that the consumer's process
+     * is still running, and if not, that the consumption lock has been
+     * abandoned; the next send after that throws NoConsumer. While blocked on
+     * a full queue, send checks the consumption lock every
+     * stallCheckInterval.
+     *
+     * If the queue is full, what send does depends on the producer's
+     * overflow policy; see setOverflowPolicy. By default it blocks until the
+     * consumer makes room.
+     *
+     * Throws QueueFull if the queue is full and the overflow policy is
+     * OVERFLOW_FAIL.
      *
      * Throws QueueError if there is an internal error sending, which might
      * reflect two consumer process stomping on each other, or an inconsistent
      * state on the other end. */
-    void send (Msg msg) {
+    void send (const Msg& msg) {
         assert(mQueue);
 
-        if (mConsumptionMutex.try_lock()) {
-            mConsumptionMutex.unlock();
-            throw NoConsumer();
+        checkAttached();
+
+        try {
+            sendWithPolicy(*mQueue, msg);
+        }
+        catch (boost::interprocess::interprocess_exception& exc) {
+            throw QueueError("Internal queue error");
+        }
+        countSent(1, sizeof(Msg));
+    }
+
+    /* Send a message on the given lane of a LaneTransport (see
+     * lane_transport.hpp). Higher lanes are more urgent, and lane 0 is the
+     * one send (msg) uses. The overflow policy applies to each lane
+     * separately.
+     *
+     * Throws QueueError if there is no such lane, and otherwise the same
+     * exceptions as send. */
+    void send (const Msg& msg, size_t lane) {
+        assert(mQueue);
+
+        checkAttached();
+
+        try {
+            sendWithPolicy(mQueue->lane(lane), msg);
+        }
+        catch (boost::interprocess::interprocess_exception& exc) {
+            throw QueueError("Internal queue error");
+        }
+        countSent(1, sizeof(Msg));
+    }
+
+    /* Send a message if there is room for it in the queue, without blocking,
+     * regardless of the overflow policy. Returns false if the queue is full.
+     *
+     * Throws NoConsumer and QueueError as send does. */
+    bool trySend (const Msg& msg) {
+        assert(mQueue);
+
+        checkAttached();
+
+        try {
+            if (!mQueue->trySend(msg, mControl->events)) {
+                countFull();
+                return false;
+            }
+        }
+        catch (boost::interprocess::interprocess_exception& exc) {
+            throw QueueError("Internal queue error");
+        }
+        countSent(1, sizeof(Msg));
+        return true;
+    }
+
+    /* Send a message, waiting at most timeout for room in the queue,
+     * regardless of the overflow policy. Returns false if the queue was
+     * still full when the timeout elapsed.
+     *
+     * Throws NoConsumer and QueueError as send does. */
+    template <typename Rep, typename Period>
+    bool timedSend (const Msg& msg, std::chrono::duration<Rep, Period> timeout) {
+        assert(mQueue);
+
+        checkAttached();
+
+        try {
+            if (!mQueue->trySend(msg, mControl->events)) {
+                countFull();
+                auto start = std::chrono::steady_clock::now();
+                auto sent = mQueue->timedSend(msg, mControl->events,
+                        [this] () { checkConsumer(); }, start + timeout);
+                countBlocked(start);
+                if (!sent) {
+                    return false;
+                }
+            }
+        }
+        catch (boost::interprocess::interprocess_exception& exc) {
+            throw QueueError("Internal queue error");
+        }
+        countSent(1, sizeof(Msg));
+        return true;
+    }
+
+    /* Choose what send does when the queue is full; see OverflowPolicy.
+     * sendBatch, sendBytes and reserve always block.
+     *
+     * Throws QueueError if policy is OVERFLOW_OVERWRITE_OLDEST and the
+     * transport cannot discard messages. */
+    void setOverflowPolicy (OverflowPolicy policy) {
+        if (policy == OVERFLOW_OVERWRITE_OLDEST && !Transport<Msg>::canOverwrite) {
+            throw QueueError("Transport cannot overwrite messages");
+        }
+        mOverflowPolicy = policy;
+    }
+
+    OverflowPolicy overflowPolicy () const {
+        return mOverflowPolicy;
+    }
+
+    /* The number of messages this producer has dropped, or discarded from the
+     * queue, because of its overflow policy. The total over all producers is
+     * kept in the queue's control block; see Consumer::droppedMessages. */
+    uint64_t droppedMessages () const {
+        return mDroppedMessages;
+    }
+
+    /* Send count messages from the array msgs, in order. This is equivalent
+     * to calling send on each of them, except that the consumer is checked
+     * for once, and the transport publishes the messages and wakes the
+     * consumer once per run of free slots rather than once per message. The
+     * batch may be larger than the queue; the remainder is sent as the
+     * consumer makes room.
+     *
+     * If NoConsumer is thrown partway through a batch, the messages before
+     * it may or may not have been delivered.
+     *
+     * Throws the same exceptions as send. */
+    void sendBatch (const Msg* msgs, size_t count) {
+        assert(mQueue);
+
+        checkAttached();
+
+        try {
+            mQueue->sendBatch(msgs, count, mControl->events,
+                    [this] () { checkConsumer(); });
+        }
+        catch (boost::interprocess::interprocess_exception& exc) {
+            throw QueueError("Internal queue error");
+        }
+        countSent(count, count * sizeof(Msg));
+    }
+
+    /* Send size bytes starting at data as one variable-length message. Only
+     * transports which carry byte records support this, i.e.,
+     * ByteRingTransport; the consumer's handler receives the same bytes as
+     * (const void* data, size_t size).
+     *
+     * Throws QueueError if size exceeds the transport's maximum message size,
+     * and otherwise the same exceptions as send. */
+    void sendBytes (const void* data, size_t size) {
+        assert(mQueue);
+
+        checkAttached();
+
+        try {
+            mQueue->sendBytes(data, size, mControl->events,
+                    [this] () { checkConsumer(); });
+        }
+        catch (boost::interprocess::interprocess_exception& exc) {
+            throw QueueError("Internal queue error");
         }
+        countSent(1, size);
+    }
+
+    /* Reserve room for a variable-length message of up to maxSize bytes, and
+     * return where to build it, so it need not be built elsewhere and copied
+     * in by sendBytes. commitBytes publishes it. As with reserve, every
+     * reserveBytes must be followed by exactly one commitBytes before the
+     * next send, and the reservation holds up the consumer, so fill it in
+     * without blocking. Only transports which carry byte records support
+     * this, i.e., ByteRingTransport.
+     *
+     * Throws QueueError if maxSize exceeds the transport's maximum message
+     * size, and otherwise the same exceptions as send. If reserveBytes
+     * throws, there is no reservation to commit. */
+    void* reserveBytes (size_t maxSize) {
+        assert(mQueue);
+
+        checkAttached();
 
         try {
-            mQueue->send(&msg, sizeof(msg), 0);
+            return mQueue->reserveBytes(maxSize, mControl->events,
+                    [this] () { checkConsumer(); });
         }
         catch (boost::interprocess::interprocess_exception& exc) {
             throw QueueError("Internal queue error");
         }
     }
 
+    /* Publish the first size bytes (at most the maxSize reserved) of the
+     * message returned by the last call to reserveBytes. */
+    void commitBytes (size_t size) {
+        assert(mQueue);
+        mQueue->commitBytes(size, mControl->events);
+        countSent(1, size);
+    }
+
+    /* Reserve the next slot in the queue and return a reference to it, so the
+     * message can be built directly in shared memory rather than built on
+     * the stack and copied in by send. The message becomes visible to the
+     * consumer when commit is called. Every reserve must be followed by
+     * exactly one commit before the next call to send, sendBatch or reserve.
+     *
+     * The returned message is default-initialized: fields which are not
+     * assigned hold whatever the slot last held.
+     *
+     * A reservation holds up the consumer at its position in the queue, and
+     * on a multi-producer transport also holds up every message sent after
+     * it, so fill it in and commit it without blocking. Transports which
+     * cannot hand out their slots (MessageQueueTransport) stage the message
+     * in the transport object and copy it in on commit.
+     *
+     * Throws the same exceptions as send. If reserve throws, there is no
+     * reservation to commit. */
+    Msg& reserve () {
+        assert(mQueue);
+
+        checkAttached();
+
+        try {
+            return mQueue->reserve([this] () { checkConsumer(); });
+        }
+        catch (boost::interprocess::interprocess_exception& exc) {
+            throw QueueError("Internal queue error");
+        }
+    }
+
+    /* Publish the message returned by the last call to reserve. */
+    void commit () {
+        assert(mQueue);
+
+        try {
+            mQueue->commit(mControl->events, [this] () { checkConsumer(); });
+        }
+        catch (boost::interprocess::interprocess_exception& exc) {
+            throw QueueError("Internal queue error");
+        }
+        countSent(1, sizeof(Msg));
+    }
+
 private:
+    /* A consumer is present if it holds the consumption lock and its epoch in
+     * the control block is odd. The consumer advances the epoch before taking
+     * the lock, so a held lock implies a current epoch, which is returned in
+     * epoch. */
+    bool consumerPresent (uint32_t& epoch) {
+        if (mConsumptionMutex.try_lock()) {
+            mConsumptionMutex.unlock();
+            return false;
+        }
+        epoch = mControl->consumerEpoch.load(std::memory_order_acquire);
+        return epoch & 1;
+    }
+
+    /* Send msg on queue, which is either our transport or one of its lanes,
+     * according to the overflow policy. */
+    template <typename Queue>
+    void sendWithPolicy (Queue& queue, const Msg& msg) {
+        switch (mOverflowPolicy) {
+            case OVERFLOW_BLOCK:
+                if (!queue.trySend(msg, mControl->events)) {
+                    countFull();
+                    auto start = std::chrono::steady_clock::now();
+                    queue.send(msg, mControl->events, [this] () { checkConsumer(); });
+                    countBlocked(start);
+                }
+                break;
+            case OVERFLOW_FAIL:
+                if (!queue.trySend(msg, mControl->events)) {
+                    countFull();
+                    throw QueueFull();
+                }
+                break;
+            case OVERFLOW_DROP_NEWEST:
+                if (!queue.trySend(msg, mControl->events)) {
+                    countFull();
+                    countDropped(1);
+                }
+                break;
+            case OVERFLOW_OVERWRITE_OLDEST:
+                if (auto discarded = sendOverwriting(queue, msg,
+                            std::integral_constant<bool, Queue::canOverwrite>())) {
+                    countFull();
+                    countDropped(discarded);
+                }
+                break;
+        }
+    }
+
+    template <typename Queue>
+    size_t sendOverwriting (Queue& queue, const Msg& msg, std::true_type) {
+        return queue.sendOverwriting(msg, mControl->events, [this] () { checkConsumer(); });
+    }
+
+    template <typename Queue>
+    size_t sendOverwriting (Queue&, const Msg&, std::false_type) {
+        assert(false && "setOverflowPolicy should have refused OVERFLOW_OVERWRITE_OLDEST");
+        return 0;
+    }
+
+    void countDropped (size_t count) {
+        if (count) {
+            mDroppedMessages += count;
+            mControl->droppedMessages.fetch_add(count, std::memory_order_relaxed);
+        }
+    }
+
+    /* Update the queue's stats; see ChannelStats. An exclusive producer is
+     * the only writer of its counters, so it need not add atomically. */
+    void addToStat (std::atomic<uint64_t>& counter, uint64_t n) {
+        if (kExclusive) {
+            counter.store(counter.load(std::memory_order_relaxed) + n,
+                    std::memory_order_relaxed);
+        }
+        else {
+            counter.fetch_add(n, std::memory_order_relaxed);
+        }
+    }
+
+    void countSent (uint64_t messages, uint64_t bytes) {
+        addToStat(mControl->stats.messagesSent, messages);
+        addToStat(mControl->stats.bytesSent, bytes);
+    }
+
+    void countFull () {
+        addToStat(mControl->stats.fullQueueEvents, 1);
+    }
+
+    void countBlocked (std::chrono::steady_clock::time_point start) {
+        addToStat(mControl->stats.blockedNanoseconds,
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start).count());
+    }
+
+    /* Throw NoConsumer if the consumer we connected to has gone. One which
+     * shut down advanced the epoch; one which crashed could not, so every
+     * stallCheckInterval we also make sure its process is running. A pid
+     * proves nothing across PID namespaces, so a consumer which seems dead
+     * is condemned only if it has also abandoned the consumption lock. The
+     * coarse clock keeps all this a few nanoseconds per send. */
+    void checkAttached () {
+        if (mControl->consumerEpoch.load(std::memory_order_acquire) != mConsumerEpoch) {
+            throw NoConsumer();
+        }
+        auto now = coarseNow();
+        if (now >= mNextLivenessCheck) {
+            mNextLivenessCheck = now + stallCheckInterval();
+            if (!processAlive(mConsumerPid)) {
+                checkConsumer();
+            }
+        }
+    }
+
+    /* Called while blocked on a full queue. */
+    void checkConsumer () {
+        uint32_t epoch;
+        if (!consumerPresent(epoch) || epoch != mConsumerEpoch) {
+            throw NoConsumer();
+        }
+    }
+
     std::string mName;
-    std::unique_ptr<boost::interprocess::message_queue> mQueue = nullptr;
-    Lock<tmp_file_lock> mProductionLock;
+    ChannelControl mControl;
+    uint32_t mConsumerEpoch = 0;
+    uint32_t mConsumerPid = 0;
+    std::chrono::nanoseconds mNextLivenessCheck { 0 };
+    std::unique_ptr<Transport<Msg>> mQueue = nullptr;
+    OverflowPolicy mOverflowPolicy = OVERFLOW_BLOCK;
+    uint64_t mDroppedMessages = 0;
+
+    /* The mutexes must outlive the lock, so they are declared first. */
     tmp_file_lock mConsumptionMutex;
     tmp_file_lock mProductionMutex;
+    Lock<tmp_file_lock> mProductionLock;
 };
 
 /* User-friendly aliases for the two types of producers. */
 
-template <typename Msg>
-using Producer = BasicProducer<Msg, boost::interprocess::scoped_lock>;
+template <typename Msg, template <typename> class Transport = MessageQueueTransport>
+using Producer = BasicProducer<Msg, boost::interprocess::scoped_lock, Transport>;
 
-template <typename Msg>
-using SharedProducer = BasicProducer<Msg, boost::interprocess::sharable_lock>;
+template <typename Msg, template <typename> class Transport = MessageQueueTransport>
+using SharedProducer = BasicProducer<Msg, boost::interprocess::sharable_lock, Transport>;
 
 }
 
@@ -0,0 +1,81 @@
+#ifndef IPC_RECEIVE_AWAITABLE_HPP
+#define IPC_RECEIVE_AWAITABLE_HPP
+
+#include "consumer.hpp"
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+
+#include <coroutine>
+#include <functional>
+
+namespace ipc {
+
+/* The awaitable returned by receive, below. */
+template <typename Msg, typename Consumer, typename Watch>
+class ReceiveAwaitable {
+public:
+    ReceiveAwaitable (Consumer& consumer, Watch watch)
+            : mConsumer(consumer), mWatch(std::move(watch)) { }
+
+    bool await_ready () {
+        mConsumer.eventFd();
+        return take();
+    }
+
+    void await_suspend (std::coroutine_handle<> handle) {
+        mHandle = handle;
+        watch();
+    }
+
+    Msg await_resume () {
+        return mMsg;
+    }
+
+private:
+    bool take () {
+        return mConsumer.drain([this] (const Msg& msg) { mMsg = msg; }, 1);
+    }
+
+    /* Readiness may be spurious, so keep watching until there is a message
+     * to resume with. */
+    void watch () {
+        mWatch(mConsumer.eventFd(), [this] () {
+            if (take()) {
+                mHandle.resume();
+            }
+            else {
+                watch();
+            }
+        });
+    }
+
+    Consumer& mConsumer;
+    Watch mWatch;
+    std::coroutine_handle<> mHandle;
+    Msg mMsg;
+};
+
+/* In a C++20 coroutine,
+ *
+ *   Msg msg = co_await ipc::receive(consumer, watch);
+ *
+ * suspends until the consumer's queue has a message, then copies it out,
+ * without blocking a thread. watch connects the consumer to your event loop:
+ * it is called as watch (fd, onReadable), and must arrange for the loop to
+ * call onReadable (a std::function<void ()>) once, the next time fd is
+ * readable (e.g., a one-shot epoll registration). The coroutine is resumed
+ * from onReadable.
+ *
+ * This uses Consumer::eventFd and Consumer::drain, so it is for fixed-size
+ * messages, and the consumer must not also have a service thread. */
+template <typename Msg, size_t N, template <typename> class Transport, typename Watch>
+ReceiveAwaitable<Msg, Consumer<Msg, N, Transport>, Watch>
+receive (Consumer<Msg, N, Transport>& consumer, Watch watch) {
+    return ReceiveAwaitable<Msg, Consumer<Msg, N, Transport>, Watch>(consumer, std::move(watch));
+}
+
+}
+
+#endif
+
+#endif
@@ -0,0 +1,564 @@
+#ifndef IPC_RPC_HPP
+#define IPC_RPC_HPP
+
+#include "channel_control.hpp"
+#include "common.hpp"
+#include "consumer.hpp"
+#include "errors.hpp"
+#include "event_count.hpp"
+#include "mpsc_ring_transport.hpp"
+#include "producer.hpp"
+#include "shm_segment.hpp"
+#include "tmp_file_lock.hpp"
+
+#include "util/log.hpp"
+
+#include <boost/interprocess/creation_tags.hpp>
+#include <boost/interprocess/exceptions.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <cassert>
+#include <cstdint>
+
+namespace ipc {
+
+/* What an RpcClient sends an RpcServer: the request, and where to put the
+ * response. */
+template <typename Req>
+struct RpcRequest {
+    /* Unique for the lifetime of the reply segment: the client's generation
+     * in the high 32 bits, and its call count in the low 32. */
+    uint64_t id;
+    uint32_t client;
+    uint32_t slot;
+    Req request;
+};
+
+namespace detail {
+
+/* The layout of an RPC server's reply segment: this header, then maxClients
+ * client records, each followed by its depth reply slots. */
+struct alignas(IPC_CACHE_LINE_SIZE) RpcHeader {
+    static const uint32_t kMagic = 0x52504352; /* "RPCR" */
+
+    std::atomic<uint32_t> magic;
+    uint32_t maxClients;
+    uint32_t depth;
+    uint32_t requestSize;
+    uint32_t responseSize;
+    uint32_t options;
+};
+
+/* A client owns its record while it holds the lock file named after the
+ * server with IPC_CLIENT_SUFFIX and the record's index appended. Each client
+ * which claims the record bumps generation, and the server drops replies to
+ * calls from an earlier generation, so a crashed predecessor's calls never
+ * disturb its own. */
+struct alignas(IPC_CACHE_LINE_SIZE) RpcClientRecord {
+    std::atomic<uint32_t> generation;
+
+    /* The client sleeps on replied while waiting for a response, and the
+     * server signals it after writing one. */
+    alignas(IPC_CACHE_LINE_SIZE) EventCount replied;
+};
+
+/* id is that of the call whose response is in response, once the server has
+ * written it, and 0 while the server is writing response. */
+template <typename Resp>
+struct alignas(IPC_CACHE_LINE_SIZE) RpcReplySlot {
+    std::atomic<uint64_t> id;
+    Resp response;
+};
+
+template <typename Resp>
+size_t rpcRecordSize (size_t depth) {
+    return sizeof(RpcClientRecord) + depth * sizeof(RpcReplySlot<Resp>);
+}
+
+inline std::string clientLockName (const std::string& name, size_t index) {
+    return name + IPC_CLIENT_SUFFIX + std::to_string(index);
+}
+
+}
+
+/* The serving end of a request/response channel. Clients send RpcRequests
+ * through an ordinary queue named name, which the server consumes with a
+ * Consumer, so clients rendezvous with the server exactly as shared
+ * producers do. Each response goes straight into a reply slot belonging to
+ * the calling client, in a shared memory segment named after the server
+ * with IPC_REPLY_SUFFIX appended, and the client is woken directly: there is
+ * no reply queue, and no thread on the client side.
+ *
+ * The server creates the reply segment, so it chooses how many clients may
+ * attach at once (maxClients) and how many calls each may have outstanding
+ * (depth). Transport must support multiple producers, and must match the
+ * clients' Transport.
+ *
+ * Req and Resp must be standard layout, as for Producer, and Resp
+ * copy-assignable. */
+template <typename Req, typename Resp, size_t N = 100,
+         template <typename> class Transport = MpscRingTransport>
+class RpcServer {
+    static_assert(std::is_standard_layout<Resp>::value,
+            "response type must be a standard layout class");
+    static_assert(alignof(Resp) <= IPC_CACHE_LINE_SIZE,
+            "response type alignment must not exceed a cache line");
+    using Header = detail::RpcHeader;
+    using Record = detail::RpcClientRecord;
+    using Slot = detail::RpcReplySlot<Resp>;
+public:
+    using Request = RpcRequest<Req>;
+    using Consumer = ipc::Consumer<Request, N, Transport>;
+
+    /* Create the reply segment, replacing any left by a previous server,
+     * then the request queue, with room for capacity requests. options are
+     * SegmentOption flags, applied to both.
+     *
+     * Throws QueueError if either cannot be created, and FileLockError if
+     * the consumption lock cannot be taken. */
+    RpcServer (const char* name, size_t capacity = N, size_t maxClients = 64,
+            size_t depth = 16, unsigned options = 0)
+            : mName(name) {
+        using namespace boost::interprocess;
+        using std::swap;
+        if (!maxClients || !depth) {
+            throw QueueError("An RPC server needs room for at least one call");
+        }
+
+        auto replyName = mName + IPC_REPLY_SUFFIX;
+        ShmSegment::remove(replyName.c_str());
+        try {
+            ShmSegment segment { create_only, replyName.c_str(),
+                sizeof(Header) + maxClients * detail::rpcRecordSize<Resp>(depth), options };
+            swap(mSegment, segment);
+        }
+        catch (interprocess_exception& exc) {
+            throw QueueError("Unable to create reply segment " + replyName);
+        }
+
+        auto header = new (mSegment.address()) Header();
+        header->maxClients = static_cast<uint32_t>(maxClients);
+        header->depth = static_cast<uint32_t>(depth);
+        header->requestSize = sizeof(Req);
+        header->responseSize = sizeof(Resp);
+        header->options = options;
+        mMaxClients = maxClients;
+        mDepth = depth;
+        for (size_t i = 0; i < maxClients; ++i) {
+            new (&record(i)) Record();
+            for (size_t j = 0; j < depth; ++j) {
+                new (&slot(i, j)) Slot();
+            }
+        }
+        header->magic.store(Header::kMagic, std::memory_order_release);
+
+        mConsumer.reset(new Consumer(name, capacity, options));
+
+        LOG(debug) << "RpcServer(" << mName << ") constructed";
+    }
+
+    RpcServer (const RpcServer&) = delete;
+    RpcServer& operator= (const RpcServer&) = delete;
+
+    /* Start a thread to answer calls: for each request, it calls
+     * handleRequest with a const Req&, and sends the Resp it returns back to
+     * the caller. The timeouts behave as for Consumer::startServiceThread,
+     * with clients as the producers. */
+    template <typename Handler, typename Duration1, typename Duration2>
+    void startServiceThread (Handler handleRequest,
+            Duration1 spawnClientTimeout, Duration2 pollingTimeout) {
+        mConsumer->startServiceThread(replier(handleRequest), spawnClientTimeout, pollingTimeout);
+    }
+
+    void joinServiceThread () {
+        mConsumer->joinServiceThread();
+    }
+
+    void stopServiceThread () {
+        mConsumer->stopServiceThread();
+    }
+
+    /* Wait up to timeout for a request, and answer it with handleRequest.
+     * Returns false on timeout. */
+    template <typename Rep, typename Period, typename Handler>
+    bool timedReceiveAndProcess (std::chrono::duration<Rep, Period> timeout,
+            Handler handleRequest) {
+        return mConsumer->timedReceiveAndProcess(timeout, replier(handleRequest));
+    }
+
+    typename Consumer::FailState failState () const {
+        return mConsumer->failState();
+    }
+
+private:
+    template <typename Handler>
+    struct Replier {
+        RpcServer* server;
+        Handler handleRequest;
+
+        void operator() (const Request& request) {
+            server->reply(request, handleRequest(request.request));
+        }
+    };
+
+    template <typename Handler>
+    Replier<Handler> replier (Handler handleRequest) {
+        return Replier<Handler> { this, handleRequest };
+    }
+
+    void reply (const Request& request, const Resp& response) {
+        if (request.client >= mMaxClients || request.slot >= mDepth) {
+            LOG(warning) << "RpcServer(" << mName << ") dropped a request with no reply slot";
+            return;
+        }
+        auto& owner = record(request.client);
+        if (uint32_t(request.id >> 32) != owner.generation.load(std::memory_order_acquire)) {
+            LOG(debug) << "RpcServer(" << mName << ") dropped a reply to a departed client";
+            return;
+        }
+        /* The client may have been replaced since we checked, so clear id
+         * first: if its successor is taking a response from this slot, it
+         * sees that we overwrote it. */
+        auto& reply = slot(request.client, request.slot);
+        reply.id.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        reply.response = response;
+        reply.id.store(request.id, std::memory_order_release);
+        owner.replied.notifyAll();
+    }
+
+    Record& record (size_t client) {
+        return *reinterpret_cast<Record*>(static_cast<char*>(mSegment.address()) +
+                sizeof(Header) + client * detail::rpcRecordSize<Resp>(mDepth));
+    }
+
+    Slot& slot (size_t client, size_t index) {
+        return reinterpret_cast<Slot*>(&record(client) + 1)[index];
+    }
+
+    std::string mName;
+    ShmSegment mSegment;
+    size_t mMaxClients = 0;
+    size_t mDepth = 0;
+    std::unique_ptr<Consumer> mConsumer;
+};
+
+template <typename Req, typename Resp, template <typename> class Transport>
+class RpcClient;
+
+/* The eventual response to an RpcClient::call. Waiting spins briefly, since a
+ * fast server often answers within a few hundred nanoseconds, then sleeps
+ * until the server signals the reply.
+ *
+ * An RpcFuture must not outlive its client. Dropping one without calling get
+ * is allowed; its reply slot is reused once the response has arrived. */
+template <typename Req, typename Resp, template <typename> class Transport>
+class RpcFuture {
+    using Client = RpcClient<Req, Resp, Transport>;
+public:
+    RpcFuture () = default;
+
+    RpcFuture (RpcFuture&& other) {
+        swap(other);
+    }
+
+    RpcFuture& operator= (RpcFuture&& other) {
+        RpcFuture discarded;
+        discarded.swap(other);
+        swap(discarded);
+        return *this;
+    }
+
+    ~RpcFuture () {
+        if (mClient) {
+            mClient->abandon(mSlot);
+        }
+    }
+
+    /* Whether get has a response to return. */
+    bool valid () const {
+        return mClient;
+    }
+
+    /* Whether the response has arrived, so that get will not wait. */
+    bool ready () const {
+        return mClient && mClient->arrived(mSlot);
+    }
+
+    /* Wait up to timeout for the response. Returns whether it has arrived.
+     *
+     * Throws NoConsumer if the server goes away while we wait. */
+    template <typename Rep, typename Period>
+    bool waitFor (std::chrono::duration<Rep, Period> timeout) {
+        return mClient && mClient->waitForReply(mSlot,
+                std::chrono::steady_clock::now() + timeout);
+    }
+
+    /* Wait for the response, and return it. May be called once.
+     *
+     * Throws NoConsumer if the server goes away before responding, and
+     * QueueError if a late reply to a crashed client which held our record
+     * before us overwrote the response. */
+    Resp get () {
+        assert(mClient);
+        mClient->waitForReply(mSlot, std::chrono::steady_clock::time_point::max());
+        auto client = mClient;
+        mClient = nullptr;
+        return client->take(mSlot);
+    }
+
+private:
+    friend Client;
+
+    RpcFuture (Client& client, size_t slot) : mClient(&client), mSlot(slot) { }
+
+    void swap (RpcFuture& other) {
+        std::swap(mClient, other.mClient);
+        std::swap(mSlot, other.mSlot);
+    }
+
+    Client* mClient = nullptr;
+    size_t mSlot = 0;
+};
+
+/* The calling end of a request/response channel; see RpcServer. A client
+ * sends its requests as a SharedProducer, and waits for each response in one
+ * of its own reply slots:
+ *
+ *   ipc::RpcClient<Query, Answer> client { "db", std::chrono::seconds(1) };
+ *   auto answer = client.call(query).get();
+ *
+ * Several calls may be outstanding at once, up to the server's depth, and
+ * their futures may be waited on in any order.
+ *
+ * A client is for one thread at a time, and, as with producers, a process
+ * may have only one client of a given server. If the server goes away, calls
+ * and waits throw NoConsumer; construct a new client to reach its
+ * successor. */
+template <typename Req, typename Resp, template <typename> class Transport = MpscRingTransport>
+class RpcClient {
+    using Header = detail::RpcHeader;
+    using Record = detail::RpcClientRecord;
+    using Slot = detail::RpcReplySlot<Resp>;
+    using Request = RpcRequest<Req>;
+public:
+    using Future = RpcFuture<Req, Resp, Transport>;
+
+    /* Wait up to timeout for the server, then claim a client record in its
+     * reply segment.
+     *
+     * Throws NoConsumer if the server does not appear in time, QueueError if
+     * its reply segment does not match Req and Resp or it already has the
+     * maximum number of clients, and FileLockError if there is a problem
+     * with the lock files. */
+    template <typename Rep, typename Period>
+    RpcClient (const char* name, std::chrono::duration<Rep, Period> timeout)
+            : mName(name)
+            , mControl(mName)
+            , mConsumptionMutex(mName + IPC_CONSUMER_SUFFIX)
+            , mProducer(name) {
+        using namespace boost::interprocess;
+        using std::swap;
+
+        if (!mProducer.waitForConsumer(timeout)) {
+            throw NoConsumer();
+        }
+        mEpoch = mControl->consumerEpoch.load(std::memory_order_acquire);
+
+        auto replyName = mName + IPC_REPLY_SUFFIX;
+        try {
+            ShmSegment segment { open_only, replyName.c_str() };
+            swap(mSegment, segment);
+        }
+        catch (interprocess_exception& exc) {
+            throw QueueError("Unable to open reply segment " + replyName);
+        }
+        if (mControl->consumerEpoch.load(std::memory_order_acquire) != mEpoch) {
+            throw NoConsumer();
+        }
+
+        auto header = static_cast<Header*>(mSegment.address());
+        if (mSegment.size() < sizeof(Header) ||
+                header->magic.load(std::memory_order_acquire) != Header::kMagic ||
+                header->requestSize != sizeof(Req) ||
+                header->responseSize != sizeof(Resp) ||
+                mSegment.size() < sizeof(Header) +
+                    header->maxClients * detail::rpcRecordSize<Resp>(header->depth)) {
+            throw QueueError("Server " + mName + " does not serve these request and response types");
+        }
+        mSegment.applyOptions(header->options);
+        mDepth = header->depth;
+
+        /* Claim the first client record whose lock nobody holds. */
+        for (size_t i = 0; i < header->maxClients && !mLock; ++i) {
+            std::unique_ptr<tmp_file_lock> lock {
+                new tmp_file_lock(detail::clientLockName(mName, i)) };
+            if (lock->try_lock()) {
+                mClient = static_cast<uint32_t>(i);
+                swap(mLock, lock);
+            }
+        }
+        if (!mLock) {
+            throw QueueError("Server " + mName + " has too many clients");
+        }
+        mRecord = reinterpret_cast<Record*>(static_cast<char*>(mSegment.address()) +
+                sizeof(Header) + mClient * detail::rpcRecordSize<Resp>(mDepth));
+        mSlots = reinterpret_cast<Slot*>(mRecord + 1);
+        mNextId = uint64_t(mRecord->generation.fetch_add(1, std::memory_order_relaxed) + 1) << 32;
+        mPending.assign(mDepth, 0);
+        mAbandoned.assign(mDepth, false);
+
+        LOG(debug) << "RpcClient(" << mName << ") constructed";
+    }
+
+    RpcClient (const RpcClient&) = delete;
+    RpcClient& operator= (const RpcClient&) = delete;
+
+    ~RpcClient () {
+        try {
+            mLock->unlock();
+        }
+        catch (FileLockError& exc) {
+            LOG(warning) << "RpcClient(" << mName << ") unable to release its lock";
+        }
+    }
+
+    /* How many times to check for a response before sleeping. Spinning
+     * only helps if the server runs on another core. */
+    void setSpinCount (size_t spinCount) {
+        mSpinCount = spinCount;
+    }
+
+    /* Send request to the server, and return a future for its response. If
+     * depth calls are already outstanding, waits for a response whose future
+     * has been dropped to free up its slot.
+     *
+     * Throws QueueError if depth calls are outstanding and none of their
+     * futures has been dropped, and NoConsumer if the server has gone
+     * away. */
+    Future call (const Req& request) {
+        auto slot = claimSlot();
+        auto id = ++mNextId;
+        mPending[slot] = id;
+        mAbandoned[slot] = false;
+        try {
+            auto& msg = mProducer.reserve();
+            msg.id = id;
+            msg.client = mClient;
+            msg.slot = static_cast<uint32_t>(slot);
+            msg.request = request;
+            mProducer.commit();
+        }
+        catch (...) {
+            mPending[slot] = 0;
+            throw;
+        }
+        return Future(*this, slot);
+    }
+
+private:
+    friend Future;
+
+    bool arrived (size_t slot) const {
+        return mSlots[slot].id.load(std::memory_order_acquire) == mPending[slot];
+    }
+
+    /* Spin, then sleep until the response for slot arrives or deadline
+     * passes, checking that the server is still there every
+     * stallCheckInterval. */
+    bool waitForReply (size_t slot, std::chrono::steady_clock::time_point deadline) {
+        for (size_t i = 0; i < mSpinCount; ++i) {
+            if (arrived(slot)) {
+                return true;
+            }
+        }
+        auto stalled = [this] () { checkServer(); };
+        return waitUntil(mRecord->replied, [&] () { return arrived(slot); }, stalled, deadline);
+    }
+
+    /* Copy out the response which has arrived in slot, then make sure the
+     * server did not overwrite it while we copied it. */
+    Resp take (size_t slot) {
+        Resp response = mSlots[slot].response;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        auto intact = mSlots[slot].id.load(std::memory_order_relaxed) == mPending[slot];
+        mPending[slot] = 0;
+        if (!intact) {
+            throw QueueError("Response from " + mName + " overwritten by a reply to a previous client");
+        }
+        return response;
+    }
+
+    void abandon (size_t slot) {
+        mAbandoned[slot] = true;
+    }
+
+    /* A free slot, or an abandoned one whose response has arrived. */
+    size_t claimSlot () {
+        bool abandoned = false;
+        for (size_t i = 0; i < mDepth; ++i) {
+            if (!mPending[i] || (mAbandoned[i] && arrived(i))) {
+                return i;
+            }
+            abandoned = abandoned || mAbandoned[i];
+        }
+        if (!abandoned) {
+            throw QueueError("Too many calls outstanding to " + mName);
+        }
+
+        size_t free = mDepth;
+        auto ready = [&] () {
+            for (size_t i = 0; i < mDepth && free == mDepth; ++i) {
+                if (mAbandoned[i] && arrived(i)) {
+                    free = i;
+                }
+            }
+            return free != mDepth;
+        };
+        auto stalled = [this] () { checkServer(); };
+        waitUntil(mRecord->replied, ready, stalled, std::chrono::steady_clock::time_point::max());
+        return free;
+    }
+
+    /* The server we attached to has gone if its epoch has moved on, or if it
+     * crashed, leaving its consumption lock free. */
+    void checkServer () {
+        if (mControl->consumerEpoch.load(std::memory_order_acquire) != mEpoch) {
+            throw NoConsumer();
+        }
+        if (mConsumptionMutex.try_lock()) {
+            mConsumptionMutex.unlock();
+            throw NoConsumer();
+        }
+    }
+
+    std::string mName;
+    ChannelControl mControl;
+    uint32_t mEpoch = 0;
+    tmp_file_lock mConsumptionMutex;
+    SharedProducer<Request, Transport> mProducer;
+    ShmSegment mSegment;
+    std::unique_ptr<tmp_file_lock> mLock;
+    uint32_t mClient = 0;
+    Record* mRecord = nullptr;
+    Slot* mSlots = nullptr;
+    size_t mDepth = 0;
+    size_t mSpinCount = 1000;
+    uint64_t mNextId = 0;
+
+    /* The id of the call outstanding in each slot, or 0. */
+    std::vector<uint64_t> mPending;
+    std::vector<bool> mAbandoned;
+};
+
+}
+
+#endif
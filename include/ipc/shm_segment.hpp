@@ -0,0 +1,167 @@
+#ifndef IPC_SHM_SEGMENT_HPP
+#define IPC_SHM_SEGMENT_HPP
+
+#include "util/log.hpp"
+
+#include <boost/interprocess/creation_tags.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/shared_memory_object.hpp>
+
+#include <string>
+#include <utility>
+
+#include <cerrno>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace ipc {
+
+/* Flags which control how a queue's shared memory is mapped, combined with
+ * bitwise or. They trade memory and setup time for steadier latency, and are
+ * all best-effort: if the system refuses one, a warning is logged and the
+ * segment is used as it is.
+ *
+ * SEGMENT_PREFAULT maps every page up front, so the first pass through the
+ * queue does not take a page fault per page.
+ *
+ * SEGMENT_LOCK locks the segment into RAM with mlock, so it is never paged
+ * out. This is subject to RLIMIT_MEMLOCK.
+ *
+ * SEGMENT_HUGE_PAGES rounds the segment up to a multiple of the huge page
+ * size and asks for transparent huge pages with madvise, to cut TLB misses
+ * on large queues. POSIX shared memory lives on a tmpfs (/dev/shm), which
+ * only honors this if it is mounted with huge=advise (or always, or
+ * within_size). Explicit MAP_HUGETLB mappings cannot be used here, since
+ * they require hugetlbfs rather than tmpfs. */
+enum SegmentOption : unsigned {
+    SEGMENT_PREFAULT = 1 << 0,
+    SEGMENT_LOCK = 1 << 1,
+    SEGMENT_HUGE_PAGES = 1 << 2
+};
+
+/* A named block of shared memory, mapped read-write into this process. This
+ * is a thin convenience over Boost.Interprocess's shared_memory_object and
+ * mapped_region: the object is created (or opened) and mapped in one step,
+ * and the mapping outlives the underlying handle.
+ *
+ * Errors are reported with Boost.Interprocess's interprocess_exception; the
+ * users of ShmSegment translate them into errors meaningful at their level. */
+class ShmSegment {
+public:
+    ShmSegment () = default;
+
+    /* Create a new segment of the given size. Its contents are zeroed. Fails
+     * if a segment by that name already exists. options is a combination of
+     * SegmentOption flags. */
+    ShmSegment (boost::interprocess::create_only_t, const char* name, size_t size,
+            unsigned options = 0) {
+        using namespace boost::interprocess;
+        if (options & SEGMENT_HUGE_PAGES) {
+            size = (size + kHugePageSize - 1) & ~(kHugePageSize - 1);
+        }
+        shared_memory_object shm { create_only, name, read_write };
+        shm.truncate(size);
+        map(shm);
+        applyOptions(options);
+    }
+
+    /* Open a segment, creating it if necessary, and make sure it is at least
+     * size bytes long. Any newly allocated bytes are zeroed. This is meant for
+     * structures which are valid when all-zero, since two processes may race
+     * to create the segment and neither can know whether it was first. */
+    ShmSegment (boost::interprocess::open_or_create_t, const char* name, size_t size) {
+        using namespace boost::interprocess;
+        shared_memory_object shm { open_or_create, name, read_write };
+        offset_t currentSize = 0;
+        if (!shm.get_size(currentSize) || currentSize < offset_t(size)) {
+            shm.truncate(size);
+        }
+        map(shm);
+    }
+
+    /* Open an existing segment, mapping all of it. */
+    ShmSegment (boost::interprocess::open_only_t, const char* name) {
+        using namespace boost::interprocess;
+        shared_memory_object shm { open_only, name, read_write };
+        map(shm);
+    }
+
+    /* Open an existing segment, mapping all of it read-only, for monitors
+     * which must not disturb it. */
+    ShmSegment (boost::interprocess::open_read_only_t, const char* name) {
+        using namespace boost::interprocess;
+        using std::swap;
+        shared_memory_object shm { open_only, name, read_only };
+        mapped_region region { shm, read_only };
+        swap(mRegion, region);
+    }
+
+    /* Apply SegmentOption flags to this process's mapping of the segment.
+     * The flags affect only the mapping they are applied to, so a process
+     * which opens a segment should apply the same flags as its creator. */
+    void applyOptions (unsigned options) {
+        auto address = mRegion.get_address();
+        auto size = mRegion.get_size();
+
+#ifdef MADV_HUGEPAGE
+        if (options & SEGMENT_HUGE_PAGES) {
+            if (madvise(address, size, MADV_HUGEPAGE)) {
+                LOG(warning) << "Unable to request huge pages: " << strerror(errno);
+            }
+        }
+#endif
+
+        if (options & SEGMENT_PREFAULT) {
+#ifdef MADV_POPULATE_WRITE
+            if (!madvise(address, size, MADV_POPULATE_WRITE)) {
+                options &= ~SEGMENT_PREFAULT;
+            }
+#endif
+        }
+        if (options & SEGMENT_PREFAULT) {
+            /* A read fault is enough to map a page of shared memory
+             * writable, and unlike a write it is safe while the segment is
+             * in use. */
+            auto pageSize = size_t(sysconf(_SC_PAGESIZE));
+            auto bytes = static_cast<volatile unsigned char*>(address);
+            for (size_t offset = 0; offset < size; offset += pageSize) {
+                (void)bytes[offset];
+            }
+        }
+
+        if (options & SEGMENT_LOCK) {
+            if (mlock(address, size)) {
+                LOG(warning) << "Unable to lock queue into memory: " << strerror(errno);
+            }
+        }
+    }
+
+    static bool remove (const char* name) {
+        return boost::interprocess::shared_memory_object::remove(name);
+    }
+
+    void* address () const {
+        return mRegion.get_address();
+    }
+
+    size_t size () const {
+        return mRegion.get_size();
+    }
+
+private:
+    static const size_t kHugePageSize = size_t(2) << 20;
+
+    void map (boost::interprocess::shared_memory_object& shm) {
+        using std::swap;
+        boost::interprocess::mapped_region region { shm, boost::interprocess::read_write };
+        swap(mRegion, region);
+    }
+
+    boost::interprocess::mapped_region mRegion;
+};
+
+}
+
+#endif
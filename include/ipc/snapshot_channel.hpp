@@ -0,0 +1,259 @@
+#ifndef IPC_SNAPSHOT_CHANNEL_HPP
+#define IPC_SNAPSHOT_CHANNEL_HPP
+
+#include "common.hpp"
+#include "errors.hpp"
+#include "event_count.hpp"
+#include "shm_segment.hpp"
+
+#include <boost/interprocess/creation_tags.hpp>
+#include <boost/interprocess/exceptions.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#include <cstdint>
+#include <cstring>
+
+namespace ipc {
+
+/* A conflating channel for state where only the latest value matters
+ * (positions, sensor readings): a table of keys slots in a POSIX shared
+ * memory segment, each holding the most recent Msg published for its key.
+ * Publishing overwrites the slot, so a slow reader simply sees fewer
+ * updates, never a backlog, and a writer never waits for readers.
+ *
+ * Each slot is a seqlock. The writer makes the slot's sequence number odd,
+ * writes the value, and makes it even again; a reader copies the value out
+ * and retries if the sequence number was odd or changed meanwhile. Writers
+ * are therefore wait-free and readers lock-free, and any number of readers
+ * can read at any rate without affecting the writer. Each key must have one
+ * writer at a time; different keys may be written concurrently. A writer
+ * which dies mid-publish leaves its key's sequence number odd: readers of
+ * the key give up after a while (see read) until it is published again.
+ *
+ * Every publish also bumps a channel-wide version number and signals an
+ * EventCount, so a reader can sleep until something changes (waitForChange)
+ * instead of polling. A signal costs the writer nothing unless a reader is
+ * waiting.
+ *
+ * Either side may create the channel, with create_only, and the other opens
+ * it by name with open_only. Msg must be trivially copyable. */
+template <typename Msg>
+class SnapshotChannel {
+    static_assert(std::is_trivially_copyable<Msg>::value,
+            "snapshot values must be trivially copyable");
+    static_assert(alignof(Msg) <= IPC_CACHE_LINE_SIZE,
+            "snapshot value alignment must not exceed a cache line");
+public:
+    static bool remove (const char* name) {
+        return ShmSegment::remove(name);
+    }
+
+    /* Create a channel with keys slots, every one of them empty. options
+     * are SegmentOption flags, as for a queue.
+     *
+     * Throws QueueError if the segment cannot be created. */
+    SnapshotChannel (boost::interprocess::create_only_t, const char* name,
+            size_t keys = 1, unsigned options = 0) {
+        using namespace boost::interprocess;
+        using std::swap;
+        if (!keys) {
+            throw QueueError("A snapshot channel needs at least one key");
+        }
+        try {
+            ShmSegment segment { create_only, name, sizeof(Header) + keys * sizeof(Slot), options };
+            swap(mSegment, segment);
+        }
+        catch (interprocess_exception& exc) {
+            throw QueueError(std::string("Unable to create snapshot channel named ") + name);
+        }
+
+        mHeader = new (mSegment.address()) Header();
+        mHeader->keys = keys;
+        mHeader->slotSize = sizeof(Msg);
+        mHeader->options = options;
+        attach();
+        for (size_t i = 0; i < keys; ++i) {
+            new (&mSlots[i]) Slot();
+        }
+        mHeader->magic.store(kMagic, std::memory_order_release);
+    }
+
+    /* Throws QueueError if the segment does not exist, or is not a snapshot
+     * channel of Msg. */
+    SnapshotChannel (boost::interprocess::open_only_t, const char* name) {
+        using namespace boost::interprocess;
+        using std::swap;
+        try {
+            ShmSegment segment { open_only, name };
+            swap(mSegment, segment);
+        }
+        catch (interprocess_exception& exc) {
+            throw QueueError(std::string("Unable to open snapshot channel named ") + name);
+        }
+
+        mHeader = static_cast<Header*>(mSegment.address());
+        if (mSegment.size() < sizeof(Header) ||
+                mHeader->magic.load(std::memory_order_acquire) != kMagic ||
+                mHeader->slotSize != sizeof(Msg) ||
+                mSegment.size() < sizeof(Header) + mHeader->keys * sizeof(Slot)) {
+            throw QueueError(std::string(name) + " is not a snapshot channel of this type");
+        }
+        mSegment.applyOptions(mHeader->options);
+        attach();
+    }
+
+    SnapshotChannel (const SnapshotChannel&) = delete;
+    SnapshotChannel& operator= (const SnapshotChannel&) = delete;
+
+    size_t keys () const {
+        return mKeys;
+    }
+
+    /* Replace the value for key. Wait-free. If the key's last writer died
+     * mid-publish, this completes its publish with our value.
+     *
+     * Throws QueueError if there is no such key. */
+    void publish (const Msg& value, size_t key = 0) {
+        auto& slot = mSlots[checkKey(key)];
+        auto sequence = slot.sequence.load(std::memory_order_relaxed) & ~uint64_t(1);
+        slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        std::memcpy(&slot.value, &value, sizeof(Msg));
+        slot.sequence.store(sequence + 2, std::memory_order_release);
+
+        mHeader->version.fetch_add(1, std::memory_order_release);
+        mHeader->changed.notifyAll();
+    }
+
+    /* Copy the latest value for key into value. Returns false, leaving value
+     * alone, if nothing has been published for key yet. While the key is
+     * being published, spins a little, then yields between attempts.
+     *
+     * Throws QueueError if there is no such key, or if the key has been stuck
+     * mid-publish for stuckTimeout, which means its writer died. */
+    bool read (Msg& value, size_t key = 0) const {
+        uint64_t version;
+        return readVersion(value, version, key);
+    }
+
+    /* Like read, but only if the value has changed since version, which is
+     * updated to the version read. Start with a version of zero. */
+    bool readIfChanged (Msg& value, uint64_t& version, size_t key = 0) const {
+        if (this->version(key) == version) {
+            return false;
+        }
+        return readVersion(value, version, key);
+    }
+
+    /* The number of times key has been published. */
+    uint64_t version (size_t key) const {
+        return mSlots[checkKey(key)].sequence.load(std::memory_order_acquire) / 2;
+    }
+
+    /* The number of times any key has been published. */
+    uint64_t version () const {
+        return mHeader->version.load(std::memory_order_acquire);
+    }
+
+    /* Wait until the channel-wide version differs from version, or until
+     * timeout elapses. Returns whether it changed. */
+    template <typename Rep, typename Period>
+    bool waitForChange (uint64_t version, std::chrono::duration<Rep, Period> timeout) const {
+        return mHeader->changed.waitFor([&] () { return this->version() != version; }, timeout);
+    }
+
+    /* How long a key may stay mid-publish before readers decide its writer
+     * died. A live writer takes microseconds, unless it is descheduled. */
+    static std::chrono::milliseconds stuckTimeout () {
+        return std::chrono::milliseconds(1000);
+    }
+
+private:
+    static const uint32_t kMagic = 0x534e4150; /* "SNAP" */
+    static const unsigned kSpinLimit = 64;
+
+    struct Header {
+        std::atomic<uint32_t> magic;
+        uint32_t slotSize;
+        uint64_t keys;
+        uint32_t options;
+
+        alignas(IPC_CACHE_LINE_SIZE) std::atomic<uint64_t> version;
+        alignas(IPC_CACHE_LINE_SIZE) EventCount changed;
+    };
+
+    /* Each slot has its own cache line(s), so writers of different keys do
+     * not disturb each other's readers. sequence is twice the number of
+     * completed publishes, plus one while a publish is in progress. */
+    struct alignas(IPC_CACHE_LINE_SIZE) Slot {
+        std::atomic<uint64_t> sequence;
+        Msg value;
+    };
+
+    void attach () {
+        mKeys = mHeader->keys;
+        mSlots = reinterpret_cast<Slot*>(mHeader + 1);
+    }
+
+    size_t checkKey (size_t key) const {
+        if (key >= mKeys) {
+            throw QueueError("No snapshot key " + std::to_string(key));
+        }
+        return key;
+    }
+
+    bool readVersion (Msg& value, uint64_t& version, size_t key) const {
+        auto& slot = mSlots[checkKey(key)];
+        uint64_t stuck = 0;
+        std::chrono::steady_clock::time_point stuckSince;
+        for (unsigned attempt = 1; ; ++attempt) {
+            auto sequence = slot.sequence.load(std::memory_order_acquire);
+            if (!sequence) {
+                return false;
+            }
+            if (!(sequence & 1)) {
+                Msg copy;
+                std::memcpy(&copy, &slot.value, sizeof(Msg));
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (slot.sequence.load(std::memory_order_relaxed) == sequence) {
+                    value = copy;
+                    version = sequence / 2;
+                    return true;
+                }
+            }
+            if (attempt < kSpinLimit) {
+                continue;
+            }
+            std::this_thread::yield();
+
+            /* A busy writer moves the sequence on; a dead one leaves it odd. */
+            if (sequence & 1) {
+                auto now = std::chrono::steady_clock::now();
+                if (sequence != stuck) {
+                    stuck = sequence;
+                    stuckSince = now;
+                }
+                else if (now - stuckSince >= stuckTimeout()) {
+                    throw QueueError("Snapshot key " + std::to_string(key) +
+                            " was left mid-publish by a writer which died");
+                }
+            }
+        }
+    }
+
+    ShmSegment mSegment;
+    Header* mHeader = nullptr;
+    Slot* mSlots = nullptr;
+    size_t mKeys = 0;
+};
+
+}
+
+#endif
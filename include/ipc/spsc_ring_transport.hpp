@@ -0,0 +1,290 @@
+#ifndef IPC_SPSC_RING_TRANSPORT_HPP
+#define IPC_SPSC_RING_TRANSPORT_HPP
+
+#include "common.hpp"
+#include "errors.hpp"
+#include "event_count.hpp"
+#include "shm_segment.hpp"
+
+#include <boost/interprocess/exceptions.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <string>
+#include <utility>
+
+#include <cstdint>
+#include <cstring>
+
+namespace ipc {
+
+/* A single-producer, single-consumer ring buffer in a POSIX shared memory
+ * segment. See message_queue_transport.hpp for the transport interface.
+ *
+ * The ring holds a power-of-two number of sizeof(Msg) slots, and is
+ * coordinated entirely by two free-running 32-bit indices: the producer owns
+ * writeIndex and the consumer owns readIndex. Each lives on its own cache
+ * line, so in the steady state the only cross-core traffic is the slot data
+ * itself and an occasional refresh of the other side's index. Neither side
+ * takes a lock; a producer waits out a full ring on an EventCount.
+ *
+ * Since there is exactly one writer, this transport may only back an
+ * exclusive Producer. */
+template <typename Msg>
+class SpscRingTransport {
+    static_assert(alignof(Msg) <= IPC_CACHE_LINE_SIZE,
+            "message type alignment must not exceed a cache line");
+public:
+    static const bool multiProducer = false;
+
+    /* Only the consumer may advance readIndex, so the producer cannot
+     * discard messages. */
+    static const bool canOverwrite = false;
+
+    static bool remove (const char* name) {
+        return ShmSegment::remove(name);
+    }
+
+    SpscRingTransport (boost::interprocess::create_only_t, const char* name,
+            size_t capacity, unsigned options = 0) {
+        using namespace boost::interprocess;
+        using std::swap;
+        capacity = roundUpToPowerOfTwo(capacity);
+        try {
+            ShmSegment segment { create_only, name, sizeof(Header) + capacity * sizeof(Msg), options };
+            swap(mSegment, segment);
+        }
+        catch (interprocess_exception& exc) {
+            throw QueueError(std::string("Unable to create queue named ") + name);
+        }
+
+        mHeader = new (mSegment.address()) Header();
+        mHeader->capacity = static_cast<uint32_t>(capacity);
+        mHeader->options = options;
+        mHeader->slotSize = sizeof(Msg);
+        mHeader->magic.store(kMagic, std::memory_order_release);
+        attach();
+    }
+
+    SpscRingTransport (boost::interprocess::open_only_t, const char* name) {
+        using namespace boost::interprocess;
+        using std::swap;
+        try {
+            ShmSegment segment { open_only, name };
+            swap(mSegment, segment);
+        }
+        catch (interprocess_exception& exc) {
+            throw QueueError("Unable to open queue");
+        }
+
+        mHeader = static_cast<Header*>(mSegment.address());
+        if (mSegment.size() < sizeof(Header) ||
+                mHeader->magic.load(std::memory_order_acquire) != kMagic ||
+                mHeader->slotSize != sizeof(Msg) ||
+                mSegment.size() < sizeof(Header) + mHeader->capacity * sizeof(Msg)) {
+            throw QueueError(std::string("Queue ") + name + " is not a ring of this message type");
+        }
+        mSegment.applyOptions(mHeader->options);
+        attach();
+    }
+
+    SpscRingTransport (const SpscRingTransport&) = delete;
+    SpscRingTransport& operator= (const SpscRingTransport&) = delete;
+
+    size_t capacity () const {
+        return mCapacity;
+    }
+
+    template <typename Stalled>
+    void send (const Msg& msg, EventCount& consumerEvents, Stalled stalled) {
+        auto w = mHeader->writeIndex.load(std::memory_order_relaxed);
+        if (w - mCachedReadIndex == mCapacity) {
+            waitForSpace(w, stalled);
+        }
+
+        std::memcpy(slot(w), &msg, sizeof(Msg));
+        mHeader->writeIndex.store(w + 1, std::memory_order_release);
+        consumerEvents.notifyAll();
+    }
+
+    bool trySend (const Msg& msg, EventCount& consumerEvents) {
+        auto w = mHeader->writeIndex.load(std::memory_order_relaxed);
+        if (w - mCachedReadIndex == mCapacity && !hasSpace(w)) {
+            return false;
+        }
+
+        std::memcpy(slot(w), &msg, sizeof(Msg));
+        mHeader->writeIndex.store(w + 1, std::memory_order_release);
+        consumerEvents.notifyAll();
+        return true;
+    }
+
+    template <typename Stalled>
+    bool timedSend (const Msg& msg, EventCount& consumerEvents, Stalled stalled,
+            std::chrono::steady_clock::time_point deadline) {
+        auto w = mHeader->writeIndex.load(std::memory_order_relaxed);
+        if (w - mCachedReadIndex == mCapacity &&
+                !waitUntil(mHeader->notFull, [&] () { return hasSpace(w); },
+                    stalled, deadline)) {
+            return false;
+        }
+
+        std::memcpy(slot(w), &msg, sizeof(Msg));
+        mHeader->writeIndex.store(w + 1, std::memory_order_release);
+        consumerEvents.notifyAll();
+        return true;
+    }
+
+    /* Copy as many messages as fit, publish them all with one store to
+     * writeIndex, and repeat until the batch is sent. */
+    template <typename Stalled>
+    void sendBatch (const Msg* msgs, size_t count, EventCount& consumerEvents,
+            Stalled stalled) {
+        auto w = mHeader->writeIndex.load(std::memory_order_relaxed);
+        while (count) {
+            if (w - mCachedReadIndex == mCapacity) {
+                /* The consumer must hear about what we have published so
+                 * far, or it will never make room for the rest. */
+                consumerEvents.notifyAll();
+                waitForSpace(w, stalled);
+            }
+            auto n = std::min<size_t>(count, mCapacity - (w - mCachedReadIndex));
+            copyIn(w, msgs, n);
+            w += static_cast<uint32_t>(n);
+            msgs += n;
+            count -= n;
+            mHeader->writeIndex.store(w, std::memory_order_release);
+        }
+        consumerEvents.notifyAll();
+    }
+
+    /* The reservation is the slot at writeIndex itself; commit publishes it
+     * by advancing writeIndex. */
+    template <typename Stalled>
+    Msg& reserve (Stalled stalled) {
+        auto w = mHeader->writeIndex.load(std::memory_order_relaxed);
+        if (w - mCachedReadIndex == mCapacity) {
+            waitForSpace(w, stalled);
+        }
+        return *new (slot(w)) Msg;
+    }
+
+    template <typename Stalled>
+    void commit (EventCount& consumerEvents, Stalled) {
+        auto w = mHeader->writeIndex.load(std::memory_order_relaxed);
+        mHeader->writeIndex.store(w + 1, std::memory_order_release);
+        consumerEvents.notifyAll();
+    }
+
+    template <typename F>
+    bool tryConsume (F&& f) {
+        auto r = mHeader->readIndex.load(std::memory_order_relaxed);
+        if (r == mCachedWriteIndex) {
+            mCachedWriteIndex = mHeader->writeIndex.load(std::memory_order_acquire);
+            if (r == mCachedWriteIndex) {
+                return false;
+            }
+        }
+
+        Release release { *this, r + 1 };
+        f(*reinterpret_cast<const Msg*>(slot(r)));
+        return true;
+    }
+
+    /* Deliver the messages in place, up to the end of the ring. A run which
+     * wraps around is delivered over two calls. */
+    template <typename F>
+    size_t tryConsumeBatch (Msg*, size_t max, F&& f) {
+        auto r = mHeader->readIndex.load(std::memory_order_relaxed);
+        mCachedWriteIndex = mHeader->writeIndex.load(std::memory_order_acquire);
+        auto n = std::min<size_t>({ max, size_t(mCachedWriteIndex - r),
+                size_t(mCapacity - (r & mMask)) });
+        if (!n) {
+            return 0;
+        }
+
+        Release release { *this, r + static_cast<uint32_t>(n) };
+        f(reinterpret_cast<const Msg*>(slot(r)), n);
+        return n;
+    }
+
+private:
+    /* Identifies an initialized ring, and guards against a producer built
+     * against a different layout. */
+    static const uint32_t kMagic = 0x53505343; /* "SPSC" */
+
+    struct Header {
+        std::atomic<uint32_t> magic;
+        uint32_t capacity;
+        uint32_t slotSize;
+        uint32_t options;
+
+        alignas(IPC_CACHE_LINE_SIZE) std::atomic<uint32_t> writeIndex;
+        alignas(IPC_CACHE_LINE_SIZE) std::atomic<uint32_t> readIndex;
+        alignas(IPC_CACHE_LINE_SIZE) EventCount notFull;
+    };
+
+    /* Hands consumed slots back to the producer on scope exit, so a message
+     * delivered in place stays intact until its handler is done with it. */
+    struct Release {
+        SpscRingTransport& transport;
+        uint32_t readIndex;
+
+        ~Release () {
+            transport.mHeader->readIndex.store(readIndex, std::memory_order_release);
+            transport.mHeader->notFull.notifyAll();
+        }
+    };
+
+    void attach () {
+        mCapacity = mHeader->capacity;
+        mMask = mCapacity - 1;
+        mSlots = reinterpret_cast<unsigned char*>(mHeader + 1);
+        mCachedReadIndex = mHeader->readIndex.load(std::memory_order_acquire);
+        mCachedWriteIndex = mHeader->writeIndex.load(std::memory_order_acquire);
+    }
+
+    unsigned char* slot (uint32_t index) const {
+        return mSlots + (index & mMask) * sizeof(Msg);
+    }
+
+    /* Refresh our copy of readIndex, and say whether there is room to write
+     * at w. */
+    bool hasSpace (uint32_t w) {
+        mCachedReadIndex = mHeader->readIndex.load(std::memory_order_acquire);
+        return w - mCachedReadIndex != mCapacity;
+    }
+
+    template <typename Stalled>
+    void waitForSpace (uint32_t w, Stalled& stalled) {
+        while (!mHeader->notFull.waitFor([&] () { return hasSpace(w); },
+                    stallCheckInterval())) {
+            stalled();
+        }
+    }
+
+    /* Copy n messages into the ring starting at index, in at most two
+     * pieces, since the run may wrap around the end of the ring. */
+    void copyIn (uint32_t index, const Msg* msgs, size_t n) {
+        auto first = std::min<size_t>(n, mCapacity - (index & mMask));
+        std::memcpy(slot(index), msgs, first * sizeof(Msg));
+        std::memcpy(mSlots, msgs + first, (n - first) * sizeof(Msg));
+    }
+
+    ShmSegment mSegment;
+    Header* mHeader = nullptr;
+    unsigned char* mSlots = nullptr;
+    uint32_t mCapacity = 0;
+    uint32_t mMask = 0;
+
+    /* Each side's last-seen copy of the other side's index. Refreshed only
+     * when the ring looks full (producer) or empty (consumer). */
+    uint32_t mCachedReadIndex = 0;
+    uint32_t mCachedWriteIndex = 0;
+};
+
+}
+
+#endif
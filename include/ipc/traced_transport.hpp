@@ -0,0 +1,252 @@
+#ifndef IPC_TRACED_TRANSPORT_HPP
+#define IPC_TRACED_TRANSPORT_HPP
+
+#include "event_count.hpp"
+#include "latency_trace.hpp"
+#include "mpsc_ring_transport.hpp"
+
+#include <boost/interprocess/creation_tags.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <cstdint>
+
+#include <unistd.h>
+
+namespace ipc {
+
+/* What a TracedTransport puts in each slot of its ring: the message, stamped
+ * by the producer with the time it was sent and the producer's sequence
+ * number for it. */
+template <typename Msg>
+struct TracedSlot {
+    uint64_t sentAt;
+    uint32_t producer;
+    uint32_t sequence;
+    Msg msg;
+};
+
+/* A transport which traces every message's latency on its way through
+ * another transport, Ring, for finding out how long messages wait in the
+ * queue. See message_queue_transport.hpp for the transport interface.
+ *
+ * Producers stamp each message with the time and their own sequence number,
+ * in a header alongside it in the Ring's slot. As the consumer takes each
+ * message out, it records how long the message was queued, and once the
+ * handler returns, how long handling it took, in the LatencyTrace returned
+ * by Consumer::latencyTrace. A producer's sequence numbers should arrive
+ * without gaps, so any gap is counted as missing messages. The producer and
+ * the consumer must both use a TracedTransport of the same Ring.
+ *
+ * Tracing costs a clock read on each send, and two clock reads, two
+ * histogram updates and a sequence check on each receive, and the header
+ * makes every slot 16 bytes larger. Batch receives copy the messages out of
+ * their slots. Ring must carry fixed-size messages, so ByteRingTransport
+ * cannot be traced.
+ *
+ * Use Traced below to name a TracedTransport as a Transport parameter, so
+ * tracing can be switched off at compile time. */
+template <typename Msg, template <typename> class Ring>
+class TracedTransport {
+    using Slot = TracedSlot<Msg>;
+public:
+    static const bool multiProducer = Ring<Slot>::multiProducer;
+    static const bool canOverwrite = Ring<Slot>::canOverwrite;
+
+    static bool remove (const char* name) {
+        return Ring<Slot>::remove(name);
+    }
+
+    TracedTransport (boost::interprocess::create_only_t, const char* name,
+            size_t capacity, unsigned options = 0)
+            : mRing(new Ring<Slot>(boost::interprocess::create_only, name, capacity, options)) { }
+
+    TracedTransport (boost::interprocess::open_only_t, const char* name)
+            : mRing(new Ring<Slot>(boost::interprocess::open_only, name))
+            , mProducer(static_cast<uint32_t>(getpid())) { }
+
+    TracedTransport (const TracedTransport&) = delete;
+    TracedTransport& operator= (const TracedTransport&) = delete;
+
+    size_t capacity () const {
+        return mRing->capacity();
+    }
+
+    LatencyTrace& trace () {
+        return mTrace;
+    }
+
+    /* A message's sequence number is used up only once it is in the queue,
+     * so a trySend which finds the queue full does not leave a gap. */
+    template <typename Stalled>
+    void send (const Msg& msg, EventCount& consumerEvents, Stalled stalled) {
+        mRing->send(stamp(msg), consumerEvents, stalled);
+        ++mSequence;
+    }
+
+    bool trySend (const Msg& msg, EventCount& consumerEvents) {
+        if (!mRing->trySend(stamp(msg), consumerEvents)) {
+            return false;
+        }
+        ++mSequence;
+        return true;
+    }
+
+    template <typename Stalled>
+    bool timedSend (const Msg& msg, EventCount& consumerEvents, Stalled stalled,
+            std::chrono::steady_clock::time_point deadline) {
+        if (!mRing->timedSend(stamp(msg), consumerEvents, stalled, deadline)) {
+            return false;
+        }
+        ++mSequence;
+        return true;
+    }
+
+    template <typename Stalled>
+    size_t sendOverwriting (const Msg& msg, EventCount& consumerEvents, Stalled stalled) {
+        auto discarded = mRing->sendOverwriting(stamp(msg), consumerEvents, stalled);
+        ++mSequence;
+        return discarded;
+    }
+
+    template <typename Stalled>
+    void sendBatch (const Msg* msgs, size_t count, EventCount& consumerEvents,
+            Stalled stalled) {
+        mScratch.resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            mScratch[i] = stamp(msgs[i]);
+            ++mSequence;
+        }
+        mRing->sendBatch(mScratch.data(), count, consumerEvents, stalled);
+    }
+
+    /* The message is stamped when it is committed, not when it is
+     * reserved. */
+    template <typename Stalled>
+    Msg& reserve (Stalled stalled) {
+        mReserved = &mRing->reserve(stalled);
+        return mReserved->msg;
+    }
+
+    template <typename Stalled>
+    void commit (EventCount& consumerEvents, Stalled stalled) {
+        mReserved->sentAt = detail::traceClock();
+        mReserved->producer = mProducer;
+        mReserved->sequence = mSequence++;
+        mRing->commit(consumerEvents, stalled);
+    }
+
+    template <typename F>
+    bool tryConsume (F&& f) {
+        return mRing->tryConsume([&] (const Slot& slot) {
+            auto dequeuedAt = received(slot);
+            f(slot.msg);
+            mTrace.mHandlerLatency.record(detail::traceClock() - dequeuedAt);
+        });
+    }
+
+    /* The messages are copied out of their slots into scratch, so they can
+     * be delivered as an array of Msg. */
+    template <typename F>
+    size_t tryConsumeBatch (Msg* scratch, size_t max, F&& f) {
+        mScratch.resize(max);
+        uint64_t dequeuedAt = 0;
+        auto count = mRing->tryConsumeBatch(mScratch.data(), max,
+                [&] (const Slot* slots, size_t count) {
+                    for (size_t i = 0; i < count; ++i) {
+                        dequeuedAt = received(slots[i]);
+                        scratch[i] = slots[i].msg;
+                    }
+                    f(static_cast<const Msg*>(scratch), count);
+                });
+        if (count) {
+            mTrace.mHandlerLatency.record(detail::traceClock() - dequeuedAt, count);
+        }
+        return count;
+    }
+
+private:
+    Slot stamp (const Msg& msg) {
+        Slot slot;
+        slot.sentAt = detail::traceClock();
+        slot.producer = mProducer;
+        slot.sequence = mSequence;
+        slot.msg = msg;
+        return slot;
+    }
+
+    /* Record how long slot was queued, and check its sequence number against
+     * the last one from the same producer. Returns the time. */
+    uint64_t received (const Slot& slot) {
+        auto now = detail::traceClock();
+        mTrace.mQueueLatency.record(now > slot.sentAt ? now - slot.sentAt : 0);
+
+        if (slot.producer != mLastProducer) {
+            if (mLastProducer) {
+                mLastSequences[mLastProducer] = mNextSequence;
+            }
+            auto known = mLastSequences.find(slot.producer);
+            mNextSequence = known == mLastSequences.end() ? slot.sequence : known->second;
+            mLastProducer = slot.producer;
+        }
+        /* A producer which starts over, e.g., a new process with a recycled
+         * pid, appears to go backwards; count no gap for it. */
+        auto gap = slot.sequence - mNextSequence;
+        if (gap && gap < (uint32_t(1) << 31)) {
+            mTrace.mSequenceGaps.fetch_add(gap, std::memory_order_relaxed);
+        }
+        mNextSequence = slot.sequence + 1;
+        return now;
+    }
+
+    std::unique_ptr<Ring<Slot>> mRing;
+    std::vector<Slot> mScratch;
+
+    /* Producer side. */
+    uint32_t mProducer = 0;
+    uint32_t mSequence = 0;
+    Slot* mReserved = nullptr;
+
+    /* Consumer side: the sequence number expected next from each producer
+     * seen, with the most recent producer's kept out of the map. */
+    LatencyTrace mTrace;
+    std::unordered_map<uint32_t, uint32_t> mLastSequences;
+    uint32_t mLastProducer = 0;
+    uint32_t mNextSequence = 0;
+};
+
+template <typename Msg, template <typename> class Ring>
+LatencyTrace* latencyTraceOf (TracedTransport<Msg, Ring>& transport) {
+    return &transport.trace();
+}
+
+/* Ring with per-message latency tracing if IPC_TRACE_LATENCY is nonzero,
+ * and plain Ring otherwise, e.g.
+ *
+ *   Consumer<Msg, 1024, Traced<SpscRingTransport>::Transport> consumer { name };
+ *   ...
+ *   if (auto trace = consumer.latencyTrace()) {
+ *       report(trace->queueLatency().valueAtPercentile(99));
+ *   }
+ *
+ * Producers must be built with the same setting as their consumer. If they
+ * are not, the consumer's ring has slots of the wrong size, and opening it
+ * fails. */
+template <template <typename> class Ring = MpscRingTransport>
+struct Traced {
+#if IPC_TRACE_LATENCY
+    template <typename Msg>
+    using Transport = TracedTransport<Msg, Ring>;
+#else
+    template <typename Msg>
+    using Transport = Ring<Msg>;
+#endif
+};
+
+}
+
+#endif
@@ -0,0 +1,445 @@
+#ifndef ASYNC_LOG_HPP
+#define ASYNC_LOG_HPP
+
+#include "util/log.hpp"
+
+#include <boost/log/trivial.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace util {
+
+/* An asynchronous log for hot paths, e.g., per-message tracing in production,
+ * which LOG would slow down with a trip through the Boost.Log core and a
+ * synchronous write for every line. Use it through ALOG below.
+ *
+ * ALOG writes a binary record into a lock-free ring of fixed-size slots, after
+ * Dmitry Vyukov's bounded queue: a slot claimed with one compare-and-swap, the
+ * raw bytes of each value copied in, and a release store to publish it.
+ * Nothing is formatted and no system call is made on the logging thread. A
+ * background thread started by start drains the ring, formats each record
+ * like Boost.Log's default sink would, and writes it out. If the ring is
+ * full, records are dropped, never waited for; droppedRecords counts them. A
+ * record holds about 230 bytes of values, and is truncated beyond that.
+ *
+ * Until start is called, and after stop, ALOG statements cost one atomic load
+ * and are otherwise skipped, so they may be left in hot paths. Records logged
+ * concurrently with stop may be lost. */
+class AsyncLog {
+public:
+    using Severity = boost::log::trivial::severity_level;
+
+    static const size_t kSlotSize = 256;
+
+    /* The log, which is shared by the whole process. */
+    static AsyncLog& instance () {
+        static AsyncLog log;
+        return log;
+    }
+
+    ~AsyncLog () {
+        stop();
+    }
+
+    AsyncLog (const AsyncLog&) = delete;
+    AsyncLog& operator= (const AsyncLog&) = delete;
+
+    /* Start draining records to out, with room for capacity records, rounded
+     * up to a power of two, waiting to be written. The ring is allocated on
+     * the first start and kept thereafter, so later capacities are
+     * ignored. */
+    void start (FILE* out = stderr, size_t capacity = 4096) {
+        if (mRunning.load(std::memory_order_relaxed)) {
+            return;
+        }
+        if (!mSlots) {
+            size_t rounded = 1;
+            while (rounded < capacity) {
+                rounded <<= 1;
+            }
+            mSlots.reset(new Slot[rounded]);
+            mMask = rounded - 1;
+            for (size_t i = 0; i < rounded; ++i) {
+                mSlots[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+        mOut = out;
+        mStopFlag.store(false, std::memory_order_relaxed);
+        mRunning.store(true, std::memory_order_release);
+        mDrainThread = std::thread(&AsyncLog::drainThread, this);
+    }
+
+    /* Write out every record logged so far and stop the drain thread. */
+    void stop () {
+        if (!mRunning.exchange(false, std::memory_order_relaxed)) {
+            return;
+        }
+        mStopFlag.store(true, std::memory_order_relaxed);
+        mDrainThread.join();
+    }
+
+    /* Skip records less severe than severity at run time. */
+    void setMinSeverity (Severity severity) {
+        mMinSeverity.store(severity, std::memory_order_relaxed);
+    }
+
+    bool enabled (Severity severity) const {
+        return mRunning.load(std::memory_order_acquire) &&
+            severity >= mMinSeverity.load(std::memory_order_relaxed);
+    }
+
+    uint64_t droppedRecords () const {
+        return mDroppedRecords.load(std::memory_order_relaxed);
+    }
+
+private:
+    friend class AsyncLogLine;
+
+    enum Kind : uint8_t {
+        KIND_STRING,
+        KIND_CHAR,
+        KIND_BOOL,
+        KIND_SIGNED,
+        KIND_UNSIGNED,
+        KIND_DOUBLE,
+        KIND_POINTER
+    };
+
+    struct Header {
+        uint64_t time;
+        uint32_t thread;
+        uint8_t severity;
+        uint8_t truncated;
+        uint16_t length;
+    };
+
+    static const size_t kPayloadSize = kSlotSize - sizeof(std::atomic<size_t>) - sizeof(Header);
+
+    struct Slot {
+        std::atomic<size_t> sequence;
+        Header header;
+        char payload[kPayloadSize];
+    };
+
+    AsyncLog () = default;
+
+    /* A free slot, or null if the ring is full. */
+    Slot* claim () {
+        auto pos = mEnqueueIndex.load(std::memory_order_relaxed);
+        while (true) {
+            auto& slot = mSlots[pos & mMask];
+            auto sequence = slot.sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (!diff) {
+                if (mEnqueueIndex.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    slot.header.truncated = 0;
+                    slot.header.length = 0;
+                    return &slot;
+                }
+            }
+            else if (diff < 0) {
+                mDroppedRecords.fetch_add(1, std::memory_order_relaxed);
+                return nullptr;
+            }
+            else {
+                pos = mEnqueueIndex.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /* Hand a claimed slot to the drain thread. Its position is one less than
+     * its sequence number once the slot is ready, so it is recovered from the
+     * sequence number it was claimed at. */
+    void publish (Slot& slot) {
+        auto pos = slot.sequence.load(std::memory_order_relaxed);
+        slot.sequence.store(pos + 1, std::memory_order_release);
+    }
+
+    void drainThread () {
+        std::string line;
+        while (true) {
+            auto stopping = mStopFlag.load(std::memory_order_relaxed);
+            bool drained = false;
+            while (auto slot = next()) {
+                format(*slot, line);
+                fwrite(line.data(), 1, line.size(), mOut);
+                release(*slot);
+                drained = true;
+            }
+            if (drained) {
+                fflush(mOut);
+            }
+            if (stopping) {
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    Slot* next () {
+        auto& slot = mSlots[mDequeueIndex & mMask];
+        if (slot.sequence.load(std::memory_order_acquire) != mDequeueIndex + 1) {
+            return nullptr;
+        }
+        return &slot;
+    }
+
+    void release (Slot& slot) {
+        slot.sequence.store(mDequeueIndex + mMask + 1, std::memory_order_release);
+        ++mDequeueIndex;
+    }
+
+    static void format (const Slot& slot, std::string& line) {
+        auto& header = slot.header;
+        time_t seconds = header.time / 1000000000;
+        struct tm local;
+        localtime_r(&seconds, &local);
+        char prefix[80];
+        auto n = strftime(prefix, sizeof(prefix), "[%Y-%m-%d %H:%M:%S", &local);
+        snprintf(prefix + n, sizeof(prefix) - n, ".%06u] [%u] [%s]   ",
+                unsigned(header.time % 1000000000 / 1000), header.thread,
+                boost::log::trivial::to_string(static_cast<Severity>(header.severity)));
+        line = prefix;
+
+        std::ostringstream values;
+        auto p = slot.payload;
+        auto end = p + header.length;
+        while (p < end) {
+            auto kind = static_cast<Kind>(*p++);
+            switch (kind) {
+                case KIND_STRING: {
+                    uint16_t length;
+                    memcpy(&length, p, sizeof(length));
+                    p += sizeof(length);
+                    values.write(p, length);
+                    p += length;
+                    break;
+                }
+                case KIND_CHAR:
+                    values << *p++;
+                    break;
+                case KIND_BOOL:
+                    values << bool(*p++);
+                    break;
+                case KIND_SIGNED:
+                    values << read<long long>(p);
+                    break;
+                case KIND_UNSIGNED:
+                    values << read<unsigned long long>(p);
+                    break;
+                case KIND_DOUBLE:
+                    values << read<double>(p);
+                    break;
+                case KIND_POINTER:
+                    values << read<const void*>(p);
+                    break;
+            }
+        }
+        if (header.truncated) {
+            values << "...";
+        }
+        line += values.str();
+        line += '\n';
+    }
+
+    template <typename T>
+    static T read (const char*& p) {
+        T value;
+        memcpy(&value, p, sizeof(value));
+        p += sizeof(value);
+        return value;
+    }
+
+    std::unique_ptr<Slot[]> mSlots;
+    size_t mMask = 0;
+    std::atomic<bool> mRunning = { false };
+    std::atomic<Severity> mMinSeverity = { boost::log::trivial::trace };
+    std::atomic<uint64_t> mDroppedRecords = { 0 };
+
+    /* Logging threads. */
+    alignas(64) std::atomic<size_t> mEnqueueIndex = { 0 };
+
+    /* The drain thread. */
+    alignas(64) size_t mDequeueIndex = 0;
+    FILE* mOut = nullptr;
+    std::atomic<bool> mStopFlag = { false };
+    std::thread mDrainThread;
+};
+
+/* One ALOG statement: claims a slot, streams values into it in their binary
+ * form, and publishes it when the statement ends. Types other than strings,
+ * characters, numbers and pointers are formatted with their operator<< on
+ * the logging thread, which is slower. */
+class AsyncLogLine {
+public:
+    AsyncLogLine (AsyncLog& log, AsyncLog::Severity severity)
+            : mLog(log), mSlot(log.claim()) {
+        if (mSlot) {
+            mSlot->header.time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::system_clock::now().time_since_epoch()).count();
+            mSlot->header.thread = threadId();
+            mSlot->header.severity = static_cast<uint8_t>(severity);
+        }
+    }
+
+    ~AsyncLogLine () {
+        if (mSlot) {
+            mLog.publish(*mSlot);
+        }
+    }
+
+    AsyncLogLine (const AsyncLogLine&) = delete;
+    AsyncLogLine& operator= (const AsyncLogLine&) = delete;
+
+    AsyncLogLine& operator<< (const char* value) {
+        return putString(value, strlen(value));
+    }
+
+    AsyncLogLine& operator<< (const std::string& value) {
+        return putString(value.data(), value.size());
+    }
+
+    AsyncLogLine& operator<< (char value) {
+        return put(AsyncLog::KIND_CHAR, value);
+    }
+
+    AsyncLogLine& operator<< (bool value) {
+        return put(AsyncLog::KIND_BOOL, value);
+    }
+
+    AsyncLogLine& operator<< (short value) {
+        return put(AsyncLog::KIND_SIGNED, static_cast<long long>(value));
+    }
+
+    AsyncLogLine& operator<< (int value) {
+        return put(AsyncLog::KIND_SIGNED, static_cast<long long>(value));
+    }
+
+    AsyncLogLine& operator<< (long value) {
+        return put(AsyncLog::KIND_SIGNED, static_cast<long long>(value));
+    }
+
+    AsyncLogLine& operator<< (long long value) {
+        return put(AsyncLog::KIND_SIGNED, value);
+    }
+
+    AsyncLogLine& operator<< (unsigned short value) {
+        return put(AsyncLog::KIND_UNSIGNED, static_cast<unsigned long long>(value));
+    }
+
+    AsyncLogLine& operator<< (unsigned value) {
+        return put(AsyncLog::KIND_UNSIGNED, static_cast<unsigned long long>(value));
+    }
+
+    AsyncLogLine& operator<< (unsigned long value) {
+        return put(AsyncLog::KIND_UNSIGNED, static_cast<unsigned long long>(value));
+    }
+
+    AsyncLogLine& operator<< (unsigned long long value) {
+        return put(AsyncLog::KIND_UNSIGNED, value);
+    }
+
+    AsyncLogLine& operator<< (float value) {
+        return put(AsyncLog::KIND_DOUBLE, static_cast<double>(value));
+    }
+
+    AsyncLogLine& operator<< (double value) {
+        return put(AsyncLog::KIND_DOUBLE, value);
+    }
+
+    AsyncLogLine& operator<< (const void* value) {
+        return put(AsyncLog::KIND_POINTER, value);
+    }
+
+    template <typename T>
+    AsyncLogLine& operator<< (const T& value) {
+        if (mSlot) {
+            std::ostringstream formatted;
+            formatted << value;
+            auto s = formatted.str();
+            putString(s.data(), s.size());
+        }
+        return *this;
+    }
+
+private:
+    static uint32_t threadId () {
+        static thread_local uint32_t id = static_cast<uint32_t>(syscall(SYS_gettid));
+        return id;
+    }
+
+    template <typename T>
+    AsyncLogLine& put (AsyncLog::Kind kind, T value) {
+        if (reserve(1 + sizeof(value))) {
+            auto p = mSlot->payload + mSlot->header.length;
+            *p = kind;
+            memcpy(p + 1, &value, sizeof(value));
+            mSlot->header.length += 1 + sizeof(value);
+        }
+        return *this;
+    }
+
+    AsyncLogLine& putString (const char* value, size_t length) {
+        uint16_t header = sizeof(uint16_t) + 1;
+        if (mSlot && mSlot->header.length + header < AsyncLog::kPayloadSize) {
+            auto room = AsyncLog::kPayloadSize - mSlot->header.length - header;
+            if (length > room) {
+                length = room;
+                mSlot->header.truncated = 1;
+            }
+            auto p = mSlot->payload + mSlot->header.length;
+            *p = AsyncLog::KIND_STRING;
+            auto stored = static_cast<uint16_t>(length);
+            memcpy(p + 1, &stored, sizeof(stored));
+            memcpy(p + header, value, length);
+            mSlot->header.length += header + stored;
+        }
+        else if (mSlot) {
+            mSlot->header.truncated = 1;
+        }
+        return *this;
+    }
+
+    bool reserve (size_t size) {
+        if (!mSlot) {
+            return false;
+        }
+        if (mSlot->header.length + size > AsyncLog::kPayloadSize) {
+            mSlot->header.truncated = 1;
+            return false;
+        }
+        return true;
+    }
+
+    AsyncLog& mLog;
+    AsyncLog::Slot* mSlot;
+};
+
+}
+
+/* Like LOG, but through the AsyncLog, e.g.
+ *
+ *   util::AsyncLog::instance().start();
+ *   ...
+ *   ALOG(debug) << "Consumer got msg with size " << size;
+ *
+ * Statements below IPC_LOG_MIN_SEVERITY compile to nothing, as with LOG. */
+#define ALOG(severity) \
+    if (!LOG_ENABLED(severity) || \
+            !::util::AsyncLog::instance().enabled(::boost::log::trivial::severity)) { } \
+    else ::util::AsyncLogLine(::util::AsyncLog::instance(), ::boost::log::trivial::severity)
+
+#endif
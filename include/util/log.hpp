@@ -3,6 +3,24 @@
 
 #include <boost/log/trivial.hpp>
 
-#define LOG BOOST_LOG_TRIVIAL
+/* The least severe level which LOG compiles in, as the name of a
+ * boost::log::trivial::severity_level, e.g., -DIPC_LOG_MIN_SEVERITY=warning.
+ * LOG statements below it compile to nothing, arguments and all, so debug
+ * logging on hot paths costs nothing in release builds. Defaults to info if
+ * NDEBUG is defined, and to trace otherwise. Boost.Log's own filters still
+ * apply to whatever is compiled in. */
+#ifndef IPC_LOG_MIN_SEVERITY
+#ifdef NDEBUG
+#define IPC_LOG_MIN_SEVERITY info
+#else
+#define IPC_LOG_MIN_SEVERITY trace
+#endif
+#endif
+
+#define LOG_ENABLED(severity) \
+    (::boost::log::trivial::severity >= ::boost::log::trivial::IPC_LOG_MIN_SEVERITY)
+
+#define LOG(severity) \
+    if (!LOG_ENABLED(severity)) { } else BOOST_LOG_TRIVIAL(severity)
 
 #endif
@@ -0,0 +1,202 @@
+/* ipcstat: print the traffic counters of the queues on this machine (see
+ * ChannelStats in ipc/channel_control.hpp).
+ *
+ * Usage: ipcstat [-a] [-i seconds] [queue ...]
+ *
+ *   -a  include queues whose consumer has gone, not just live ones
+ *   -i  print again every interval seconds, with message rates since the
+ *       last print, until interrupted
+ *
+ * Without queue names, every queue with a control segment in /dev/shm is
+ * shown. Control segments are mapped read-only, so ipcstat cannot disturb
+ * the queues it watches. */
+
+#include "ipc/channel_control.hpp"
+#include "ipc/common.hpp"
+#include "ipc/shm_segment.hpp"
+
+#include <boost/interprocess/creation_tags.hpp>
+#include <boost/interprocess/exceptions.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <dirent.h>
+#include <unistd.h>
+
+namespace {
+
+struct Sample {
+    const char* state;
+    uint32_t pid;
+    uint64_t capacity;
+    uint64_t messageSize;
+    uint64_t depth;
+    uint64_t highWaterMark;
+    uint64_t sent;
+    uint64_t bytesSent;
+    uint64_t received;
+    uint64_t lost;
+    uint64_t dropped;
+    uint64_t fullQueueEvents;
+    uint64_t blockedNanoseconds;
+    uint64_t consumerStarts;
+};
+
+/* Queue names, from the control segments in /dev/shm. */
+std::vector<std::string> findQueues () {
+    std::vector<std::string> names;
+    std::string suffix = IPC_CONTROL_SUFFIX;
+    if (auto dir = opendir("/dev/shm")) {
+        while (auto entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name.size() > suffix.size() &&
+                    !name.compare(name.size() - suffix.size(), suffix.size(), suffix)) {
+                names.push_back(name.substr(0, name.size() - suffix.size()));
+            }
+        }
+        closedir(dir);
+    }
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+bool readSample (const std::string& name, Sample& sample) {
+    using namespace boost::interprocess;
+    auto segmentName = name + IPC_CONTROL_SUFFIX;
+    ipc::ShmSegment segment;
+    try {
+        ipc::ShmSegment readOnly { open_read_only, segmentName.c_str() };
+        std::swap(segment, readOnly);
+    }
+    catch (interprocess_exception& exc) {
+        return false;
+    }
+    if (segment.size() < sizeof(ipc::ChannelControlBlock)) {
+        return false;
+    }
+
+    auto& block = *static_cast<const ipc::ChannelControlBlock*>(segment.address());
+    auto& stats = block.stats;
+    auto relaxed = std::memory_order_relaxed;
+    auto epoch = block.consumerEpoch.load(relaxed);
+    sample.pid = block.consumerPid.load(relaxed);
+    sample.state = !(epoch & 1) ? "none" : ipc::processAlive(sample.pid) ? "live" : "dead";
+    sample.capacity = stats.capacity.load(relaxed);
+    sample.messageSize = stats.messageSize.load(relaxed);
+    sample.depth = ipc::depth(block);
+    sample.highWaterMark = stats.highWaterMark.load(relaxed);
+    sample.sent = stats.messagesSent.load(relaxed);
+    sample.bytesSent = stats.bytesSent.load(relaxed);
+    sample.received = stats.messagesReceived.load(relaxed);
+    sample.lost = stats.messagesLost.load(relaxed);
+    sample.dropped = block.droppedMessages.load(relaxed);
+    sample.fullQueueEvents = stats.fullQueueEvents.load(relaxed);
+    sample.blockedNanoseconds = stats.blockedNanoseconds.load(relaxed);
+    sample.consumerStarts = stats.consumerStarts.load(relaxed);
+    return true;
+}
+
+void printHeader (int width, bool rates) {
+    printf("%-*s %-5s %7s %8s %6s %8s %8s %12s %12s %10s %8s %8s %8s %10s %6s",
+            width, "QUEUE", "STATE", "PID", "CAPACITY", "SIZE", "DEPTH", "HWM", "SENT",
+            "RECEIVED", "SENT_MB", "LOST", "DROPPED", "FULL", "BLOCKED_MS", "STARTS");
+    if (rates) {
+        printf(" %10s %10s", "SENT/S", "RECV/S");
+    }
+    printf("\n");
+}
+
+void printSample (int width, const std::string& name, const Sample& sample,
+        const Sample* previous, double seconds) {
+    printf("%-*s %-5s %7u %8llu %6llu %8llu %8llu %12llu %12llu %10.1f %8llu %8llu %8llu %10.1f %6llu",
+            width, name.c_str(), sample.state, sample.pid,
+            (unsigned long long)sample.capacity, (unsigned long long)sample.messageSize,
+            (unsigned long long)sample.depth, (unsigned long long)sample.highWaterMark,
+            (unsigned long long)sample.sent, (unsigned long long)sample.received,
+            sample.bytesSent / 1e6, (unsigned long long)sample.lost,
+            (unsigned long long)sample.dropped, (unsigned long long)sample.fullQueueEvents,
+            sample.blockedNanoseconds / 1e6, (unsigned long long)sample.consumerStarts);
+    if (seconds > 0) {
+        if (previous) {
+            printf(" %10.0f %10.0f", (sample.sent - previous->sent) / seconds,
+                    (sample.received - previous->received) / seconds);
+        }
+        else {
+            printf(" %10s %10s", "-", "-");
+        }
+    }
+    printf("\n");
+}
+
+void usage (const char* argv0) {
+    fprintf(stderr, "Usage: %s [-a] [-i seconds] [queue ...]\n", argv0);
+    exit(2);
+}
+
+}
+
+int main (int argc, char** argv) {
+    bool all = false;
+    double interval = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "ai:")) != -1) {
+        switch (opt) {
+            case 'a':
+                all = true;
+                break;
+            case 'i':
+                interval = atof(optarg);
+                if (interval <= 0) {
+                    usage(argv[0]);
+                }
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    std::vector<std::string> named { argv + optind, argv + argc };
+
+    std::map<std::string, Sample> previous;
+    auto lastTime = std::chrono::steady_clock::now();
+    while (true) {
+        auto names = named.empty() ? findQueues() : named;
+        auto now = std::chrono::steady_clock::now();
+        double seconds = interval > 0 && !previous.empty()
+            ? std::chrono::duration<double>(now - lastTime).count() : 0;
+
+        std::map<std::string, Sample> samples;
+        int width = 5;
+        for (auto& name : names) {
+            Sample sample;
+            if (readSample(name, sample) && (all || !named.empty() || !strcmp(sample.state, "live"))) {
+                samples[name] = sample;
+                width = std::max(width, int(name.size()));
+            }
+        }
+
+        printHeader(width, interval > 0);
+        for (auto& entry : samples) {
+            auto it = previous.find(entry.first);
+            printSample(width, entry.first, entry.second,
+                    it == previous.end() ? nullptr : &it->second, interval > 0 ? std::max(seconds, 1e-9) : 0);
+        }
+        fflush(stdout);
+
+        if (interval <= 0) {
+            return 0;
+        }
+        previous = samples;
+        lastTime = now;
+        std::this_thread::sleep_for(std::chrono::duration<double>(interval));
+        printf("\n");
+    }
+}
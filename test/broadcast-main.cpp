@@ -0,0 +1,169 @@
+/* Check that subscribers sharing a process with each other and with the
+ * publisher get cursors of their own, and that the cursor of a subscriber
+ * process which dies without detaching is freed, whatever the channel's
+ * policy.
+ *
+ * Usage: test-broadcast
+ *
+ * Exits non-zero, saying why, on failure. */
+
+#include "ipc/broadcast.hpp"
+
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+
+#include <chrono>
+#include <string>
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+namespace {
+
+const char* kChannel = "ipc-test-broadcast";
+
+/* Read count messages from subscriber, expecting first, first + 1, .... */
+void expectMessages (ipc::Subscriber<long>& subscriber, long first, long count) {
+    long expected = first;
+    auto received = subscriber.drain([&] (const long& msg) {
+        CHECK(msg == expected);
+        ++expected;
+    });
+    CHECK(received == size_t(count));
+}
+
+void testSameProcess () {
+    ipc::Publisher<long> publisher { kChannel, 8 };
+    ipc::Subscriber<long> a { kChannel };
+    ipc::Subscriber<long> b { kChannel };
+    CHECK(publisher.subscribers() == 2);
+
+    /* Each subscriber has its own cursor, so each sees every message, and
+     * the publisher waits for the slower of them. */
+    for (long i = 0; i < 4; ++i) {
+        publisher.publish(i);
+    }
+    expectMessages(a, 0, 4);
+    for (long i = 4; i < 8; ++i) {
+        publisher.publish(i);
+    }
+    expectMessages(b, 0, 8);
+    expectMessages(a, 4, 4);
+
+    /* Asking after the publisher must not disturb it. */
+    CHECK(a.publisherPresent());
+    CHECK(b.publisherPresent());
+
+    {
+        ipc::Subscriber<long> c { kChannel };
+        CHECK(publisher.subscribers() == 3);
+        publisher.publish(8);
+        expectMessages(c, 8, 1);
+    }
+    CHECK(publisher.subscribers() == 2);
+    expectMessages(a, 8, 1);
+    expectMessages(b, 8, 1);
+}
+
+void testDeadSubscriber () {
+    ipc::Publisher<long> publisher { kChannel, 8 };
+    auto pid = fork();
+    CHECK(pid >= 0);
+    if (!pid) {
+        /* Attach, and die without detaching. */
+        new ipc::Subscriber<long> { kChannel };
+        _exit(0);
+    }
+    int status = 0;
+    CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status));
+    CHECK(publisher.subscribers() == 1);
+
+    /* The dead subscriber holds the ring full until the publisher notices. */
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < 16; ++i) {
+        publisher.publish(i);
+    }
+    CHECK(publisher.subscribers() == 0);
+    CHECK(std::chrono::steady_clock::now() - start < 10 * ipc::stallCheckInterval());
+}
+
+/* A lapping publisher never waits, so never drops dead subscribers; new
+ * subscribers must take over their cursors. */
+void testDeadSubscribersLap () {
+    const auto kMax = ipc::detail::BroadcastHeader::kMaxSubscribers;
+    ipc::Publisher<long> publisher { kChannel, 8, ipc::SLOW_SUBSCRIBER_LAP };
+
+    /* Use up every cursor, then die without detaching. */
+    int ready[2];
+    CHECK(!pipe(ready));
+    pid_t pids[kMax];
+    for (size_t i = 0; i < kMax; ++i) {
+        pids[i] = fork();
+        CHECK(pids[i] >= 0);
+        if (!pids[i]) {
+            new ipc::Subscriber<long> { kChannel };
+            CHECK(write(ready[1], "x", 1) == 1);
+            pause();
+            _exit(0);
+        }
+    }
+    for (size_t i = 0; i < kMax; ++i) {
+        char c;
+        CHECK(read(ready[0], &c, 1) == 1);
+    }
+    close(ready[0]);
+    close(ready[1]);
+    CHECK(publisher.subscribers() == kMax);
+
+    bool full = false;
+    try {
+        ipc::Subscriber<long> extra { kChannel };
+    }
+    catch (ipc::QueueError& exc) {
+        full = true;
+    }
+    CHECK(full);
+
+    for (size_t i = 0; i < kMax; ++i) {
+        CHECK(!kill(pids[i], SIGKILL));
+        CHECK(waitpid(pids[i], nullptr, 0) == pids[i]);
+    }
+
+    ipc::Subscriber<long> a { kChannel };
+    ipc::Subscriber<long> b { kChannel };
+    for (long i = 0; i < 4; ++i) {
+        publisher.publish(i);
+    }
+    expectMessages(a, 0, 4);
+    expectMessages(b, 0, 4);
+}
+
+}
+
+int main () {
+    boost::log::core::get()->set_filter(
+            boost::log::trivial::severity >= boost::log::trivial::error);
+
+    try {
+        testSameProcess();
+        testDeadSubscriber();
+        testDeadSubscribersLap();
+    }
+    catch (ipc::QueueError& exc) {
+        fprintf(stderr, "QueueError: %s\n", exc.what());
+        return 1;
+    }
+    printf("ok\n");
+}
@@ -0,0 +1,113 @@
+/* Check that recovering a journal keeps messages which were never synced,
+ * but are intact, after the reader has moved past the last sync and deleted
+ * the segments before it; and that a writer which sends rarely still syncs
+ * once its commit interval has passed.
+ *
+ * Usage: test-journal
+ *
+ * Exits non-zero, saying why, on failure. */
+
+#include "ipc/journal.hpp"
+
+#include <boost/filesystem.hpp>
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+namespace {
+
+const std::string kDirectory = "/tmp/ipc-test-journal";
+
+/* Never sync on our own. */
+const std::chrono::hours kCommitInterval { 1 };
+
+const size_t kSegmentCapacity = 4;
+
+/* Read count messages, expecting first, first + 1, .... */
+void expectMessages (ipc::JournalReader<long>& reader, long first, long count) {
+    for (long i = first; i < first + count; ++i) {
+        CHECK(reader.tryReceiveAndProcess([&] (const long& msg) { CHECK(msg == i); }));
+    }
+}
+
+void testRecoveryPastReader () {
+    boost::filesystem::remove_all(kDirectory);
+
+    /* A writer which dies without syncing anything. */
+    auto pid = fork();
+    CHECK(pid >= 0);
+    if (!pid) {
+        ipc::JournalWriter<long> writer { kDirectory, kCommitInterval, kSegmentCapacity };
+        for (long i = 0; i < 10; ++i) {
+            writer.send(i);
+        }
+        _exit(0);
+    }
+    int status = 0;
+    CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && !WEXITSTATUS(status));
+
+    /* Read into the second segment, which deletes the first. */
+    {
+        ipc::JournalReader<long> reader { kDirectory, kCommitInterval };
+        expectMessages(reader, 0, 6);
+    }
+
+    /* The next writer repairs the journal, which must keep 6 to 9. */
+    {
+        ipc::JournalWriter<long> writer { kDirectory, kCommitInterval };
+        CHECK(writer.position() == 10);
+        writer.send(10);
+    }
+    ipc::JournalReader<long> reader { kDirectory, kCommitInterval };
+    expectMessages(reader, 6, 5);
+    CHECK(!reader.backlog());
+
+    boost::filesystem::remove_all(kDirectory);
+}
+
+/* A send after the commit interval syncs, however few sends came before. */
+void testLoneSendSyncs () {
+    boost::filesystem::remove_all(kDirectory);
+    {
+        ipc::JournalWriter<long> writer { kDirectory, std::chrono::milliseconds(10) };
+        writer.send(0);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        writer.send(1);
+        CHECK(writer.durablePosition() == 2);
+    }
+    boost::filesystem::remove_all(kDirectory);
+}
+
+}
+
+int main () {
+    boost::log::core::get()->set_filter(
+            boost::log::trivial::severity >= boost::log::trivial::error);
+
+    try {
+        testRecoveryPastReader();
+        testLoneSendSyncs();
+    }
+    catch (ipc::QueueError& exc) {
+        fprintf(stderr, "QueueError: %s\n", exc.what());
+        return 1;
+    }
+    printf("ok\n");
+}
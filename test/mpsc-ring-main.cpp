@@ -0,0 +1,114 @@
+/* Check that the smallest MPSC ring still delivers every message once, in
+ * order, and that an overwriting send discards no more than it must.
+ *
+ * Usage: test-mpsc-ring
+ *
+ * Exits non-zero, saying why, on failure. */
+
+#include "ipc/mpsc_ring_transport.hpp"
+
+#include <boost/interprocess/creation_tags.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include <cstdio>
+#include <cstdlib>
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+namespace {
+
+const char* kQueue = "ipc-test-mpsc-ring";
+
+using Ring = ipc::MpscRingTransport<long>;
+
+void testCapacityOne () {
+    Ring::remove(kQueue);
+    Ring ring { boost::interprocess::create_only, kQueue, 1 };
+    ipc::EventCount consumerEvents;
+    auto stalled = [] () { CHECK(!"send stalled"); };
+
+    CHECK(ring.capacity() >= 2);
+    for (long round = 0; round < 4; ++round) {
+        auto first = round * 2;
+        ring.send(first, consumerEvents, stalled);
+        CHECK(ring.trySend(first + 1, consumerEvents));
+        CHECK(!ring.trySend(-1, consumerEvents));
+
+        for (long i = first; i < first + 2; ++i) {
+            long received = -1;
+            CHECK(ring.tryConsume([&] (const long& msg) { received = msg; }));
+            CHECK(received == i);
+        }
+        CHECK(!ring.tryConsume([] (const long&) { CHECK(!"queue should be empty"); }));
+    }
+    Ring::remove(kQueue);
+}
+
+/* While the consumer is still handling the message in the slot an
+ * overwriting send needs, the send must wait for it, not discard the rest of
+ * the queue. */
+void testOverwriteInFlight () {
+    Ring::remove(kQueue);
+    Ring ring { boost::interprocess::create_only, kQueue, 4 };
+    ipc::EventCount consumerEvents;
+    auto stalled = [] () { };
+
+    for (long i = 0; i < 4; ++i) {
+        CHECK(ring.trySend(i, consumerEvents));
+    }
+
+    std::atomic<bool> handling { false };
+    std::atomic<bool> done { false };
+    std::thread consumer { [&] () {
+        CHECK(ring.tryConsume([&] (const long& msg) {
+            CHECK(msg == 0);
+            handling = true;
+            while (!done) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }));
+    } };
+    while (!handling) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    size_t discarded = 1;
+    std::thread producer { [&] () {
+        discarded = ring.sendOverwriting(4, consumerEvents, stalled);
+    } };
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    done = true;
+    consumer.join();
+    producer.join();
+
+    CHECK(discarded == 0);
+    for (long i = 1; i < 5; ++i) {
+        long received = -1;
+        CHECK(ring.tryConsume([&] (const long& msg) { received = msg; }));
+        CHECK(received == i);
+    }
+    Ring::remove(kQueue);
+}
+
+}
+
+int main () {
+    try {
+        testCapacityOne();
+        testOverwriteInFlight();
+    }
+    catch (ipc::QueueError& exc) {
+        fprintf(stderr, "QueueError: %s\n", exc.what());
+        return 1;
+    }
+    printf("ok\n");
+}
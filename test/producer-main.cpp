@@ -0,0 +1,81 @@
+/* Check that a producer notices a consumer process which dies without
+ * detaching, while the queue still has room.
+ *
+ * Usage: test-producer
+ *
+ * Exits non-zero, saying why, on failure. */
+
+#include "ipc/consumer.hpp"
+#include "ipc/producer.hpp"
+
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+
+#include <chrono>
+#include <thread>
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+namespace {
+
+const char* kQueue = "ipc-test-producer";
+
+void testDeadConsumer () {
+    ipc::Producer<int> producer { kQueue };
+    auto pid = fork();
+    CHECK(pid >= 0);
+    if (!pid) {
+        ipc::Consumer<int> consumer { kQueue };
+        pause();
+        _exit(0);
+    }
+    CHECK(producer.waitForConsumer(std::chrono::seconds(10)));
+    producer.send(0);
+
+    /* A zombie is still running as far as kill is concerned, so reap it. */
+    CHECK(!kill(pid, SIGKILL));
+    CHECK(waitpid(pid, nullptr, 0) == pid);
+
+    /* Far fewer messages than the queue holds. */
+    auto deadline = std::chrono::steady_clock::now() + 10 * ipc::stallCheckInterval();
+    bool noticed = false;
+    for (int i = 1; !noticed && std::chrono::steady_clock::now() < deadline; ++i) {
+        try {
+            producer.send(i);
+        }
+        catch (ipc::NoConsumer& exc) {
+            noticed = true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    CHECK(noticed);
+}
+
+}
+
+int main () {
+    boost::log::core::get()->set_filter(
+            boost::log::trivial::severity >= boost::log::trivial::error);
+
+    try {
+        testDeadConsumer();
+    }
+    catch (ipc::QueueError& exc) {
+        fprintf(stderr, "QueueError: %s\n", exc.what());
+        return 1;
+    }
+    printf("ok\n");
+}
@@ -0,0 +1,91 @@
+/* Check that an RPC server drops a late reply to a call from a client which
+ * held the caller's record before it, rather than overwriting the caller's
+ * response.
+ *
+ * Usage: test-rpc
+ *
+ * Exits non-zero, saying why, on failure. */
+
+#include "ipc/rpc.hpp"
+
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+
+#include <chrono>
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+namespace {
+
+const char* kServer = "ipc-test-rpc";
+
+/* Answer count calls by negating them. */
+void runServer (int count) {
+    ipc::RpcServer<long, long> server { kServer, 16, 1, 1 };
+    for (int i = 0; i < count; ++i) {
+        CHECK(server.timedReceiveAndProcess(std::chrono::seconds(10),
+                    [] (const long& request) { return -request; }));
+    }
+}
+
+void testStaleReply () {
+    auto server = fork();
+    CHECK(server >= 0);
+    if (!server) {
+        runServer(2);
+        _exit(0);
+    }
+
+    ipc::RpcClient<long, long> client { kServer, std::chrono::seconds(10) };
+    auto future = client.call(1);
+    CHECK(future.waitFor(std::chrono::seconds(10)));
+
+    /* A call the first client to hold our record made before it crashed,
+     * sent from a process of its own, as producers must be. */
+    auto pid = fork();
+    CHECK(pid >= 0);
+    if (!pid) {
+        ipc::SharedProducer<ipc::RpcRequest<long>, ipc::MpscRingTransport> producer { kServer };
+        CHECK(producer.waitForConsumer(std::chrono::seconds(10)));
+        ipc::RpcRequest<long> stale {};
+        stale.id = 1;
+        stale.request = 2;
+        producer.send(stale);
+        _exit(0);
+    }
+    int status = 0;
+    CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && !WEXITSTATUS(status));
+
+    /* Once the server has answered both, our response must be intact. */
+    CHECK(waitpid(server, &status, 0) == server && WIFEXITED(status) && !WEXITSTATUS(status));
+    CHECK(future.ready());
+    CHECK(future.get() == -1);
+}
+
+}
+
+int main () {
+    boost::log::core::get()->set_filter(
+            boost::log::trivial::severity >= boost::log::trivial::error);
+
+    try {
+        testStaleReply();
+    }
+    catch (ipc::QueueError& exc) {
+        fprintf(stderr, "QueueError: %s\n", exc.what());
+        return 1;
+    }
+    printf("ok\n");
+}